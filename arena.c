@@ -0,0 +1,65 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "global.h"
+#include "arena.h"
+
+void arena_alloc(Arena *arena, size_t block_size)
+{
+  arena->blocks = NULL;
+  arena->sizes = NULL;
+  arena->nblocks = arena->cap_blocks = 0;
+  arena->block_size = block_size;
+  arena->cur = arena->used = 0;
+}
+
+void arena_dealloc(Arena *arena)
+{
+  size_t i;
+  for(i = 0; i < arena->nblocks; i++) free(arena->blocks[i]);
+  free(arena->blocks);
+  free(arena->sizes);
+}
+
+// Move to the next block, which must hold at least size bytes
+static void arena_next_block(Arena *arena, size_t size)
+{
+  if(arena->nblocks > 0) arena->cur++;
+
+  if(arena->cur == arena->nblocks) {
+    if(arena->nblocks == arena->cap_blocks) {
+      arena->cap_blocks = arena->cap_blocks ? arena->cap_blocks * 2 : 8;
+      arena->blocks = realloc(arena->blocks, arena->cap_blocks * sizeof(char*));
+      arena->sizes = realloc(arena->sizes, arena->cap_blocks * sizeof(size_t));
+      if(arena->blocks == NULL || arena->sizes == NULL) die("Out of memory");
+    }
+    arena->blocks[arena->nblocks] = NULL;
+    arena->sizes[arena->nblocks] = 0;
+    arena->nblocks++;
+  }
+
+  if(arena->sizes[arena->cur] < size) {
+    free(arena->blocks[arena->cur]);
+    arena->sizes[arena->cur] = MAX2(arena->block_size, size);
+    arena->blocks[arena->cur] = malloc(arena->sizes[arena->cur]);
+    if(arena->blocks[arena->cur] == NULL) die("Out of memory");
+  }
+
+  arena->used = 0;
+}
+
+void* arena_malloc(Arena *arena, size_t size)
+{
+  void *ptr;
+  size = (size + 7) & ~(size_t)7;
+  if(arena->nblocks == 0 || arena->used + size > arena->sizes[arena->cur])
+    arena_next_block(arena, size);
+  ptr = arena->blocks[arena->cur] + arena->used;
+  arena->used += size;
+  return ptr;
+}
+
+void arena_reset(Arena *arena)
+{
+  arena->cur = arena->used = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+// Bump allocator for memory that is all freed at once. Blocks are kept on
+// arena_reset(), so once it has grown to the largest working set it makes no
+// more calls to malloc.
+
+typedef struct {
+  char **blocks;
+  size_t *sizes; // size of each block
+  size_t nblocks, cap_blocks;
+  size_t block_size; // default size of a new block
+  size_t cur, used; // current block and bytes used in it
+} Arena;
+
+void arena_alloc(Arena *arena, size_t block_size);
+void arena_dealloc(Arena *arena);
+
+// Returns 8 byte aligned memory, valid until arena_reset()
+void* arena_malloc(Arena *arena, size_t size);
+
+// Free everything, in O(1)
+void arena_reset(Arena *arena);
+
+#endif /* ARENA_H_ */
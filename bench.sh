@@ -0,0 +1,63 @@
+#!/bin/bash
+# Time vcfref, vcfcombine and vcfcombo on generated data. Called by
+# `make bench`. Settings are taken from the environment, e.g.
+#   BENCH_ENTRIES=500000 BENCH_SAMPLES=100 BENCH_GZ=1 make bench
+# Results are printed and appended to $BENCH_DIR/results.tsv, one tab
+# separated line per run, with the commit so runs can be compared.
+
+set -eo pipefail
+
+BENCH_DIR=${BENCH_DIR:-bench}
+BENCH_SEED=${BENCH_SEED:-1}
+BENCH_CONTIGS=${BENCH_CONTIGS:-4}
+BENCH_LENGTH=${BENCH_LENGTH:-10000000}
+BENCH_ENTRIES=${BENCH_ENTRIES:-250000} # per contig
+BENCH_INDELS=${BENCH_INDELS:-0.2}
+BENCH_MULTI=${BENCH_MULTI:-0.05}
+BENCH_CLUSTERS=${BENCH_CLUSTERS:-0.3}
+BENCH_SAMPLES=${BENCH_SAMPLES:-1}
+BENCH_GZ=${BENCH_GZ:-0} # 1 for BGZF input
+BENCH_OVERLAP=${BENCH_OVERLAP:-10}
+BENCH_THREADS=${BENCH_THREADS:-1}
+
+mkdir -p $BENCH_DIR
+log=$BENCH_DIR/bench.log
+results=$BENCH_DIR/results.tsv
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+# Same settings give the same files, so only generate them once
+name="s${BENCH_SEED}_c${BENCH_CONTIGS}_l${BENCH_LENGTH}_n${BENCH_ENTRIES}"
+name+="_i${BENCH_INDELS}_m${BENCH_MULTI}_d${BENCH_CLUSTERS}_S${BENCH_SAMPLES}"
+ref=$BENCH_DIR/$name.fa
+calls=$BENCH_DIR/$name.vcf
+[ "$BENCH_GZ" == 1 ] && calls+=.gz
+
+if [ ! -e $calls ]; then
+  echo "Generating $calls" >&2
+  ./bin/vcfbench gen -r $BENCH_SEED -C $BENCH_CONTIGS -L $BENCH_LENGTH \
+    -n $BENCH_ENTRIES -i $BENCH_INDELS -M $BENCH_MULTI -d $BENCH_CLUSTERS \
+    -S $BENCH_SAMPLES $ref $calls 2>>$log
+fi
+
+if [ ! -e $results ]; then
+  printf 'commit\tthreads\tname\tentries\tbytes\tsecs\tcpu_secs\t' > $results
+  printf 'entries_per_sec\tmb_per_sec\tmax_rss_kb\n' >> $results
+fi
+
+run() {
+  ./bin/vcfbench time "$@" 2>>$log | \
+    sed "s/^/$commit\t$BENCH_THREADS\t/" | tee -a $results
+}
+
+# vcfcombine and vcfcombo read the vcfref output, as they would in practice
+fixed=$BENCH_DIR/$name.ref.vcf
+[ "$BENCH_GZ" == 1 ] && fixed+=.gz
+t=$BENCH_THREADS k=$BENCH_OVERLAP
+
+run vcfref $calls ./bin/vcfref -t $t -s -o $fixed $calls $ref
+run vcfcombine $fixed ./bin/vcfcombine -t $t $k $fixed $ref
+run vcfcombo $fixed ./bin/vcfcombo -t $t $k $fixed $ref
+if [ "$BENCH_SAMPLES" -gt 1 ]; then
+  run vcfcombine-gt $fixed ./bin/vcfcombine -g -t $t $k $fixed $ref
+  run vcfcombo-gt $fixed ./bin/vcfcombo -g -t $t $k $fixed $ref
+fi
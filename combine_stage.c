@@ -0,0 +1,463 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+
+#include "global.h"
+#include "vcf_record.h"
+#include "vcf_stage.h"
+#include "string_buffer.h"
+#include "genotypes.h"
+#include "contig_ids.h"
+
+// A cluster of overlapping entries is kept as the sites columns of its first
+// entry plus a list of alt alleles, and only written out when it closes. An
+// allele from an entry at offset o with REF length l becomes
+// ref[0..o) + allele + ref[o+l..reflen) of the merged REF, so adding an entry
+// costs only the length of its ALT column however long the cluster gets.
+// With genotypes, each entry's GT calls are kept in a GtMatrix and mapped to
+// the merged alleles when the cluster is written.
+// Without genotypes, a BCF record that starts a cluster is held as it is, and
+// only formatted as text if a second entry joins it. Lone entries, most of
+// them, are passed on without being unpacked.
+typedef struct {
+  size_t id; // index in the order alleles were added
+  size_t offset, len; // allele is altbuf[offset..offset+len)
+  size_t start, end; // its entry covers [start,end) of the merged REF
+  size_t merged; // offset of the merged allele in allelebuf
+  const char *str; // merged allele, set when the cluster is written
+} CombineAlt;
+
+typedef struct {
+  Genome *genome;
+  int overlap;
+  StrBuf line; // first entry of the cluster, only columns up to FORMAT
+  VcfRecord rec; // points into line
+  size_t reflen, nentries; // merged REF length, entries in the cluster
+  const PackedRef *ref; // reference of the cluster once it has 2+ entries
+  StrBuf altbuf; // alleles of all entries, one after another
+  CombineAlt *alts;
+  size_t nalts, cap_alts;
+  StrBuf refbuf, allelebuf, out;
+  GenomeCursor cursor;
+  ContigIds contigs;
+  int chrom; // contig id of the cluster
+  bcf1_t *first; // BCF first entry, while it is alone in the cluster
+  char pending; // set while the cluster is just first, rec has only its pos
+  kstring_t ks; // first formatted as text
+  char genotypes;
+  GtMatrix gm; // one row per entry
+  size_t *first_alt; // index of the first alt of each entry, then nalts
+  size_t *merged; // allele number in the output of each alt, by id
+  size_t cap_rows, cap_merged;
+} Combiner;
+
+// Add an allele of an entry covering [start,end) of the merged REF
+static void combine_add_alt(Combiner *cb, const char *str, size_t len,
+                            size_t start, size_t end)
+{
+  if(cb->nalts == cb->cap_alts) {
+    cb->cap_alts *= 2;
+    cb->alts = realloc(cb->alts, cb->cap_alts * sizeof(CombineAlt));
+    if(cb->alts == NULL) die("Out of memory");
+  }
+  cb->alts[cb->nalts] = (CombineAlt){.id = cb->nalts,
+                                     .offset = cb->altbuf.end,
+                                     .len = len, .start = start, .end = end};
+  cb->nalts++;
+  strbuf_append_strn(&cb->altbuf, str, len);
+}
+
+// Add each allele of rec to the cluster, and its genotypes if we keep them.
+// Reading the genotypes may move rec's line, so it comes last.
+static void combine_add(VcfStage *stage, Combiner *cb, const VcfRecord *rec)
+{
+  const char *str = vcfrecord_col(rec, VALT), *comma;
+  const char *end = str + vcfrecord_collen(rec, VALT);
+  size_t start = rec->pos - cb->rec.pos;
+  size_t len = start + vcfrecord_collen(rec, VREF);
+
+  do {
+    if((comma = memchr(str, ',', end - str)) == NULL) comma = end;
+    combine_add_alt(cb, str, comma - str, start, len);
+    str = comma + 1;
+  } while(comma < end);
+
+  cb->reflen = MAX2(cb->reflen, len);
+  cb->nentries++;
+
+  if(cb->genotypes) {
+    if(cb->nentries + 1 > cb->cap_rows) {
+      cb->cap_rows *= 2;
+      cb->first_alt = realloc(cb->first_alt, cb->cap_rows * sizeof(size_t));
+      if(cb->first_alt == NULL) die("Out of memory");
+    }
+    cb->first_alt[cb->nentries] = cb->nalts;
+    gtmatrix_add(&cb->gm, rec, stage->samples);
+  }
+}
+
+// As combine_add() for a BCF record unpacked as far as its alleles. No ALT
+// is "." in text, so it is added as that.
+static void combine_add_bcf(Combiner *cb, const bcf1_t *rec)
+{
+  size_t start = rec->pos - cb->rec.pos;
+  size_t len = start + strlen(rec->d.allele[0]);
+  int i;
+
+  if(rec->n_allele < 2) combine_add_alt(cb, ".", 1, start, len);
+  for(i = 1; i < rec->n_allele; i++)
+    combine_add_alt(cb, rec->d.allele[i], strlen(rec->d.allele[i]),
+                    start, len);
+
+  cb->reflen = MAX2(cb->reflen, len);
+  cb->nentries++;
+}
+
+// Next line becomes the first entry of a new cluster
+static void combine_start(VcfStage *stage, Combiner *cb,
+                          const VcfRecord *nrec)
+{
+  strbuf_reset(&cb->altbuf);
+  cb->nalts = cb->nentries = 0;
+  cb->ref = NULL;
+  cb->pending = 0;
+  if(cb->genotypes) gtmatrix_reset(&cb->gm, stage->nsamples);
+
+  cb->rec = *nrec;
+  vcfrecord_copy_sites(&cb->rec, &cb->line);
+  cb->reflen = vcfrecord_collen(&cb->rec, VREF);
+  combine_add(stage, cb, nrec);
+}
+
+// Next BCF record becomes the first entry of a new cluster. Until another
+// joins it, its extent is rlen, which is the REF length unless INFO/END
+// says otherwise.
+static void combine_start_bcf(Combiner *cb, bcf1_t *nrec)
+{
+  if(bcf_copy(cb->first, nrec) == NULL) die("Out of memory");
+  cb->pending = 1;
+  cb->nentries = 1;
+  cb->rec.pos = nrec->pos;
+  cb->reflen = nrec->rlen;
+}
+
+// A second entry joins the cluster, so its first entry is needed as text
+static void combine_unpend(VcfStage *stage, Combiner *cb)
+{
+  VcfRecord rec;
+  vcfrecord_format_bcf(stage->hdr, cb->first, 1, &cb->ks);
+  vcfrecord_parse(&rec, cb->ks.s, cb->ks.l);
+  combine_start(stage, cb, &rec);
+}
+
+// Genotype of each sample with alleles renumbered to the merged entry. A
+// call is missing if it is missing in any entry or if more than one entry
+// puts an alt allele on it.
+static void combine_print_genotypes(Combiner *cb, StrBuf *out)
+{
+  const GtMatrix *gm = &cb->gm;
+  size_t s, e, c, nalts;
+  int a, calls[2];
+  char haploid, phased;
+
+  strbuf_append_str(out, "\tGT");
+  for(s = 0; s < gm->nsamples; s++) {
+    calls[0] = calls[1] = 0;
+    haploid = phased = 1;
+    for(e = 0; e < cb->nentries; e++) {
+      haploid &= gtmatrix_haploid(gm, e, s);
+      phased &= gtmatrix_phased(gm, e, s);
+      nalts = cb->first_alt[e+1] - cb->first_alt[e];
+      for(c = 0; c < 2; c++) {
+        a = gtmatrix_call(gm, e, s, c);
+        if(a == 0 || calls[c] == GT_MISSING) continue;
+        if(a == GT_MISSING || (size_t)a > nalts || calls[c] != 0)
+          calls[c] = GT_MISSING;
+        else calls[c] = cb->merged[cb->first_alt[e] + a - 1];
+      }
+    }
+    strbuf_append_char(out, '\t');
+    gt_append(out, calls[0], calls[1], haploid, phased);
+  }
+}
+
+static int altcmp(const void *a, const void *b)
+{
+  const char *s0 = ((const CombineAlt*)a)->str;
+  const char *s1 = ((const CombineAlt*)b)->str;
+  int cmp = strcasecmp(s0, s1);
+  return cmp != 0 ? cmp : strcmp(s0, s1);
+}
+
+// Write the merged entry: REF of the first entry extended to cover the
+// cluster, then the sorted distinct merged alleles
+// VCF: CHROM-POS-ID-REF-ALT-QUAL-FILTER-INFO-FORMAT[-SAMPLE0...] '-' is '\t'
+static void combine_print(VcfStage *stage, Combiner *cb)
+{
+  const VcfRecord *rec = &cb->rec;
+  const CombineAlt *alt;
+  const char *ref;
+  size_t i, num, reflen0 = vcfrecord_collen(rec, VREF);
+
+  stats_cluster(cb->nentries);
+
+  if(cb->pending) {
+    vcfstage_emit_bcf(stage, cb->first, 1);
+    return;
+  }
+
+  // A lone entry is passed on as it is, with its columns
+  if(cb->nentries == 1 && (!cb->genotypes || cb->gm.nsamples == 0)) {
+    LineSpan line = {.b = cb->line.b, .len = cb->line.end};
+    vcfstage_emit_rec(stage, &line, &cb->rec);
+    return;
+  }
+  if(cb->nentries == 1) {
+    strbuf_reset(&cb->out);
+    strbuf_append_strn(&cb->out, rec->line, rec->cols[VFRMT]-1);
+    gtmatrix_print_row(&cb->gm, 0, &cb->out);
+    vcfstage_emit(stage, cb->out.b, cb->out.end);
+    return;
+  }
+
+  // Upper case ref bases spanned by the merged entry
+  strbuf_reset(&cb->refbuf);
+  packedref_append(cb->ref, rec->pos, cb->reflen, &cb->refbuf);
+  ref = cb->refbuf.b;
+
+  // Build each merged allele, NUL terminated
+  strbuf_reset(&cb->allelebuf);
+  for(i = 0; i < cb->nalts; i++) {
+    alt = &cb->alts[i];
+    cb->alts[i].merged = cb->allelebuf.end;
+    strbuf_append_strn(&cb->allelebuf, ref, alt->start);
+    strbuf_append_strn(&cb->allelebuf, cb->altbuf.b + alt->offset, alt->len);
+    strbuf_append_strn(&cb->allelebuf, ref + alt->end, cb->reflen - alt->end);
+    strbuf_append_char(&cb->allelebuf, '\0');
+  }
+  for(i = 0; i < cb->nalts; i++)
+    cb->alts[i].str = cb->allelebuf.b + cb->alts[i].merged;
+
+  qsort(cb->alts, cb->nalts, sizeof(CombineAlt), altcmp);
+
+  strbuf_reset(&cb->out);
+
+  // Copy "CHROM-POS-ID-"
+  strbuf_append_strn(&cb->out, rec->line, rec->cols[VREF]);
+
+  // Print "REF"
+  strbuf_append_strn(&cb->out, vcfrecord_col(rec, VREF), reflen0);
+  strbuf_append_strn(&cb->out, ref+reflen0, cb->reflen-reflen0);
+  strbuf_append_char(&cb->out, '\t');
+
+  // Print distinct alleles, noting the number each alt becomes
+  if(cb->genotypes && cb->nalts > cb->cap_merged) {
+    cb->cap_merged = ROUNDUP2POW(cb->nalts);
+    cb->merged = realloc(cb->merged, cb->cap_merged * sizeof(size_t));
+    if(cb->merged == NULL) die("Out of memory");
+  }
+  for(i = 0, num = 0; i < cb->nalts; i++) {
+    if(i == 0 || strcmp(cb->alts[i].str, cb->alts[i-1].str) != 0) {
+      if(num++ > 0) strbuf_append_char(&cb->out, ',');
+      strbuf_append_str(&cb->out, cb->alts[i].str);
+    }
+    if(cb->genotypes) cb->merged[cb->alts[i].id] = num;
+  }
+  strbuf_append_char(&cb->out, '\t');
+
+  // Append remaining
+  if(cb->genotypes && cb->gm.nsamples > 0) {
+    strbuf_append_strn(&cb->out, vcfrecord_col(rec, VQUAL),
+                       rec->cols[VFRMT] - rec->cols[VQUAL] - 1);
+    combine_print_genotypes(cb, &cb->out);
+  }
+  else {
+    strbuf_append_strn(&cb->out, vcfrecord_col(rec, VQUAL),
+                       rec->len - rec->cols[VQUAL]);
+  }
+
+  vcfstage_emit(stage, cb->out.b, cb->out.end);
+}
+
+static void combine_entry(VcfStage *stage, LineSpan *nline,
+                          VcfRecord *nrec)
+{
+  Combiner *cb = stage->state;
+  const PackedRef *r;
+  size_t chrlen, reflen;
+  int chrom, same_chr;
+
+  chrlen = vcfrecord_collen(nrec, VCHR);
+  chrom = contigids_get(&cb->contigs, nline->b, chrlen);
+
+  if(cb->nentries == 0) {
+    cb->chrom = chrom;
+    combine_start(stage, cb, nrec);
+    return;
+  }
+
+  same_chr = (nrec->pos >= 0 && chrom == cb->chrom);
+
+  if(same_chr && cb->rec.pos > nrec->pos)
+    die("VCF not sorted: %.*s", (int)nline->len, nline->b);
+
+  if(same_chr && nrec->pos - (cb->rec.pos+(long)cb->reflen-1) <= cb->overlap &&
+     (r = genomecursor_get_id(&cb->cursor, cb->genome, chrom,
+                              nline->b, chrlen)) != NULL)
+  {
+    // Overlap - merge
+    if(cb->pending) combine_unpend(stage, cb);
+    if(cb->rec.pos < 0)
+      die("Invalid entry: %.*s", (int)cb->rec.cols[VID], cb->rec.line);
+    reflen = nrec->pos - cb->rec.pos + vcfrecord_collen(nrec, VREF);
+    if(cb->rec.pos + MAX2(reflen, cb->reflen) > r->len)
+      die("Out of bounds: %.*s", (int)nrec->cols[VID], nrec->line);
+    cb->ref = r;
+    combine_add(stage, cb, nrec);
+    return;
+  }
+
+  // No overlap. Print before looking up another chromosome, which may unpin
+  // the reference of this cluster.
+  combine_print(stage, cb);
+
+  if(genomecursor_get_id(&cb->cursor, cb->genome, chrom,
+                         nline->b, chrlen) == NULL)
+    warn("Cannot find chr: %s", cb->cursor.name.b);
+  else if(nrec->pos < 0)
+    warn("Bad line: %.*s", (int)nline->len, nline->b);
+
+  cb->chrom = chrom;
+  combine_start(stage, cb, nrec);
+}
+
+// As combine_entry() for BCF input, without genotypes
+static void combine_entry_bcf(VcfStage *stage, bcf1_t *nrec, char sites)
+{
+  Combiner *cb = stage->state;
+  const PackedRef *r;
+  const char *chr = bcf_seqname(stage->hdr, nrec);
+  size_t chrlen = strlen(chr), reflen;
+  int chrom, same_chr;
+  (void)sites;
+
+  chrom = contigids_get(&cb->contigs, chr, chrlen);
+
+  if(cb->nentries == 0) {
+    cb->chrom = chrom;
+    combine_start_bcf(cb, nrec);
+    return;
+  }
+
+  same_chr = (nrec->pos >= 0 && chrom == cb->chrom);
+
+  if(same_chr && cb->rec.pos > nrec->pos)
+    die("VCF not sorted: %s:%"PRId64, chr, nrec->pos+1);
+
+  if(same_chr && nrec->pos - (cb->rec.pos+(long)cb->reflen-1) <= cb->overlap &&
+     (r = genomecursor_get_id(&cb->cursor, cb->genome, chrom,
+                              chr, chrlen)) != NULL)
+  {
+    // Overlap - merge
+    if(cb->pending) combine_unpend(stage, cb);
+    if(cb->rec.pos < 0)
+      die("Invalid entry: %.*s", (int)cb->rec.cols[VID], cb->rec.line);
+    if(bcf_unpack(nrec, BCF_UN_STR) != 0) die("Cannot unpack BCF record");
+    reflen = nrec->pos - cb->rec.pos + strlen(nrec->d.allele[0]);
+    if(cb->rec.pos + MAX2(reflen, cb->reflen) > r->len)
+      die("Out of bounds: %s:%"PRId64, chr, nrec->pos+1);
+    cb->ref = r;
+    combine_add_bcf(cb, nrec);
+    return;
+  }
+
+  // No overlap. Print before looking up another chromosome, which may unpin
+  // the reference of this cluster.
+  combine_print(stage, cb);
+
+  if(genomecursor_get_id(&cb->cursor, cb->genome, chrom, chr, chrlen) == NULL)
+    warn("Cannot find chr: %s", cb->cursor.name.b);
+  else if(nrec->pos < 0)
+    warn("Bad entry at %s:%"PRId64, chr, nrec->pos+1);
+
+  cb->chrom = chrom;
+  combine_start_bcf(cb, nrec);
+}
+
+static void combine_flush(VcfStage *stage)
+{
+  Combiner *cb = stage->state;
+  if(cb->nentries > 0) combine_print(stage, cb);
+  cb->nentries = 0;
+  cb->pending = 0;
+}
+
+// Contig ids follow the order of the ##contig lines
+static void combine_header(VcfStage *stage, LineSpan *line)
+{
+  Combiner *cb = stage->state;
+  contigids_header(&cb->contigs, line->b, line->len);
+  if(cb->genotypes) vcfstage_emit(stage, line->b, line->len);
+  else vcfstage_sites_header(stage, line);
+}
+
+static void combine_dealloc(VcfStage *stage)
+{
+  Combiner *cb = stage->state;
+  genomecursor_dealloc(&cb->cursor, cb->genome);
+  contigids_dealloc(&cb->contigs);
+  strbuf_dealloc(&cb->line);
+  strbuf_dealloc(&cb->altbuf);
+  strbuf_dealloc(&cb->refbuf);
+  strbuf_dealloc(&cb->allelebuf);
+  strbuf_dealloc(&cb->out);
+  gtmatrix_dealloc(&cb->gm);
+  free(cb->alts);
+  free(cb->first_alt);
+  free(cb->merged);
+  bcf_destroy(cb->first);
+  free(cb->ks.s);
+  free(cb);
+}
+
+void combinestage_alloc(VcfStage *stage, Genome *genome, int overlap,
+                        char genotypes)
+{
+  Combiner *cb = malloc(sizeof(Combiner));
+  if(cb == NULL) die("Out of memory");
+  cb->genome = genome;
+  cb->overlap = overlap;
+  strbuf_alloc(&cb->line, 1024);
+  strbuf_alloc(&cb->altbuf, 1024);
+  strbuf_alloc(&cb->refbuf, 1024);
+  strbuf_alloc(&cb->allelebuf, 1024);
+  strbuf_alloc(&cb->out, 1024);
+  cb->cap_alts = 64;
+  cb->alts = malloc(cb->cap_alts * sizeof(CombineAlt));
+  if(cb->alts == NULL) die("Out of memory");
+  cb->nalts = cb->nentries = 0;
+  genomecursor_alloc(&cb->cursor);
+  contigids_alloc(&cb->contigs);
+  cb->chrom = -1;
+  if((cb->first = bcf_init()) == NULL) die("Out of memory");
+  cb->pending = 0;
+  cb->ks = (kstring_t){0, 0, NULL};
+  cb->genotypes = genotypes;
+  gtmatrix_alloc(&cb->gm);
+  cb->cap_rows = cb->cap_merged = 64;
+  cb->first_alt = malloc(cb->cap_rows * sizeof(size_t));
+  cb->merged = malloc(cb->cap_merged * sizeof(size_t));
+  if(cb->first_alt == NULL || cb->merged == NULL) die("Out of memory");
+  cb->first_alt[0] = 0;
+
+  memset(stage, 0, sizeof(VcfStage));
+  stage->entry = combine_entry;
+  // Genotypes are read from text
+  if(!genotypes) stage->entry_bcf = combine_entry_bcf;
+  stage->header = combine_header;
+  stage->flush = combine_flush;
+  stage->dealloc = combine_dealloc;
+  stage->state = cb;
+}
@@ -0,0 +1,114 @@
+#ifndef COMBO_KERNELS_H_
+#define COMBO_KERNELS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vcf_record.h"
+#include "string_buffer.h"
+#include "arena.h"
+
+// Internal to vcfcombo: the steps combo_stage.c takes to combine a cluster,
+// shared with vcfmicrobench so that it can time each of them.
+
+// line, alts and the alleles they point to are held in the cluster's arena
+typedef struct {
+  char *line, *fields[9], *ref, **alts;
+  size_t linelen, pos, reflen, num_alts;
+  int chrom; // contig id
+} Var;
+
+// A cluster of overlapping vars
+typedef struct {
+  Var *vars;
+  size_t nvars, cap_vars;
+  Arena arena; // reset with each cluster
+} VarSet;
+
+// Distinct haplotypes of a cluster. Each is built at the end of the arena and
+// hashed; a duplicate is dropped at once by moving the end back. Memory grows
+// with the number of distinct alleles, not the number of combinations.
+typedef struct {
+  StrBuf arena; // NUL terminated alleles, one after another
+  size_t *offsets; // of each allele in arena
+  uint64_t *hashes; // of each allele
+  char **alleles; // set by alleleset_finish()
+  size_t num, cap;
+  size_t nadded; // alleles added since the reset, including duplicates
+  uint32_t *table; // open addressing, index+1 of an allele or 0 if empty
+  size_t table_size; // power of two
+} AlleleSet;
+
+// Pairwise compatibility of a cluster's variants, which are sorted by
+// position. Row i has bit j set if vars[j] can follow vars[i] (so j > i).
+// Also holds space for walking the matrix, nvars of each array, so that
+// large clusters do not go on the stack.
+typedef struct {
+  uint64_t *bits;
+  size_t nvars, nwords, cap; // nwords per row, cap words allocated
+  size_t *idx, *alleles;
+  const Var **set;
+  size_t cap_vars;
+} CompatMatrix;
+
+// Copy a line without sample information into the arena
+void var_construct(Var *var, const VcfRecord *rec, Arena *arena);
+// As var_construct() for a BCF record, whose sites are formatted in ks first
+void var_construct_bcf(Var *var, const bcf_hdr_t *hdr, const bcf1_t *rec,
+                       kstring_t *ks, Arena *arena);
+
+// Order by ref position then by ref length
+int varcmp(const Var *v1, const Var *v2);
+void vars_sort(Var *vars, size_t nvars);
+
+// Check if two variants are compatible (v1 must be <= v2)
+int vars_compatible(const Var *v1, const Var *v2);
+// Returns 1 if var contains allele, 0 otherwise
+int var_contains_allele(const Var *var, char *allele);
+// Add the alts of src that dst does not have to dst
+void vars_merge(Var *dst, const Var *src, Arena *arena);
+
+// Trim bases that REF and every ALT share at the start or end
+void var_trim_alts_starts(Var *var);
+void var_trim_alts_ends(Var *var);
+void var_sort_alts(Var *var);
+// Remove alts equal to REF or to the one before, alts must be sorted
+void var_remove_dup_alts(Var *var);
+
+void varset_alloc(VarSet *vset);
+void varset_dealloc(VarSet *vset);
+void varset_reset(VarSet *vset);
+// Add a var to the set, it is valid until the next varset_reset()
+Var* varset_add(VarSet *vset, const VcfRecord *rec);
+Var* varset_add_bcf(VarSet *vset, const bcf_hdr_t *hdr, const bcf1_t *rec,
+                    kstring_t *ks);
+// Merge vars with the same pos and reflen, vars must be sorted first
+void varset_remove_duplicates(VarSet *vset);
+
+void alleleset_alloc(AlleleSet *set);
+void alleleset_dealloc(AlleleSet *set);
+void alleleset_reset(AlleleSet *set);
+// Keep the allele built at the end of the arena from offset start, unless we
+// already have it
+void alleleset_add(AlleleSet *set, size_t start);
+// Point alleles at the strings, which no longer move
+void alleleset_finish(AlleleSet *set);
+// Index of allele str in set, or SIZE_MAX if not there
+size_t alleleset_find(const AlleleSet *set, const char *str, size_t len);
+
+void compat_alloc(CompatMatrix *cm);
+void compat_dealloc(CompatMatrix *cm);
+void compat_build(CompatMatrix *cm, const Var *vars, size_t nvars);
+
+// Number of haplotypes generate_var_combinations() would produce, without
+// producing them. Saturates at SIZE_MAX.
+size_t count_var_combinations(const Var *vars, CompatMatrix *cm);
+
+// Every haplotype of compatible vars of a cluster, on ref which must be upper
+// case. Distinct haplotypes are collected in alleles, returns how many. nsets
+// is set to the number of sets of vars visited.
+size_t generate_var_combinations(const Var *vars, CompatMatrix *cm,
+                                 const char *ref, size_t reflen,
+                                 AlleleSet *alleles, size_t *nsets);
+
+#endif /* COMBO_KERNELS_H_ */
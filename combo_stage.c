@@ -0,0 +1,1287 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+
+#include "global.h"
+#include "vcf_record.h"
+#include "vcf_stage.h"
+#include "string_buffer.h"
+#include "arena.h"
+#include "genotypes.h"
+#include "contig_ids.h"
+#include "combo_kernels.h"
+
+#define TRACE_BUF_SIZE (1UL<<16)
+
+#define prntbf(stage,sbuf) vcfstage_emit(stage, (sbuf)->b, (sbuf)->end)
+
+#define var_is_ins(var) ((var)->ref[0] == '\0')
+
+/*
+static inline char var_is_del(Var *var) {
+  size_t i;
+  for(i = 0; i < var->num_alts; i++)
+    if(var->alts[i][0] == '\0')
+      return 1;
+  return 0;
+}
+
+#define var_is_indel(var) (var_is_ins(var) || var_is_del(var))
+*/
+
+// To be a SNP all alleles must be exactly one base long
+static inline int alts_are_snps(char **alts, size_t num_alts)
+{
+  size_t i;
+  for(i = 0; i < num_alts; i++)
+    if(alts[i][0] == '\0' || alts[i][1] != '\0') return 0;
+  return 1;
+}
+
+// Copy a line without sample information into the arena
+void var_construct(Var *var, const VcfRecord *rec, Arena *arena)
+{
+  size_t i; char *comma, **fields = var->fields;
+
+  var->linelen = MIN2(rec->len, rec->cols[9]-1);
+  var->line = arena_malloc(arena, var->linelen+1);
+  memcpy(var->line, rec->line, var->linelen);
+  var->line[var->linelen] = '\0';
+
+  // Split our copy of the line into NUL terminated columns and alleles
+  for(i = 0; i < 9; i++) fields[i] = var->line + rec->cols[i];
+  for(i = 1; i < VFRMT; i++) fields[i][-1] = '\0';
+
+  var->num_alts = rec->nalts;
+  var->alts = arena_malloc(arena, var->num_alts * sizeof(char*));
+  var->alts[0] = fields[VALT];
+  for(i = 1; i < var->num_alts; i++) {
+    comma = strchr(var->alts[i-1], ',');
+    *comma = '\0';
+    var->alts[i] = comma+1;
+  }
+
+  var->pos = rec->pos;
+  var->ref = fields[VREF];
+  var->reflen = vcfrecord_collen(rec, VREF);
+}
+
+void var_construct_bcf(Var *var, const bcf_hdr_t *hdr, const bcf1_t *rec,
+                       kstring_t *ks, Arena *arena)
+{
+  VcfRecord vrec;
+  vcfrecord_format_bcf(hdr, rec, 1, ks);
+  vcfrecord_parse(&vrec, ks->s, ks->l);
+  var_construct(var, &vrec, arena);
+}
+
+// returns 1 if an entry at pos on contig id chrom is within overlap bases of
+// v0, 0 otherwise. The caller checks the entry does not come before v0.
+static int var_overlaps(const Var *v0, long pos, int chrom, size_t overlap)
+{
+  return (v0->chrom == chrom &&
+          (long)(v0->pos + v0->reflen + overlap - 1) >= pos);
+}
+
+#ifdef DEBUG
+static void var_print(const Var *var) {
+  size_t i;
+  printf("ref: %s; alts: %s", var->ref, var->alts[0]);
+  for(i = 1; i < var->num_alts; i++) printf(", %s", var->alts[i]);
+  printf("; pos: %zu; reflen: %zu; num_alts: %zu\n",
+         var->pos, var->reflen, var->num_alts);
+}
+#endif
+
+int varcmp(const Var *v1, const Var *v2) {
+  int cmp = (long)v1->pos - v2->pos;
+  return cmp == 0 ? (long)v1->reflen - (long)v2->reflen : cmp;
+}
+
+// Order by ref position then by ref length
+static int varcmp2(const void *a, const void *b)
+{
+  return varcmp((const Var*)a, (const Var*)b);
+}
+
+void vars_sort(Var *vars, size_t nvars)
+{
+  qsort(vars, nvars, sizeof(Var), varcmp2);
+}
+
+// Check if two variants are compatible (v1 must be <= v2)
+int vars_compatible(const Var *v1, const Var *v2)
+{
+  return (v1->pos + v1->reflen <= v2->pos) &&
+         (!var_is_ins(v1) || !var_is_ins(v2) || v1->pos != v2->pos);
+}
+
+// Returns 1 if var contains allele, 0 otherwise
+int var_contains_allele(const Var *var, char *allele)
+{
+  size_t i;
+  if(strcmp(var->ref, allele) == 0) return 1;
+  for(i = 0; i < var->num_alts; i++)
+    if(strcmp(var->alts[i], allele) == 0)
+      return 1;
+  return 0;
+}
+
+void vars_merge(Var *dst, const Var *src, Arena *arena)
+{
+  size_t i;
+  char **alts = arena_malloc(arena, (dst->num_alts + src->num_alts) *
+                                    sizeof(char*));
+  memcpy(alts, dst->alts, dst->num_alts * sizeof(char*));
+  dst->alts = alts;
+  for(i = 0; i < src->num_alts; i++)
+    if(!var_contains_allele(dst, src->alts[i]))
+      dst->alts[dst->num_alts++] = src->alts[i];
+}
+
+void alleleset_alloc(AlleleSet *set)
+{
+  strbuf_alloc(&set->arena, 1024);
+  set->num = set->nadded = 0;
+  set->cap = 64;
+  set->table_size = 2 * set->cap;
+  set->offsets = malloc(set->cap * sizeof(size_t));
+  set->hashes = malloc(set->cap * sizeof(uint64_t));
+  set->alleles = malloc(set->cap * sizeof(char*));
+  set->table = calloc(set->table_size, sizeof(uint32_t));
+  if(!set->offsets || !set->hashes || !set->alleles || !set->table)
+    die("Out of memory");
+}
+
+void alleleset_dealloc(AlleleSet *set)
+{
+  strbuf_dealloc(&set->arena);
+  free(set->offsets);
+  free(set->hashes);
+  free(set->alleles);
+  free(set->table);
+}
+
+// FNV-1a
+static inline uint64_t allele_hash(const char *str, size_t len)
+{
+  uint64_t h = 14695981039346656037UL;
+  size_t i;
+  for(i = 0; i < len; i++) h = (h ^ (uint8_t)str[i]) * 1099511628211UL;
+  return h;
+}
+
+void alleleset_reset(AlleleSet *set)
+{
+  size_t i, slot, mask = set->table_size - 1;
+
+  if(set->num * 8 < set->table_size) {
+    // Clear only the slots we used
+    for(i = 0; i < set->num; i++) {
+      for(slot = set->hashes[i] & mask; set->table[slot] != i+1;
+          slot = (slot + 1) & mask) {}
+      set->table[slot] = 0;
+    }
+  }
+  else memset(set->table, 0, set->table_size * sizeof(uint32_t));
+
+  set->num = set->nadded = 0;
+  strbuf_reset(&set->arena);
+}
+
+static void alleleset_grow(AlleleSet *set)
+{
+  size_t i, slot, mask;
+
+  set->cap *= 2;
+  set->offsets = realloc(set->offsets, set->cap * sizeof(size_t));
+  set->hashes = realloc(set->hashes, set->cap * sizeof(uint64_t));
+  set->alleles = realloc(set->alleles, set->cap * sizeof(char*));
+  if(!set->offsets || !set->hashes || !set->alleles) die("Out of memory");
+
+  // Rehash into a table twice the size of the capacity
+  free(set->table);
+  set->table_size = 2 * set->cap;
+  if((set->table = calloc(set->table_size, sizeof(uint32_t))) == NULL)
+    die("Out of memory");
+  mask = set->table_size - 1;
+  for(i = 0; i < set->num; i++) {
+    for(slot = set->hashes[i] & mask; set->table[slot] != 0;
+        slot = (slot + 1) & mask) {}
+    set->table[slot] = i+1;
+  }
+}
+
+// Keep the allele built at the end of the arena from offset start, unless we
+// already have it
+void alleleset_add(AlleleSet *set, size_t start)
+{
+  const char *str = set->arena.b + start;
+  size_t len = set->arena.end - start, slot, mask;
+  uint64_t h = allele_hash(str, len);
+  uint32_t idx;
+
+  set->nadded++;
+  mask = set->table_size - 1;
+  for(slot = h & mask; (idx = set->table[slot]) != 0; slot = (slot + 1) & mask)
+  {
+    idx--;
+    if(set->hashes[idx] == h &&
+       strcmp(set->arena.b + set->offsets[idx], str) == 0)
+    {
+      // Duplicate
+      set->arena.end = start;
+      set->arena.b[start] = '\0';
+      return;
+    }
+  }
+
+  if(set->num == UINT32_MAX) die("Too many alleles");
+  set->table[slot] = set->num+1;
+  set->offsets[set->num] = start;
+  set->hashes[set->num] = h;
+  set->num++;
+  strbuf_append_char(&set->arena, '\0'); // keep the NUL
+
+  if(set->num * 2 > set->cap) alleleset_grow(set);
+}
+
+// Point alleles at the strings, which no longer move
+void alleleset_finish(AlleleSet *set)
+{
+  size_t i;
+  for(i = 0; i < set->num; i++)
+    set->alleles[i] = set->arena.b + set->offsets[i];
+}
+
+// Index of allele str in set, or SIZE_MAX if not there
+size_t alleleset_find(const AlleleSet *set, const char *str, size_t len)
+{
+  size_t slot, mask = set->table_size - 1;
+  uint64_t h = allele_hash(str, len);
+  uint32_t idx;
+
+  for(slot = h & mask; (idx = set->table[slot]) != 0; slot = (slot + 1) & mask)
+  {
+    idx--;
+    if(set->hashes[idx] == h &&
+       strcmp(set->arena.b + set->offsets[idx], str) == 0) return idx;
+  }
+  return SIZE_MAX;
+}
+
+// Append ref with vars[i]->alts[alleles[i]] in place of each var
+static void append_haplotype(const Var **vars, size_t nvars,
+                             const size_t *alleles,
+                             const char *ref, size_t reflen, StrBuf *out)
+{
+  size_t i, end = 0;
+  for(i = 0; i < nvars; i++) {
+    if(vars[i]->pos > end) strbuf_append_strn(out, ref+end, vars[i]->pos-end);
+    strbuf_append_str(out, vars[i]->alts[alleles[i]]);
+    end = vars[i]->pos + vars[i]->reflen;
+  }
+  strbuf_append_strn(out, ref + end, reflen - end);
+}
+
+static void construct_genotype(const Var **vars, size_t nvars,
+                               const size_t *alleles,
+                               const char *ref, size_t reflen, AlleleSet *set)
+{
+  size_t start = set->arena.end;
+  append_haplotype(vars, nvars, alleles, ref, reflen, &set->arena);
+  alleleset_add(set, start);
+}
+
+// ref must be upper case. alleles is space for nvars indices.
+static void print_genotypes(const Var **vars, size_t nvars,
+                            const char *ref, size_t reflen, AlleleSet *set,
+                            size_t *alleles)
+{
+  size_t gt, i, num_genotypes = 1;
+  memset(alleles, 0, nvars * sizeof(size_t));
+
+  for(i = 0; i < nvars; i++)
+    num_genotypes *= vars[i]->num_alts;
+
+  for(gt = 0; gt < num_genotypes; gt++) {
+    for(i = nvars-1; i < SIZE_MAX; i--) {
+      alleles[i]++;
+      if(alleles[i] == vars[i]->num_alts) alleles[i] = 0;
+      else break;
+    }
+    construct_genotype(vars, nvars, alleles, ref, reflen, set);
+  }
+}
+
+#define compat_row(cm,i) ((cm)->bits + (i)*(cm)->nwords)
+
+void compat_alloc(CompatMatrix *cm)
+{
+  cm->cap = cm->cap_vars = 64;
+  cm->bits = malloc(cm->cap * sizeof(uint64_t));
+  cm->idx = malloc(cm->cap_vars * sizeof(size_t));
+  cm->alleles = malloc(cm->cap_vars * sizeof(size_t));
+  cm->set = malloc(cm->cap_vars * sizeof(Var*));
+  if(cm->bits == NULL || cm->idx == NULL || cm->alleles == NULL ||
+     cm->set == NULL) die("Out of memory");
+}
+
+void compat_dealloc(CompatMatrix *cm)
+{
+  free(cm->bits);
+  free(cm->idx);
+  free(cm->alleles);
+  free(cm->set);
+}
+
+void compat_build(CompatMatrix *cm, const Var *vars, size_t nvars)
+{
+  size_t i, j;
+  uint64_t *row;
+
+  cm->nvars = nvars;
+  cm->nwords = (nvars+63)/64;
+  if(nvars * cm->nwords > cm->cap) {
+    cm->cap = ROUNDUP2POW(nvars * cm->nwords);
+    free(cm->bits);
+    if((cm->bits = malloc(cm->cap * sizeof(uint64_t))) == NULL)
+      die("Out of memory");
+  }
+  memset(cm->bits, 0, nvars * cm->nwords * sizeof(uint64_t));
+
+  if(nvars > cm->cap_vars) {
+    cm->cap_vars = ROUNDUP2POW(nvars);
+    cm->idx = realloc(cm->idx, cm->cap_vars * sizeof(size_t));
+    cm->alleles = realloc(cm->alleles, cm->cap_vars * sizeof(size_t));
+    cm->set = realloc(cm->set, cm->cap_vars * sizeof(Var*));
+    if(cm->idx == NULL || cm->alleles == NULL || cm->set == NULL)
+      die("Out of memory");
+  }
+
+  for(i = 0; i < nvars; i++) {
+    row = compat_row(cm, i);
+    for(j = i+1; j < nvars; j++)
+      if(vars_compatible(&vars[i], &vars[j])) row[j/64] |= 1UL << (j%64);
+  }
+}
+
+// First var >= from that can follow var i, or nvars if none
+static size_t compat_next(const CompatMatrix *cm, size_t i, size_t from)
+{
+  const uint64_t *row = compat_row(cm, i);
+  size_t w = from/64;
+  uint64_t word;
+
+  if(from >= cm->nvars) return cm->nvars;
+  word = row[w] & (~0UL << (from%64));
+  while(word == 0) {
+    if(++w == cm->nwords) return cm->nvars;
+    word = row[w];
+  }
+  return w*64 + __builtin_ctzll(word);
+}
+
+static inline size_t sat_add(size_t a, size_t b) {
+  return a > SIZE_MAX - b ? SIZE_MAX : a + b;
+}
+
+static inline size_t sat_mul(size_t a, size_t b) {
+  return b != 0 && a > SIZE_MAX / b ? SIZE_MAX : a * b;
+}
+
+// Number of haplotypes generate_var_combinations() would produce, without
+// producing them. Saturates at SIZE_MAX.
+size_t count_var_combinations(const Var *vars, CompatMatrix *cm)
+{
+  size_t i, j, total = 0, nvars = cm->nvars, *counts = cm->idx;
+
+  // counts[i]: haplotypes whose first var is vars[i]
+  for(i = nvars-1; i < SIZE_MAX; i--) {
+    counts[i] = 1;
+    for(j = compat_next(cm, i, i+1); j < nvars; j = compat_next(cm, i, j+1))
+      counts[i] = sat_add(counts[i], counts[j]);
+    counts[i] = sat_mul(counts[i], vars[i].num_alts);
+    total = sat_add(total, counts[i]);
+  }
+
+  return total;
+}
+
+// Depth first search over sets of compatible variants. Each node visited is a
+// set, so the cost is proportional to the number of haplotypes produced.
+// Distinct haplotypes are collected in alleles, returns how many. nsets is
+// set to the number of sets visited.
+size_t generate_var_combinations(const Var *vars, CompatMatrix *cm,
+                                 const char *ref, size_t reflen,
+                                 AlleleSet *alleles, size_t *nsets)
+{
+  size_t d = 0, next, nvars = cm->nvars, *idx = cm->idx;
+  const Var **set = cm->set;
+
+  alleleset_reset(alleles);
+  *nsets = 0;
+  if(nvars == 0) return 0;
+
+  // idx[0..d] are the vars in the current set
+  idx[0] = 0;
+  while(1)
+  {
+    set[d] = &vars[idx[d]];
+    print_genotypes(set, d+1, ref, reflen, alleles, cm->alleles);
+    (*nsets)++;
+
+    // Extend the set with the first var that can follow the last
+    if((next = compat_next(cm, idx[d], idx[d]+1)) < nvars) {
+      idx[++d] = next;
+      continue;
+    }
+
+    // Otherwise replace the last var with the next one that can follow the
+    // one before it, backtracking as needed
+    while(1) {
+      next = d == 0 ? idx[0]+1 : compat_next(cm, idx[d-1], idx[d]+1);
+      if(next < nvars) break;
+      if(d == 0) {
+        alleleset_finish(alleles);
+        return alleles->num;
+      }
+      d--;
+    }
+    idx[d] = next;
+  }
+}
+
+static int strptrcmp(const void *a, const void *b) {
+  const char *x = *(const char**)a, *y = *(const char**)b;
+  return strcmp(x, y);
+}
+
+// Padding base is -1 or base char. alts must be distinct.
+static void print_alt_strings(char **alts, size_t num,
+                              int padding_base, StrBuf *out)
+{
+  size_t i;
+  qsort(alts, num, sizeof(char**), strptrcmp);
+  for(i = 0; i < num; i++) {
+    if(i > 0) strbuf_append_char(out, ',');
+    if(padding_base != -1) strbuf_append_char(out, padding_base);
+    strbuf_append_str(out, alts[i]);
+  }
+}
+
+// Trim matching start bases
+void var_trim_alts_starts(Var *var)
+{
+  size_t i, offset;
+  char c;
+  for(offset = 0; (c = var->ref[offset]) != '\0'; offset++) {
+    for(i = 0; i < var->num_alts && var->alts[i][offset] == c; i++);
+    if(i < var->num_alts) break;
+  }
+  if(offset > 0) {
+    var->pos += offset;
+    var->ref += offset;
+    var->reflen -= offset;
+    for(i = 0; i < var->num_alts; i++) var->alts[i] += offset;
+  }
+}
+
+// Trim matching end bases
+void var_trim_alts_ends(Var *var)
+{
+  size_t i, trim, minlen = var->reflen, lens[var->num_alts];
+  char c;
+  for(i = 0; i < var->num_alts; i++) {
+    lens[i] = strlen(var->alts[i]);
+    minlen = MIN2(minlen, lens[i]);
+  }
+  for(trim = 0; trim < minlen; trim++) {
+    c = var->ref[var->reflen-trim-1];
+    for(i = 0; i < var->num_alts && var->alts[i][lens[i]-trim-1] == c; i++);
+    if(i < var->num_alts) break;
+  }
+  var->reflen -= trim;
+  for(i = 0; i < var->num_alts; i++) var->alts[i][lens[i]-trim] = '\0';
+}
+
+void var_sort_alts(Var *var) {
+  qsort(var->alts, var->num_alts, sizeof(char*), strptrcmp);
+}
+
+void var_remove_dup_alts(Var *var)
+{
+  size_t i; char *tmp;
+  for(i = 0; i < var->num_alts; ) {
+    if(strcmp(var->alts[i], var->ref) == 0 ||
+       (i > 1 && strcmp(var->alts[i], var->alts[i-1]) == 0))
+    {
+      var->num_alts--;
+      SWAP(var->alts[i], var->alts[var->num_alts], tmp);
+    }
+    else i++;
+  }
+}
+
+//
+// VarSet set of Vars
+//
+
+void varset_alloc(VarSet *vset)
+{
+  vset->cap_vars = 16;
+  vset->vars = malloc(vset->cap_vars * sizeof(Var));
+  if(vset->vars == NULL) die("Out of memory");
+  vset->nvars = 0;
+  arena_alloc(&vset->arena, 1UL<<16);
+}
+
+void varset_dealloc(VarSet *vset) {
+  arena_dealloc(&vset->arena);
+  free(vset->vars);
+}
+
+void varset_reset(VarSet *vset) {
+  vset->nvars = 0;
+  arena_reset(&vset->arena);
+}
+
+static Var* varset_next(VarSet *vset)
+{
+  if(vset->nvars == vset->cap_vars) {
+    vset->cap_vars *= 2;
+    vset->vars = realloc(vset->vars, vset->cap_vars * sizeof(Var));
+    if(vset->vars == NULL) die("Out of memory");
+  }
+  return &vset->vars[vset->nvars++];
+}
+
+// Add a var to the set, it is valid until the next varset_reset()
+Var* varset_add(VarSet *vset, const VcfRecord *rec)
+{
+  Var *var = varset_next(vset);
+  var_construct(var, rec, &vset->arena);
+  return var;
+}
+
+Var* varset_add_bcf(VarSet *vset, const bcf_hdr_t *hdr, const bcf1_t *rec,
+                    kstring_t *ks)
+{
+  Var *var = varset_next(vset);
+  var_construct_bcf(var, hdr, rec, ks, &vset->arena);
+  return var;
+}
+
+// Remove duplicates: same pos, same alts
+// vset->vars should be sorted first with:
+//   vars_sort(vset->vars, vset->nvars);
+// result is vset is merged duplicate variants
+void varset_remove_duplicates(VarSet *vset)
+{
+  size_t i; Var tmp;
+  for(i = 1; i < vset->nvars; ) {
+    if(varcmp(&vset->vars[i], &vset->vars[i-1]) == 0)
+    {
+      vars_merge(&vset->vars[i-1], &vset->vars[i], &vset->arena);
+      vset->nvars--;
+      SWAP(vset->vars[i], vset->vars[vset->nvars], tmp);
+    }
+    else i++;
+  }
+}
+
+// Undo splitting var->line into columns and alleles
+static inline void var_join(Var *var)
+{
+  size_t i;
+  for(i = 1; i < VFRMT; i++) var->fields[i][-1] = '\t';
+  for(i = 1; i < var->num_alts; i++) var->alts[i][-1] = ',';
+}
+
+
+// Upper bound on the number of haplotypes, ignoring compatibility
+static inline size_t varset_max_haplotypes(const VarSet *vset)
+{
+  size_t i, n = 1;
+  for(i = 0; i < vset->nvars; i++)
+    n = sat_mul(n, vset->vars[i].num_alts + 1);
+  return n - 1;
+}
+
+// Copy the lines to saved, one per line, so they can be written out unchanged
+// after the vars have been trimmed
+static void varset_save(VarSet *vset, StrBuf *saved)
+{
+  size_t v;
+  const char *line;
+  VcfRecord rec;
+
+  strbuf_reset(saved);
+  for(v = 0; v < vset->nvars; v++) {
+    var_join(&vset->vars[v]);
+    strbuf_append_strn(saved, vset->vars[v].line, vset->vars[v].linelen);
+    strbuf_append_char(saved, '\n');
+  }
+
+  // Split the lines again
+  line = saved->b;
+  for(v = 0; v < vset->nvars; v++) {
+    vcfrecord_parse(&rec, line, vset->vars[v].linelen);
+    var_construct(&vset->vars[v], &rec, &vset->arena);
+    line += rec.len + 1;
+  }
+}
+
+// With genotypes, each entry's GT calls are kept in a GtMatrix. A call that
+// picks alts from several entries of a cluster becomes the haplotype with all
+// of them, if that is one of the combinations.
+// Without genotypes, a BCF record that starts a cluster is held as it is, and
+// only becomes a var, formatted as text, if a second entry joins it.
+typedef struct {
+  Genome *genome;
+  int overlap;
+  size_t max_haplotypes; // 0 for no limit
+  VarSet vset;
+  CompatMatrix compat;
+  AlleleSet alleles;
+  StrBuf refbuf, outbuf, saved;
+  GenomeCursor cursor;
+  char genotypes;
+  GtMatrix gm; // one row per entry, in input order
+  Var *rows; // each entry's var after trimming, alts in input order
+  const Var **call_vars; // combo_call() space, cap_rows of each
+  size_t *call_alleles;
+  size_t *rank; // number in the output ALT of each allele in alleles
+  size_t cap_rows, cap_rank;
+  StrBuf gtbuf;
+  ComboTrace *trace; // NULL if not tracing
+  StrBuf tracebuf; // trace lines not yet written
+  size_t nsets; // sets visited by generate_var_combinations()
+  ContigIds contigs;
+  bcf1_t *first; // BCF first entry, while it is alone in the cluster
+  char pending; // set while the cluster is just first
+  Var pend; // pos, reflen and chrom of first
+  kstring_t ks; // BCF entries formatted as text
+} Combo;
+
+#define combo_has_samples(cmb) ((cmb)->genotypes && (cmb)->gm.nsamples > 0)
+
+// Pass on a line of the sites columns, with its columns if rec is not NULL.
+// With genotypes its FORMAT column is replaced by GT and the calls of the
+// given row.
+static void combo_emit(Combo *cmb, VcfStage *stage,
+                       char *line, size_t len, size_t row, VcfRecord *rec)
+{
+  StrBuf *out = &cmb->outbuf;
+  LineSpan span = {.b = line, .len = len};
+  size_t end = len;
+
+  if(!combo_has_samples(cmb)) {
+    if(rec != NULL) vcfstage_emit_rec(stage, &span, rec);
+    else vcfstage_emit(stage, line, len);
+    return;
+  }
+
+  // Drop FORMAT, the last column
+  while(end > 0 && line[end-1] != '\t') end--;
+  strbuf_reset(out);
+  strbuf_append_strn(out, line, end > 0 ? end-1 : 0);
+  gtmatrix_print_row(&cmb->gm, row, out);
+  prntbf(stage, out);
+}
+
+static void saved_dump(Combo *cmb, VcfStage *stage)
+{
+  StrBuf *saved = &cmb->saved;
+  char *line = saved->b, *end = saved->b + saved->end, *nl;
+  size_t row;
+  for(row = 0; line < end; line = nl+1, row++) {
+    nl = memchr(line, '\n', end - line);
+    combo_emit(cmb, stage, line, nl - line, row, NULL);
+  }
+}
+
+// Keep a copy of each var, after its alleles are trimmed and before they are
+// sorted, so GT allele numbers can be looked up
+static void combo_save_row(Combo *cmb, size_t row, const Var *var)
+{
+  if(row == cmb->cap_rows) {
+    cmb->cap_rows *= 2;
+    cmb->rows = realloc(cmb->rows, cmb->cap_rows * sizeof(Var));
+    cmb->call_vars = realloc(cmb->call_vars, cmb->cap_rows * sizeof(Var*));
+    cmb->call_alleles = realloc(cmb->call_alleles,
+                                cmb->cap_rows * sizeof(size_t));
+    if(cmb->rows == NULL || cmb->call_vars == NULL ||
+       cmb->call_alleles == NULL) die("Out of memory");
+  }
+  cmb->rows[row] = *var;
+  cmb->rows[row].alts = arena_malloc(&cmb->vset.arena,
+                                     var->num_alts * sizeof(char*));
+  memcpy(cmb->rows[row].alts, var->alts, var->num_alts * sizeof(char*));
+}
+
+// Non-zero if a trimmed alt is the same as the trimmed ref
+static inline char var_alt_is_ref(const Var *var, size_t i)
+{
+  return strlen(var->alts[i]) == var->reflen &&
+         strncmp(var->alts[i], var->ref, var->reflen) == 0;
+}
+
+// Output allele of one call of a sample, GT_MISSING if any entry has it
+// missing, the alts picked cannot go together, or their haplotype was not
+// generated
+static int combo_call(Combo *cmb, size_t sample, size_t call,
+                      const char *ref, size_t reflen)
+{
+  size_t r, i, n = 0, nrows = cmb->gm.nrows, idx;
+  size_t *alleles = cmb->call_alleles;
+  const Var **vars = cmb->call_vars;
+  int a;
+
+  for(r = 0; r < nrows; r++) {
+    a = gtmatrix_call(&cmb->gm, r, sample, call);
+    if(a == GT_MISSING || (size_t)a > cmb->rows[r].num_alts) return GT_MISSING;
+    if(a == 0 || var_alt_is_ref(&cmb->rows[r], a-1)) continue;
+    // Insert in position order
+    for(i = n++; i > 0 && varcmp(vars[i-1], &cmb->rows[r]) > 0; i--) {
+      vars[i] = vars[i-1];
+      alleles[i] = alleles[i-1];
+    }
+    vars[i] = &cmb->rows[r];
+    alleles[i] = a-1;
+  }
+
+  if(n == 0) return 0;
+  for(i = 1; i < n; i++)
+    if(!vars_compatible(vars[i-1], vars[i])) return GT_MISSING;
+
+  strbuf_reset(&cmb->gtbuf);
+  append_haplotype(vars, n, alleles, ref, reflen, &cmb->gtbuf);
+  idx = alleleset_find(&cmb->alleles, cmb->gtbuf.b, cmb->gtbuf.end);
+  return idx == SIZE_MAX ? GT_MISSING : (int)cmb->rank[idx];
+}
+
+// Append GT of each sample for the combined entry
+static void combo_print_genotypes(Combo *cmb, char **alts, size_t num_alts,
+                                  const char *ref, size_t reflen, StrBuf *out)
+{
+  const GtMatrix *gm = &cmb->gm;
+  size_t s, r, k;
+  char haploid, phased;
+  int a0, a1;
+
+  // alts were sorted for printing, number them as printed
+  if(num_alts > cmb->cap_rank) {
+    cmb->cap_rank = ROUNDUP2POW(num_alts);
+    cmb->rank = realloc(cmb->rank, cmb->cap_rank * sizeof(size_t));
+    if(cmb->rank == NULL) die("Out of memory");
+  }
+  for(k = 0; k < num_alts; k++)
+    cmb->rank[alleleset_find(&cmb->alleles, alts[k], strlen(alts[k]))] = k+1;
+
+  strbuf_append_str(out, "\tGT");
+  for(s = 0; s < gm->nsamples; s++) {
+    haploid = phased = 1;
+    for(r = 0; r < gm->nrows; r++) {
+      haploid &= gtmatrix_haploid(gm, r, s);
+      phased &= gtmatrix_phased(gm, r, s);
+    }
+    a0 = combo_call(cmb, s, 0, ref, reflen);
+    a1 = haploid ? 0 : combo_call(cmb, s, 1, ref, reflen);
+    strbuf_append_char(out, '\t');
+    gt_append(out, a0, a1, haploid, phased);
+  }
+}
+
+// Columns of a var's joined line. Only valid before the var is trimmed.
+static void var_record(const Var *var, VcfRecord *rec)
+{
+  size_t i;
+  rec->line = var->line;
+  rec->len = var->linelen;
+  for(i = 0; i < 9; i++) rec->cols[i] = var->fields[i] - var->line;
+  rec->cols[9] = var->linelen + 1;
+  rec->pos = var->pos;
+  rec->nalts = var->num_alts;
+}
+
+// Pass on the entries of a cluster unchanged, before they are trimmed
+static void varset_dump(Combo *cmb, VcfStage *stage)
+{
+  VarSet *vset = &cmb->vset;
+  VcfRecord rec;
+  Var *var;
+  size_t v;
+  for(v = 0; v < vset->nvars; v++) {
+    var = &vset->vars[v];
+    var_join(var);
+    var_record(var, &rec);
+    combo_emit(cmb, stage, var->line, var->linelen, v, &rec);
+  }
+}
+
+// Returns 1 if the cluster was combined, 0 if passed through
+static char varset_combine(Combo *cmb, VcfStage *stage)
+{
+  VarSet *vset = &cmb->vset;
+  StrBuf *refbuf = &cmb->refbuf, *out = &cmb->outbuf;
+  size_t i, num_alts, minstart = SIZE_MAX, maxend = 0, refstart;
+  const char *ref;
+  const PackedRef *r;
+  Var *var = &vset->vars[0];
+  char saved;
+  uint64_t start;
+
+  if(vset->nvars == 1) {
+    varset_dump(cmb, stage);
+    return 0;
+  }
+
+  // Find reference chromosome
+  r = genomecursor_get_id(&cmb->cursor, cmb->genome, var->chrom,
+                          var->fields[VCHR],
+                          var->fields[VPOS] - var->fields[VCHR] - 1);
+  if(r == NULL)
+  {
+    warn("Cannot find chr: %s", var->fields[VCHR]);
+    varset_dump(cmb, stage);
+    return 0;
+  }
+
+  // Before anything is sized by nvars: the compatibility matrix grows with
+  // its square
+  if(vset->nvars > COMBO_MAX_VARS) {
+    warn("Cluster at %s:%s has more than %i entries, not combined",
+         var->fields[VCHR], var->fields[VPOS], COMBO_MAX_VARS);
+    varset_dump(cmb, stage);
+    return 0;
+  }
+
+  #ifdef DEBUG
+  printf(" MERGE! [nvars=%zu]\n", vset->nvars);
+  #endif
+
+  // Trimming alleles changes the lines, keep a copy if we may need them
+  saved = (cmb->max_haplotypes > 0 &&
+           varset_max_haplotypes(vset) > cmb->max_haplotypes);
+  if(saved) varset_save(vset, &cmb->saved);
+
+  for(i = 0; i < vset->nvars; i++)
+  {
+    var = &vset->vars[i];
+    var_trim_alts_starts(var);
+    var_trim_alts_ends(var);
+    if(combo_has_samples(cmb)) combo_save_row(cmb, i, var);
+    var_sort_alts(var);
+    var_remove_dup_alts(var);
+    minstart = MIN2(minstart, var->pos);
+    maxend = MAX2(maxend, var->pos + var->reflen);
+    #ifdef DEBUG
+      var_print(var);
+    #endif
+  }
+
+  if(maxend > r->len) die("Out of bounds: %s:%zu", var->fields[VCHR], maxend);
+
+  // Fetch upper case ref, including the base before in case we need to pad
+  refstart = minstart > 0 ? minstart-1 : 0;
+  strbuf_reset(refbuf);
+  packedref_append(r, refstart, maxend-refstart, refbuf);
+  ref = refbuf->b + (minstart-refstart);
+
+  vars_sort(vset->vars, vset->nvars);
+  varset_remove_duplicates(vset);
+
+  for(i = 0; i < vset->nvars; i++) vset->vars[i].pos -= minstart;
+  if(combo_has_samples(cmb))
+    for(i = 0; i < cmb->gm.nrows; i++) cmb->rows[i].pos -= minstart;
+
+  compat_build(&cmb->compat, vset->vars, vset->nvars);
+
+  if(saved &&
+     count_var_combinations(vset->vars, &cmb->compat) > cmb->max_haplotypes)
+  {
+    // Too many haplotypes, pass the entries through unchanged
+    warn("Cluster at %s:%s has more than %zu haplotypes, not combined",
+         vset->vars[0].fields[VCHR], vset->vars[0].fields[VPOS],
+         cmb->max_haplotypes);
+    saved_dump(cmb, stage);
+    return 0;
+  }
+
+  start = stats_start();
+  num_alts = generate_var_combinations(vset->vars, &cmb->compat,
+                                       ref, maxend-minstart, &cmb->alleles,
+                                       &cmb->nsets);
+  stats_stop(PHASE_COMBOS, start);
+  stats_add(STAT_HAPLOTYPES, num_alts);
+  char **alts = cmb->alleles.alleles;
+
+  int padding_base = -1;
+  if(minstart+1 != maxend || !alts_are_snps(alts, num_alts)) {
+    padding_base = minstart == 0 ? 'N' : refbuf->b[0];
+    #ifdef DEBUG
+      printf("pad: %c\n", padding_base);
+    #endif
+  }
+
+  strbuf_reset(out);
+  var = &vset->vars[0];
+
+  // Copy "CHROM-POS-ID-"
+  size_t pos = minstart + 1 - (padding_base != -1);
+  strbuf_append_str(out, var->fields[VCHR]);
+  strbuf_append_char(out, '\t');
+  strbuf_ensure_capacity(out, out->end + 22);
+  out->end += ulong_to_str(pos, out->b + out->end);
+  strbuf_append_char(out, '\t');
+  strbuf_append_str(out, var->fields[VID]);
+  strbuf_append_char(out, '\t');
+  // Copy "REF-"
+  if(padding_base != -1) strbuf_append_char(out, padding_base);
+  strbuf_append_strn(out, ref, maxend-minstart);
+  strbuf_append_char(out, '\t');
+  // ALT
+  print_alt_strings(alts, num_alts, padding_base, out);
+  strbuf_append_char(out, '\t');
+  // Append remaining. Joining the line would end alleles the calls use.
+  if(combo_has_samples(cmb)) {
+    for(i = VQUAL; i < VINFO; i++) {
+      strbuf_append_str(out, var->fields[i]);
+      strbuf_append_char(out, '\t');
+    }
+    strbuf_append_strn(out, var->fields[VINFO],
+                       var->fields[VFRMT] - var->fields[VINFO] - 1);
+    combo_print_genotypes(cmb, alts, num_alts, ref, maxend-minstart, out);
+  }
+  else {
+    for(i = 1; i < VFRMT; i++) var->fields[i][-1] = '\t';
+    strbuf_append_str(out, var->fields[VQUAL]);
+  }
+
+  prntbf(stage, out);
+  return 1;
+}
+
+static void combo_trace_flush(Combo *cmb)
+{
+  ComboTrace *trace = cmb->trace;
+  pthread_mutex_lock(&trace->lock);
+  if(fwrite(cmb->tracebuf.b, 1, cmb->tracebuf.end, trace->fh) !=
+     cmb->tracebuf.end) die("Cannot write trace");
+  pthread_mutex_unlock(&trace->lock);
+  strbuf_reset(&cmb->tracebuf);
+}
+
+// Combine a cluster, with a trace line if tracing. Single entries are not
+// traced, they cost next to nothing.
+static void varset_print(Combo *cmb, VcfStage *stage)
+{
+  VarSet *vset = &cmb->vset;
+  const Var *var = &vset->vars[0];
+  size_t i, chrlen, start = SIZE_MAX, end = 0;
+  uint64_t ns;
+  char combined;
+
+  stats_cluster(vset->nvars);
+
+  if(cmb->trace == NULL || vset->nvars == 1) {
+    varset_combine(cmb, stage);
+    return;
+  }
+
+  // Combining trims and moves the vars, get the region first
+  chrlen = var->fields[VPOS] - var->fields[VCHR] - 1;
+  for(i = 0; i < vset->nvars; i++) {
+    start = MIN2(start, vset->vars[i].pos);
+    end = MAX2(end, vset->vars[i].pos + vset->vars[i].reflen);
+  }
+
+  ns = stats_now();
+  combined = varset_combine(cmb, stage);
+  ns = stats_now() - ns;
+
+  // chrom start end nvars subsets genotypes alleles ns combined
+  strbuf_sprintf(&cmb->tracebuf,
+                 "%.*s\t%zu\t%zu\t%zu\t%zu\t%zu\t%zu\t%lu\t%i\n",
+                 (int)chrlen, var->fields[VCHR], start+1, end, vset->nvars,
+                 combined ? cmb->nsets : 0,
+                 combined ? cmb->alleles.nadded : 0,
+                 combined ? cmb->alleles.num : 0, (unsigned long)ns,
+                 combined);
+  if(cmb->tracebuf.end >= TRACE_BUF_SIZE) combo_trace_flush(cmb);
+}
+
+// ACCAT
+// 1 A T
+// 1 AC A
+// 2 CCA C
+// 4 A C
+
+// 0 'A' 'T'
+// 1 'C' ''
+// 2 'CA' ''
+// 3 'A' 'C','T'
+
+// [A|T][C|]C[A|C]
+// ACCA 000 ref
+// ACCC 001 var2
+// A-CA 010 var1
+// A-CC 011 var1+var2
+// TCCA 100 var0
+// TCCC 101 var0+var2
+// T-CA 110 var0+var1
+// T-CC 111 var0+var1+var2
+
+// ACCA 0000 ref
+// ACCC 0001 var3
+// AC-- 0010 var2
+// xxxx 0011 var2+var3
+// A-CA 0100 var1
+// A-CC 0101 var1+var3
+// A--- 0110 var1+var2
+// xxxx 0111 var1+var2+var3
+// TCCA 1000 var0
+// TCCC 1001 var0+var3
+// TC-- 1010 var0+var2
+// xxxx 1011 var0+var2+var3
+// T-CA 1100 var0+var1
+// T-CC 1101 var0+var1+var3
+// T--- 1110 var0+var1+var2
+// xxxx 1111 var0+var1+var2+var3
+
+// First entry of the cluster, NULL if there is none
+static const Var* combo_first(const Combo *cmb)
+{
+  if(cmb->pending) return &cmb->pend;
+  return cmb->vset.nvars > 0 ? &cmb->vset.vars[0] : NULL;
+}
+
+// Pass on the cluster and start a new one
+static void combo_end(Combo *cmb, VcfStage *stage)
+{
+  if(cmb->pending) {
+    stats_cluster(1);
+    vcfstage_emit_bcf(stage, cmb->first, 1);
+    cmb->pending = 0;
+  }
+  else if(cmb->vset.nvars > 0) varset_print(cmb, stage);
+  varset_reset(&cmb->vset);
+}
+
+// A second entry joins the cluster, so its first entry becomes a var
+static void combo_unpend(Combo *cmb, VcfStage *stage)
+{
+  varset_add_bcf(&cmb->vset, stage->hdr, cmb->first, &cmb->ks)->chrom =
+    cmb->pend.chrom;
+  cmb->pending = 0;
+}
+
+// Entries are buffered in vset while they overlap the first
+static void combo_entry(VcfStage *stage, LineSpan *line, VcfRecord *rec)
+{
+  Combo *cmb = stage->state;
+  VarSet *vset = &cmb->vset;
+  const Var *first;
+  int chrom;
+
+  if(rec->pos < 0) die("Bad line: %.*s\n", (int)line->len, line->b);
+  chrom = contigids_get(&cmb->contigs, line->b, vcfrecord_collen(rec, VCHR));
+
+  if((first = combo_first(cmb)) != NULL) {
+    if(first->chrom == chrom && (long)first->pos > rec->pos)
+      die("VCF not sorted: %.*s", (int)rec->len, rec->line);
+    // No overlap -> print buffered lines, start a new cluster
+    if(!var_overlaps(first, rec->pos, chrom, cmb->overlap))
+      combo_end(cmb, stage);
+    else if(cmb->pending) combo_unpend(cmb, stage);
+  }
+
+  if(cmb->genotypes && vset->nvars == 0)
+    gtmatrix_reset(&cmb->gm, stage->nsamples);
+  varset_add(vset, rec)->chrom = chrom;
+
+  // Reading samples from the reader may move the line, so do it last
+  if(cmb->genotypes) gtmatrix_add(&cmb->gm, rec, stage->samples);
+}
+
+// As combo_entry() for BCF input, without genotypes. Lone entries, most of
+// them, are passed on as records without being unpacked.
+static void combo_entry_bcf(VcfStage *stage, bcf1_t *rec, char sites)
+{
+  Combo *cmb = stage->state;
+  const char *chr = bcf_seqname(stage->hdr, rec);
+  const Var *first;
+  int chrom;
+  (void)sites;
+
+  if(rec->pos < 0) die("Bad entry at %s:%"PRId64, chr, rec->pos+1);
+  chrom = contigids_get(&cmb->contigs, chr, strlen(chr));
+
+  if((first = combo_first(cmb)) != NULL) {
+    if(first->chrom == chrom && (long)first->pos > rec->pos)
+      die("VCF not sorted: %s:%"PRId64, chr, rec->pos+1);
+    if(!var_overlaps(first, rec->pos, chrom, cmb->overlap))
+      combo_end(cmb, stage);
+    else if(cmb->pending) combo_unpend(cmb, stage);
+  }
+
+  if(cmb->vset.nvars > 0) {
+    varset_add_bcf(&cmb->vset, stage->hdr, rec, &cmb->ks)->chrom = chrom;
+    return;
+  }
+
+  // Until another joins it, its extent is rlen, which is the REF length
+  // unless INFO/END says otherwise
+  if(bcf_copy(cmb->first, rec) == NULL) die("Out of memory");
+  cmb->pending = 1;
+  cmb->pend.pos = rec->pos;
+  cmb->pend.reflen = rec->rlen;
+  cmb->pend.chrom = chrom;
+}
+
+static void combo_flush(VcfStage *stage)
+{
+  combo_end(stage->state, stage);
+}
+
+// Returns the offset of the last line in block to start a cluster, using the
+// same test as var_overlaps(). Only CHROM, POS and REF are read, entries are
+// checked in full by combo_entry(). Returning 0 means every entry so far is
+// in the cluster started by the first, so a call that resumes at *scanned
+// only has to find that first entry again.
+static size_t combo_cut(const VcfStage *stage, const char *block, size_t len,
+                        size_t *scanned)
+{
+  const Combo *cmb = stage->state;
+  const char *line, *nl, *end = block + len, *chr = NULL;
+  size_t chrlen = 0, reflen = 0, cut = 0;
+  long pos = 0, npos;
+  uint32_t tabs[4];
+  int same_chr;
+
+  for(line = block; line < end; line = nl+1) {
+    nl = memchr(line, '\n', end - line);
+    if(line[0] == '#' || vcf_find_tabs(line, nl - line, tabs, 4) < 4) continue;
+    npos = vcf_parse_uint(line + tabs[0] + 1, tabs[1] - tabs[0] - 1);
+    if(npos <= 0) continue;
+    npos--;
+    same_chr = (chr != NULL && tabs[0] == chrlen &&
+                memcmp(chr, line, chrlen) == 0);
+    if(same_chr && pos > npos)
+      die("VCF not sorted: %.*s", (int)(nl - line), line);
+    if(!same_chr || (long)(pos + reflen + cmb->overlap - 1) < npos) {
+      chr = line;
+      chrlen = tabs[0];
+      pos = npos;
+      reflen = tabs[3] - tabs[2] - 1;
+      cut = line - block;
+    }
+    if(chr != NULL && nl+1 < block + *scanned) nl = block + *scanned - 1;
+  }
+
+  *scanned = len;
+  return cut;
+}
+
+// Contig ids follow the order of the ##contig lines
+static void combo_header(VcfStage *stage, LineSpan *line)
+{
+  Combo *cmb = stage->state;
+  contigids_header(&cmb->contigs, line->b, line->len);
+  if(cmb->genotypes) vcfstage_emit(stage, line->b, line->len);
+  else vcfstage_sites_header(stage, line);
+}
+
+static void combo_dealloc(VcfStage *stage)
+{
+  Combo *cmb = stage->state;
+  genomecursor_dealloc(&cmb->cursor, cmb->genome);
+  contigids_dealloc(&cmb->contigs);
+  varset_dealloc(&cmb->vset);
+  compat_dealloc(&cmb->compat);
+  alleleset_dealloc(&cmb->alleles);
+  strbuf_dealloc(&cmb->refbuf);
+  strbuf_dealloc(&cmb->outbuf);
+  strbuf_dealloc(&cmb->saved);
+  strbuf_dealloc(&cmb->gtbuf);
+  gtmatrix_dealloc(&cmb->gm);
+  if(cmb->trace != NULL && cmb->tracebuf.end > 0) combo_trace_flush(cmb);
+  strbuf_dealloc(&cmb->tracebuf);
+  free(cmb->rows);
+  free(cmb->call_vars);
+  free(cmb->call_alleles);
+  free(cmb->rank);
+  bcf_destroy(cmb->first);
+  free(cmb->ks.s);
+  free(cmb);
+}
+
+void combostage_alloc(VcfStage *stage, Genome *genome, int overlap,
+                      size_t max_haplotypes, char genotypes)
+{
+  Combo *cmb = malloc(sizeof(Combo));
+  if(cmb == NULL) die("Out of memory");
+  cmb->genome = genome;
+  cmb->overlap = overlap;
+  cmb->max_haplotypes = max_haplotypes;
+  varset_alloc(&cmb->vset);
+  compat_alloc(&cmb->compat);
+  alleleset_alloc(&cmb->alleles);
+  strbuf_alloc(&cmb->refbuf, 1024);
+  strbuf_alloc(&cmb->outbuf, 1024);
+  strbuf_alloc(&cmb->saved, 1024);
+  genomecursor_alloc(&cmb->cursor);
+  cmb->genotypes = genotypes;
+  gtmatrix_alloc(&cmb->gm);
+  strbuf_alloc(&cmb->gtbuf, 1024);
+  cmb->trace = NULL;
+  strbuf_alloc(&cmb->tracebuf, 1024);
+  cmb->nsets = 0;
+  contigids_alloc(&cmb->contigs);
+  if((cmb->first = bcf_init()) == NULL) die("Out of memory");
+  cmb->pending = 0;
+  cmb->ks = (kstring_t){0, 0, NULL};
+  cmb->cap_rows = cmb->cap_rank = 16;
+  cmb->rows = malloc(cmb->cap_rows * sizeof(Var));
+  cmb->call_vars = malloc(cmb->cap_rows * sizeof(Var*));
+  cmb->call_alleles = malloc(cmb->cap_rows * sizeof(size_t));
+  cmb->rank = malloc(cmb->cap_rank * sizeof(size_t));
+  if(cmb->rows == NULL || cmb->call_vars == NULL ||
+     cmb->call_alleles == NULL || cmb->rank == NULL) die("Out of memory");
+
+  memset(stage, 0, sizeof(VcfStage));
+  stage->entry = combo_entry;
+  // Genotypes are read from text
+  if(!genotypes) stage->entry_bcf = combo_entry_bcf;
+  stage->header = combo_header;
+  stage->flush = combo_flush;
+  stage->dealloc = combo_dealloc;
+  stage->cut = combo_cut;
+  stage->state = cmb;
+}
+
+void combostage_trace(VcfStage *stage, ComboTrace *trace)
+{
+  for(; stage != NULL; stage = stage->next)
+    if(stage->entry == combo_entry) ((Combo*)stage->state)->trace = trace;
+}
+
+void combotrace_open(ComboTrace *trace, const char *path)
+{
+  if(strcmp(path, "-") == 0) trace->fh = stderr;
+  else if((trace->fh = fopen(path, "w")) == NULL)
+    die("Cannot write trace to: %s", path);
+  pthread_mutex_init(&trace->lock, NULL);
+  fprintf(trace->fh, "#chrom\tstart\tend\tnvars\tsubsets\tgenotypes\t"
+                     "alleles\tns\tcombined\n");
+}
+
+void combotrace_close(ComboTrace *trace)
+{
+  if(trace->fh != stderr && fclose(trace->fh) != 0) die("Cannot write trace");
+  pthread_mutex_destroy(&trace->lock);
+}
@@ -0,0 +1,79 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "global.h"
+#include "contig_ids.h"
+#include "khash.h"
+
+KHASH_MAP_INIT_STR(cids, int)
+
+void contigids_alloc(ContigIds *ids)
+{
+  // unused functions
+  (void)kh_clear_cids;
+  (void)kh_del_cids;
+
+  ids->hash = kh_init(cids);
+  ids->nnames = 0;
+  ids->cap_names = 64;
+  ids->names = malloc(ids->cap_names * sizeof(char*));
+  if(ids->hash == NULL || ids->names == NULL) die("Out of memory");
+  ids->last = -1;
+  ids->lastlen = 0;
+  strbuf_alloc(&ids->key, 256);
+}
+
+void contigids_dealloc(ContigIds *ids)
+{
+  size_t i;
+  for(i = 0; i < ids->nnames; i++) free(ids->names[i]);
+  free(ids->names);
+  kh_destroy(cids, ids->hash);
+  strbuf_dealloc(&ids->key);
+}
+
+int contigids_get(ContigIds *ids, const char *name, size_t len)
+{
+  khiter_t k;
+  int hret;
+
+  if(ids->last >= 0 && ids->lastlen == len &&
+     memcmp(ids->names[ids->last], name, len) == 0) return ids->last;
+
+  strbuf_reset(&ids->key);
+  strbuf_append_strn(&ids->key, name, len);
+  k = kh_get(cids, ids->hash, ids->key.b);
+
+  if(k == kh_end(ids->hash)) {
+    if(ids->nnames == ids->cap_names) {
+      ids->cap_names *= 2;
+      ids->names = realloc(ids->names, ids->cap_names * sizeof(char*));
+      if(ids->names == NULL) die("Out of memory");
+    }
+    if((ids->names[ids->nnames] = strdup(ids->key.b)) == NULL)
+      die("Out of memory");
+    k = kh_put(cids, ids->hash, ids->names[ids->nnames], &hret);
+    kh_value(ids->hash, k) = ids->nnames++;
+  }
+
+  ids->last = kh_value(ids->hash, k);
+  ids->lastlen = len;
+  return ids->last;
+}
+
+void contigids_header(ContigIds *ids, const char *line, size_t len)
+{
+  const char *str, *end = line + len, *stop;
+
+  if(len < 10 || strncmp(line, "##contig=<", 10) != 0) return;
+
+  // ID is usually first but need not be
+  for(str = line + 10; str < end; str = stop+1) {
+    for(stop = str; stop < end && *stop != ',' && *stop != '>'; stop++) {}
+    if(stop - str > 3 && strncmp(str, "ID=", 3) == 0) {
+      contigids_get(ids, str+3, stop-str-3);
+      return;
+    }
+  }
+}
@@ -0,0 +1,32 @@
+#ifndef CONTIG_IDS_H_
+#define CONTIG_IDS_H_
+
+#include <stddef.h>
+#include "string_buffer.h"
+
+// Contig names interned to ids 0, 1, 2... so entries can be compared by
+// contig with an integer compare. Ids are given out in the order of the
+// ##contig header lines, then of first sight. Sorted input changes contig
+// rarely, so a lookup compares against the last contig before it hashes.
+
+struct kh_cids_s;
+
+typedef struct {
+  struct kh_cids_s *hash; // name -> id
+  char **names; // by id, NUL terminated
+  size_t nnames, cap_names;
+  int last; // id of the last lookup, -1 if none
+  size_t lastlen;
+  StrBuf key; // NUL terminated copy of the name being hashed
+} ContigIds;
+
+void contigids_alloc(ContigIds *ids);
+void contigids_dealloc(ContigIds *ids);
+
+// name does not need to be NUL terminated. Adds it if not seen before.
+int contigids_get(ContigIds *ids, const char *name, size_t len);
+
+// Add the ID of a ##contig=<ID=...> line, other lines are ignored
+void contigids_header(ContigIds *ids, const char *line, size_t len);
+
+#endif /* CONTIG_IDS_H_ */
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "hfile.h"
+
+#include "global.h"
+#include "contig_pool.h"
+
+typedef struct {
+  const char *path;
+  tbx_t *tbx;
+  const char **names;
+  size_t ncontigs, next; // next is the next contig to be taken
+  size_t stitched; // contigs in out
+  size_t ntmp; // temporary files not yet stitched
+  LineWriter *out;
+  LineWriter *outs; // temporary file of each contig not written to out
+  char *done, *direct; // direct if written straight to out
+  pthread_mutex_t lock; // guards all of the above but out
+  pthread_cond_t cond;
+  contig_func func;
+  void *arg;
+} ContigPool;
+
+typedef struct {
+  ContigPool *pool;
+  size_t worker;
+} ContigWorker;
+
+static void* contigpool_worker(void *ptr)
+{
+  const ContigWorker *wkr = ptr;
+  ContigPool *pool = wkr->pool;
+  LineReader rdr;
+  LineWriter *wtr;
+  size_t i;
+  char direct;
+
+  linereader_open(&rdr, pool->path, 1);
+
+  while(1)
+  {
+    // Contigs are taken in order, so the next to stitch is already taken and
+    // waiting here cannot hold it up
+    pthread_mutex_lock(&pool->lock);
+    while(pool->ntmp >= CONTIGPOOL_MAX_TMP)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    i = pool->next++;
+    direct = (i == pool->stitched);
+    if(i < pool->ncontigs && !direct) pool->ntmp++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if(i >= pool->ncontigs) break;
+
+    // Everything before this contig is in out, nothing else writes to it
+    // until we are done
+    if(direct) wtr = pool->out;
+    else {
+      wtr = &pool->outs[i];
+      linewriter_open_tmp(wtr);
+    }
+
+    linereader_query(&rdr, pool->tbx, i);
+    pool->func(wkr->worker, pool->names[i], &rdr, wtr, pool->arg);
+    if(!direct) linewriter_flush(wtr); // frees its buffer until it is stitched
+
+    pthread_mutex_lock(&pool->lock);
+    pool->direct[i] = direct;
+    pool->done[i] = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  linereader_close(&rdr);
+  return NULL;
+}
+
+// BCF is read through htslib's own reader, not by tabix region
+static char path_is_bcf(const char *path)
+{
+  hFILE *hf;
+  htsFormat fmt;
+  char is_bcf;
+  if((hf = hopen(path, "r")) == NULL) return 0;
+  is_bcf = (hts_detect_format(hf, &fmt) == 0 && fmt.format == bcf);
+  hclose(hf);
+  return is_bcf;
+}
+
+char contigpool_indexed(const char *path)
+{
+  tbx_t *tbx;
+  if(strcmp(path, "-") == 0 || path_is_bcf(path) ||
+     (tbx = tbx_index_load(path)) == NULL) return 0;
+  tbx_destroy(tbx);
+  return 1;
+}
+
+void contigpool_run(const char *path, size_t nthreads, LineWriter *out,
+                    contig_func func, void *arg)
+{
+  ContigPool pool;
+  size_t i;
+  int n;
+
+  if(strcmp(path, "-") == 0) die("Cannot use threads when reading from stdin");
+  if(path_is_bcf(path)) die("Cannot use --threads with BCF input: %s", path);
+  if((pool.tbx = tbx_index_load(path)) == NULL)
+    die("Threads need an indexed input (.tbi or .csi): %s", path);
+  if((pool.names = tbx_seqnames(pool.tbx, &n)) == NULL) die("Out of memory");
+
+  pool.path = path;
+  pool.ncontigs = n;
+  pool.next = pool.stitched = pool.ntmp = 0;
+  pool.out = out;
+  pool.func = func;
+  pool.arg = arg;
+  pool.outs = malloc(pool.ncontigs * sizeof(LineWriter));
+  pool.done = calloc(pool.ncontigs, sizeof(char));
+  pool.direct = calloc(pool.ncontigs, sizeof(char));
+  if(pool.ncontigs > 0 &&
+     (pool.outs == NULL || pool.done == NULL || pool.direct == NULL))
+    die("Out of memory");
+
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+
+  nthreads = MIN2(nthreads, MAX2(pool.ncontigs, 1));
+  pthread_t threads[nthreads];
+  ContigWorker workers[nthreads];
+
+  for(i = 0; i < nthreads; i++) {
+    workers[i] = (ContigWorker){.pool = &pool, .worker = i};
+    if(pthread_create(&threads[i], NULL, contigpool_worker, &workers[i]) != 0)
+      die("Cannot start thread");
+  }
+
+  // Stitch contigs back together in order
+  for(i = 0; i < pool.ncontigs; i++) {
+    pthread_mutex_lock(&pool.lock);
+    while(!pool.done[i]) pthread_cond_wait(&pool.cond, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    if(!pool.direct[i]) {
+      linewriter_append(out, &pool.outs[i]);
+      linewriter_close(&pool.outs[i]);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stitched = i+1;
+    pool.ntmp -= !pool.direct[i];
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  for(i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.cond);
+  free(pool.outs);
+  free(pool.done);
+  free(pool.direct);
+  free(pool.names);
+  tbx_destroy(pool.tbx);
+}
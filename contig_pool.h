@@ -0,0 +1,29 @@
+#ifndef CONTIG_POOL_H_
+#define CONTIG_POOL_H_
+
+#include "line_reader.h"
+#include "line_writer.h"
+
+// Process each contig of a tabix/CSI indexed BGZF VCF on its own thread.
+// nthreads workers take the next unprocessed contig from a shared counter, so
+// a worker that finishes a small contig moves straight on to the next one.
+// A contig taken once all contigs before it are written goes straight to the
+// output. Others are written to a temporary file, which is appended to the
+// output as soon as all contigs before it are done, so output order matches
+// input. At most CONTIGPOOL_MAX_TMP temporary files are open at once.
+
+// Called once per contig. worker is in [0,nthreads) and no two threads use
+// the same worker at the same time, so it can index per-thread state.
+#define CONTIGPOOL_MAX_TMP 256
+
+typedef void (*contig_func)(size_t worker, const char *contig,
+                            LineReader *rdr, LineWriter *wtr, void *arg);
+
+// Returns 1 if path has a tabix or CSI index we can use
+char contigpool_indexed(const char *path);
+
+// Header lines are not passed to func, they should be written to out first
+void contigpool_run(const char *path, size_t nthreads, LineWriter *out,
+                    contig_func func, void *arg);
+
+#endif /* CONTIG_POOL_H_ */
@@ -4,3 +4,6 @@
 
 # Combine calls within 10bp of each other
 ./bin/vcfcombine 10 tests/refcorrect.vcf tests/ref.fa > tests/combined.vcf
+
+# Or both steps in one process, loading the reference once
+./bin/vcfhack run -S ref:swap,combine:10 tests/calls.vcf tests/ref.fa > tests/combined.vcf
@@ -0,0 +1,456 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "global.h"
+#include "genome.h"
+#include "seq_file.h"
+#include "khash.h"
+
+KHASH_MAP_INIT_STR(ghash, GenomeChrom*)
+
+#define packedref_mem(r) \
+  (packedref_nwords((r)->len) * sizeof(uint64_t) + (r)->cap_runs * sizeof(RefRun))
+
+// Reference image: header, chrom table, NUL terminated names, then for each
+// chrom its packed words followed by its runs. Offsets are from the start of
+// the file, all 8 byte aligned. Integers are in host byte order.
+#define GENOME_IMG_MAGIC "VCFHREF1"
+
+typedef struct {
+  char magic[8];
+  uint64_t nchroms, runsize; // runsize is sizeof(RefRun) when written
+} GenomeImgHeader;
+
+typedef struct {
+  uint64_t name, len, words, runs, nruns;
+} GenomeImgChrom;
+
+#define roundup8(x) (((x)+7) & ~(uint64_t)7)
+
+void genome_alloc(Genome *genome, size_t max_mem)
+{
+  // compiler complains about unused function without these linese
+  (void)kh_clear_ghash;
+  (void)kh_del_ghash;
+
+  genome->hash = kh_init(ghash);
+  genome->nchroms = genome->nfais = genome->nimgs = 0;
+  genome->cap_chroms = genome->cap_fais = genome->cap_imgs = 16;
+  genome->chroms = malloc(genome->cap_chroms * sizeof(GenomeChrom*));
+  genome->fais = malloc(genome->cap_fais * sizeof(faidx_t*));
+  genome->imgs = malloc(genome->cap_imgs * sizeof(GenomeImg));
+  if(genome->chroms == NULL || genome->fais == NULL || genome->imgs == NULL)
+    die("Out of memory");
+  genome->lru_head = genome->lru_tail = NULL;
+  genome->mem = 0;
+  genome->max_mem = max_mem;
+  pthread_mutex_init(&genome->lock, NULL);
+  pthread_mutex_init(&genome->fai_lock, NULL);
+  pthread_cond_init(&genome->loaded, NULL);
+}
+
+void genome_dealloc(Genome *genome)
+{
+  size_t i;
+  GenomeChrom *chrom;
+  for(i = 0; i < genome->nchroms; i++) {
+    chrom = genome->chroms[i];
+    if(chrom->ref.words != NULL && !chrom->mapped) packedref_dealloc(&chrom->ref);
+    free(chrom->name);
+    free(chrom);
+  }
+  for(i = 0; i < genome->nfais; i++) fai_destroy(genome->fais[i]);
+  for(i = 0; i < genome->nimgs; i++)
+    munmap(genome->imgs[i].ptr, genome->imgs[i].len);
+  kh_destroy(ghash, genome->hash);
+  free(genome->chroms);
+  free(genome->fais);
+  free(genome->imgs);
+  pthread_mutex_destroy(&genome->lock);
+  pthread_mutex_destroy(&genome->fai_lock);
+  pthread_cond_destroy(&genome->loaded);
+}
+
+// Returns NULL if name already taken
+static GenomeChrom* genome_add(Genome *genome, const char *name, faidx_t *fai)
+{
+  GenomeChrom *chrom;
+  khiter_t k;
+  int hret;
+
+  if((chrom = calloc(1, sizeof(GenomeChrom))) == NULL ||
+     (chrom->name = strdup(name)) == NULL) die("Out of memory");
+
+  k = kh_put(ghash, genome->hash, chrom->name, &hret);
+  if(hret == 0) {
+    warn("Duplicate read name (taking first): %s", name);
+    free(chrom->name);
+    free(chrom);
+    return NULL;
+  }
+  kh_value(genome->hash, k) = chrom;
+  chrom->fai = fai;
+
+  if(genome->nchroms == genome->cap_chroms) {
+    genome->cap_chroms *= 2;
+    genome->chroms = realloc(genome->chroms,
+                             genome->cap_chroms * sizeof(GenomeChrom*));
+    if(genome->chroms == NULL) die("Out of memory");
+  }
+  genome->chroms[genome->nchroms++] = chrom;
+  return chrom;
+}
+
+static void genome_index(Genome *genome, const char *path)
+{
+  faidx_t *fai;
+  int i, n;
+
+  if((fai = fai_load(path)) == NULL) die("Cannot load index for: %s", path);
+
+  if(genome->nfais == genome->cap_fais) {
+    genome->cap_fais *= 2;
+    genome->fais = realloc(genome->fais, genome->cap_fais * sizeof(faidx_t*));
+    if(genome->fais == NULL) die("Out of memory");
+  }
+  genome->fais[genome->nfais++] = fai;
+
+  n = faidx_nseq(fai);
+  for(i = 0; i < n; i++) genome_add(genome, faidx_iseq(fai, i), fai);
+
+  fprintf(stderr, "Indexed: %s [%i chroms]\n", path, n);
+}
+
+// Returns 0 if path is not a reference image
+static int genome_mmap(Genome *genome, const char *path)
+{
+  int fd;
+  struct stat st;
+  GenomeImgHeader hdr;
+  const GenomeImgChrom *table, *c;
+  GenomeChrom *chrom;
+  char *img;
+  size_t i, size;
+
+  if((fd = open(path, O_RDONLY)) == -1) die("Cannot open file: %s", path);
+  if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+     (size_t)st.st_size < sizeof(hdr) ||
+     read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+     memcmp(hdr.magic, GENOME_IMG_MAGIC, 8) != 0) {
+    close(fd);
+    return 0;
+  }
+
+  if(hdr.runsize != sizeof(RefRun))
+    die("Reference image written on an incompatible machine: %s", path);
+  size = st.st_size;
+  if(hdr.nchroms > (size - sizeof(hdr)) / sizeof(GenomeImgChrom))
+    die("Corrupt reference image: %s", path);
+
+  img = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(img == MAP_FAILED) die("Cannot mmap file: %s", path);
+
+  if(genome->nimgs == genome->cap_imgs) {
+    genome->cap_imgs *= 2;
+    genome->imgs = realloc(genome->imgs, genome->cap_imgs * sizeof(GenomeImg));
+    if(genome->imgs == NULL) die("Out of memory");
+  }
+  genome->imgs[genome->nimgs++] = (GenomeImg){.ptr = img, .len = size};
+
+  table = (const GenomeImgChrom*)(img + sizeof(hdr));
+  for(i = 0; i < hdr.nchroms; i++)
+  {
+    c = table + i;
+    // Offsets and sizes are checked without overflowing, and names must end
+    // within the file
+    if(c->name >= size ||
+       memchr(img + c->name, '\0', size - c->name) == NULL ||
+       c->words > size ||
+       packedref_nwords(c->len) > (size - c->words) / sizeof(uint64_t) ||
+       c->runs > size || c->nruns > (size - c->runs) / sizeof(RefRun))
+      die("Corrupt reference image: %s", path);
+
+    if((chrom = genome_add(genome, img + c->name, NULL)) != NULL) {
+      chrom->mapped = 1;
+      chrom->ref = (PackedRef){.name = chrom->name, .len = c->len,
+                               .words = (uint64_t*)(img + c->words),
+                               .runs = (RefRun*)(img + c->runs),
+                               .nruns = c->nruns, .cap_runs = c->nruns};
+    }
+  }
+
+  fprintf(stderr, "Mapped: %s [%zu chroms]\n", path, (size_t)hdr.nchroms);
+  return 1;
+}
+
+char genome_add_seq(Genome *genome, const char *name,
+                    const char *seq, size_t len)
+{
+  GenomeChrom *chrom = genome_add(genome, name, NULL);
+  if(chrom != NULL) packedref_pack(&chrom->ref, name, seq, len);
+  return chrom != NULL;
+}
+
+static void genome_read(Genome *genome, const char *path)
+{
+  seq_file_t *sf;
+  read_t r;
+  size_t len = strlen(path);
+  char fai_path[len+5];
+
+  memcpy(fai_path, path, len);
+  strcpy(fai_path+len, ".fai");
+
+  if(strcmp(path, "-") != 0) {
+    if(genome_mmap(genome, path)) return;
+    if(access(fai_path, R_OK) == 0) { genome_index(genome, path); return; }
+  }
+
+  if((sf = seq_open(path)) == NULL) die("Cannot open file: %s\n", path);
+  if(seq_read_alloc(&r) == NULL) die("Out of memory");
+
+  while(seq_read(sf, &r) > 0)
+  {
+    seq_read_truncate_name(&r);
+    if(genome_add_seq(genome, r.name.b, r.seq.b, r.seq.end))
+      fprintf(stderr, "Loaded: '%s'\n", r.name.b);
+  }
+
+  seq_read_dealloc(&r);
+  seq_close(sf);
+}
+
+void genome_load(Genome *genome, const char *path)
+{
+  uint64_t start = stats_start();
+  genome_read(genome, path);
+  stats_stop(PHASE_REF_LOAD, start);
+}
+
+static void lru_remove(Genome *genome, GenomeChrom *chrom)
+{
+  if(chrom->prev != NULL) chrom->prev->next = chrom->next;
+  else genome->lru_head = chrom->next;
+  if(chrom->next != NULL) chrom->next->prev = chrom->prev;
+  else genome->lru_tail = chrom->prev;
+  chrom->prev = chrom->next = NULL;
+}
+
+static void lru_push_front(Genome *genome, GenomeChrom *chrom)
+{
+  chrom->prev = NULL;
+  chrom->next = genome->lru_head;
+  if(genome->lru_head != NULL) genome->lru_head->prev = chrom;
+  else genome->lru_tail = chrom;
+  genome->lru_head = chrom;
+}
+
+// Drop least recently used chromosomes until we are within our memory limit.
+// Never drops the most recently used or pinned chromosomes.
+static void genome_trim(Genome *genome)
+{
+  GenomeChrom *chrom, *prev;
+  for(chrom = genome->lru_tail;
+      genome->max_mem > 0 && genome->mem > genome->max_mem &&
+      chrom != genome->lru_head; chrom = prev)
+  {
+    prev = chrom->prev;
+    if(chrom->pins > 0) continue;
+    lru_remove(genome, chrom);
+    genome->mem -= packedref_mem(&chrom->ref);
+    packedref_dealloc(&chrom->ref);
+    chrom->ref.words = NULL;
+  }
+}
+
+// Called without the cache lock. A faidx_t is not safe to share between
+// threads, so reads are serialised on fai_lock; packing runs in parallel.
+static void genome_fetch(Genome *genome, GenomeChrom *chrom, PackedRef *ref)
+{
+  char *seq;
+  int len;
+  uint64_t start = stats_start();
+
+  pthread_mutex_lock(&genome->fai_lock);
+  seq = faidx_fetch_seq(chrom->fai, chrom->name, 0, INT_MAX, &len);
+  pthread_mutex_unlock(&genome->fai_lock);
+  if(seq == NULL || len < 0) die("Cannot fetch chrom: %s", chrom->name);
+  packedref_pack(ref, chrom->name, seq, len);
+  free(seq);
+
+  stats_stop(PHASE_REF_LOAD, start);
+  fprintf(stderr, "Loaded: '%s'\n", chrom->name);
+}
+
+// Hash is not modified after loading, so lookups do not need the lock
+static GenomeChrom* genome_find(Genome *genome, const char *name)
+{
+  khiter_t k = kh_get(ghash, genome->hash, name);
+  return k == kh_end(genome->hash) ? NULL : kh_value(genome->hash, k);
+}
+
+// Move to the front of the LRU list, loading if needed. Caller holds the lock,
+// which is dropped while the chromosome is read and packed. A chromosome that
+// is loading is not on the LRU list, so it cannot be trimmed meanwhile.
+static void genome_touch(Genome *genome, GenomeChrom *chrom)
+{
+  PackedRef ref;
+
+  while(chrom->loading) pthread_cond_wait(&genome->loaded, &genome->lock);
+
+  if(chrom->ref.words == NULL) {
+    chrom->loading = 1;
+    pthread_mutex_unlock(&genome->lock);
+    genome_fetch(genome, chrom, &ref);
+    pthread_mutex_lock(&genome->lock);
+    chrom->ref = ref;
+    chrom->loading = 0;
+    genome->mem += packedref_mem(&chrom->ref);
+    pthread_cond_broadcast(&genome->loaded);
+  }
+  else lru_remove(genome, chrom);
+  lru_push_front(genome, chrom);
+  genome_trim(genome);
+}
+
+const PackedRef* genome_get(Genome *genome, const char *name)
+{
+  GenomeChrom *chrom = genome_find(genome, name);
+  if(chrom == NULL) return NULL;
+
+  if(chrom->fai != NULL) {
+    pthread_mutex_lock(&genome->lock);
+    genome_touch(genome, chrom);
+    pthread_mutex_unlock(&genome->lock);
+  }
+
+  return &chrom->ref;
+}
+
+const PackedRef* genome_pin(Genome *genome, const char *name)
+{
+  GenomeChrom *chrom = genome_find(genome, name);
+  if(chrom == NULL) return NULL;
+
+  if(chrom->fai != NULL) {
+    pthread_mutex_lock(&genome->lock);
+    chrom->pins++;
+    genome_touch(genome, chrom);
+    pthread_mutex_unlock(&genome->lock);
+  }
+
+  return &chrom->ref;
+}
+
+void genome_unpin(Genome *genome, const char *name)
+{
+  GenomeChrom *chrom = genome_find(genome, name);
+  if(chrom == NULL || chrom->fai == NULL) return;
+
+  pthread_mutex_lock(&genome->lock);
+  chrom->pins--;
+  genome_trim(genome);
+  pthread_mutex_unlock(&genome->lock);
+}
+
+void genomecursor_alloc(GenomeCursor *gc)
+{
+  strbuf_alloc(&gc->name, 256);
+  gc->ref = NULL;
+  gc->id = -1;
+}
+
+void genomecursor_dealloc(GenomeCursor *gc, Genome *genome)
+{
+  if(gc->name.end > 0) genome_unpin(genome, gc->name.b);
+  strbuf_dealloc(&gc->name);
+}
+
+const PackedRef* genomecursor_get(GenomeCursor *gc, Genome *genome,
+                                  const char *chrom, size_t len)
+{
+  if(gc->name.end == len && gc->name.end > 0 &&
+     memcmp(gc->name.b, chrom, len) == 0) return gc->ref;
+
+  if(gc->name.end > 0) genome_unpin(genome, gc->name.b);
+  strbuf_reset(&gc->name);
+  strbuf_append_strn(&gc->name, chrom, len);
+  gc->id = -1;
+  return (gc->ref = genome_pin(genome, gc->name.b));
+}
+
+const PackedRef* genomecursor_get_id(GenomeCursor *gc, Genome *genome, int id,
+                                     const char *chrom, size_t len)
+{
+  if(id >= 0 && id == gc->id) return gc->ref;
+  genomecursor_get(gc, genome, chrom, len);
+  gc->id = id;
+  return gc->ref;
+}
+
+static void safe_fwrite(const void *ptr, size_t len, FILE *fh, const char *path)
+{
+  if(len > 0 && fwrite(ptr, 1, len, fh) != len)
+    die("Cannot write to file: %s", path);
+}
+
+void genome_save_image(Genome *genome, const char *path)
+{
+  FILE *fh;
+  GenomeImgHeader hdr;
+  GenomeImgChrom *table;
+  const PackedRef *r;
+  const char *name;
+  size_t i, len, nwords;
+  uint64_t offset, zero = 0;
+
+  if((fh = fopen(path, "w")) == NULL) die("Cannot write to file: %s", path);
+  table = calloc(genome->nchroms, sizeof(GenomeImgChrom));
+  if(table == NULL) die("Out of memory");
+
+  // Names follow the chrom table, which we write last
+  offset = sizeof(hdr) + genome->nchroms * sizeof(GenomeImgChrom);
+  if(fseek(fh, offset, SEEK_SET) != 0) die("Cannot seek in file: %s", path);
+
+  for(i = 0; i < genome->nchroms; i++) {
+    name = genome->chroms[i]->name;
+    len = strlen(name)+1;
+    safe_fwrite(name, len, fh, path);
+    table[i].name = offset;
+    offset += len;
+  }
+  safe_fwrite(&zero, roundup8(offset) - offset, fh, path);
+  offset = roundup8(offset);
+
+  for(i = 0; i < genome->nchroms; i++) {
+    r = genome_get(genome, genome->chroms[i]->name);
+    nwords = packedref_nwords(r->len);
+    table[i].len = r->len;
+    table[i].words = offset;
+    table[i].runs = offset + nwords * sizeof(uint64_t);
+    table[i].nruns = r->nruns;
+    safe_fwrite(r->words, nwords * sizeof(uint64_t), fh, path);
+    safe_fwrite(r->runs, r->nruns * sizeof(RefRun), fh, path);
+    offset = table[i].runs + r->nruns * sizeof(RefRun);
+    safe_fwrite(&zero, roundup8(offset) - offset, fh, path);
+    offset = roundup8(offset);
+  }
+
+  memcpy(hdr.magic, GENOME_IMG_MAGIC, 8);
+  hdr.nchroms = genome->nchroms;
+  hdr.runsize = sizeof(RefRun);
+
+  if(fseek(fh, 0, SEEK_SET) != 0) die("Cannot seek in file: %s", path);
+  safe_fwrite(&hdr, sizeof(hdr), fh, path);
+  safe_fwrite(table, genome->nchroms * sizeof(GenomeImgChrom), fh, path);
+  if(fclose(fh) != 0) die("Cannot write to file: %s", path);
+
+  free(table);
+}
@@ -0,0 +1,93 @@
+#ifndef GENOME_H_
+#define GENOME_H_
+
+#include <pthread.h>
+#include "packed_ref.h"
+#include "faidx.h"
+
+// Set of reference chromosomes looked up by name. FASTA files with a .fai
+// index are loaded lazily: a chromosome is only read and packed the first time
+// it is requested. Lazily loaded chromosomes are kept in an LRU cache that is
+// trimmed to max_mem bytes (0 for no limit). Reference images written by
+// genome_save_image() are mmap'd. Other files are loaded in full.
+// Once loading is done genome_get(), genome_pin() and genome_unpin() may be
+// called from multiple threads.
+
+typedef struct GenomeChrom GenomeChrom;
+
+struct GenomeChrom {
+  char *name;
+  faidx_t *fai; // NULL if not lazily loaded
+  PackedRef ref; // ref.words is NULL if not loaded
+  char mapped; // ref points into an mmap'd image
+  char loading; // being read by another thread, wait on Genome.loaded
+  size_t pins; // pinned chromosomes are not dropped from the cache
+  GenomeChrom *prev, *next; // LRU list, most recently used first
+};
+
+struct kh_ghash_s;
+
+typedef struct {
+  void *ptr;
+  size_t len;
+} GenomeImg;
+
+typedef struct {
+  struct kh_ghash_s *hash;
+  GenomeChrom **chroms;
+  faidx_t **fais;
+  GenomeImg *imgs;
+  size_t nchroms, cap_chroms, nfais, cap_fais, nimgs, cap_imgs;
+  GenomeChrom *lru_head, *lru_tail;
+  size_t mem, max_mem;
+  pthread_mutex_t lock; // guards the LRU cache
+  pthread_cond_t loaded; // signalled when a chromosome finishes loading
+  pthread_mutex_t fai_lock; // guards reads from fais
+} Genome;
+
+void genome_alloc(Genome *genome, size_t max_mem);
+void genome_dealloc(Genome *genome);
+
+// Load, index or mmap a FASTA/FASTQ file or reference image. "-" reads from
+// stdin
+void genome_load(Genome *genome, const char *path);
+
+// Add a chromosome from memory. Returns 0 if name is already taken.
+char genome_add_seq(Genome *genome, const char *name,
+                    const char *seq, size_t len);
+
+// Write all chromosomes to a binary image that genome_load() can mmap
+void genome_save_image(Genome *genome, const char *path);
+
+// Returns NULL if chromosome not found. Returned pointer is only valid until
+// the next call to genome_get(), unless the chromosome is pinned
+const PackedRef* genome_get(Genome *genome, const char *chrom);
+
+// Load a chromosome and keep it in memory until genome_unpin() is called, for
+// threads that each work on a different chromosome. Returns NULL if not found.
+const PackedRef* genome_pin(Genome *genome, const char *chrom);
+void genome_unpin(Genome *genome, const char *chrom);
+
+// One thread's view of the genome: remembers the last chromosome looked up
+// and keeps it pinned until a different one is asked for. Sorted input only
+// does a hash lookup when the chromosome changes.
+typedef struct {
+  StrBuf name;
+  const PackedRef *ref; // NULL if name not found
+  int id; // ContigIds id of name, -1 if looked up by name
+} GenomeCursor;
+
+void genomecursor_alloc(GenomeCursor *gc);
+void genomecursor_dealloc(GenomeCursor *gc, Genome *genome);
+
+// chrom does not need to be NUL terminated. Returns NULL if not found.
+const PackedRef* genomecursor_get(GenomeCursor *gc, Genome *genome,
+                                  const char *chrom, size_t len);
+
+// As genomecursor_get() for a chrom already interned as id, which is all it
+// compares unless the chromosome changes. Ids must all come from one
+// ContigIds.
+const PackedRef* genomecursor_get_id(GenomeCursor *gc, Genome *genome, int id,
+                                     const char *chrom, size_t len);
+
+#endif /* GENOME_H_ */
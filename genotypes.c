@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "global.h"
+#include "genotypes.h"
+
+#define SAMPLE_BITS 6
+#define GT_CODE_MISSING 2
+#define GT_CODE_OVERFLOW 3
+
+#define gt_offset(gm,row,sample) \
+  (((row) * (gm)->nsamples + (sample)) * SAMPLE_BITS)
+
+void gtmatrix_alloc(GtMatrix *gm)
+{
+  if((gm->bits = bit_array_create(0)) == NULL) die("Out of memory");
+  gm->cap_overflow = 64;
+  gm->overflow = malloc(gm->cap_overflow * sizeof(GtOverflow));
+  if(gm->overflow == NULL) die("Out of memory");
+  gm->noverflow = gm->nsamples = gm->nrows = 0;
+}
+
+void gtmatrix_dealloc(GtMatrix *gm)
+{
+  bit_array_free(gm->bits);
+  free(gm->overflow);
+}
+
+void gtmatrix_reset(GtMatrix *gm, size_t nsamples)
+{
+  gm->nsamples = nsamples;
+  gm->nrows = gm->noverflow = 0;
+}
+
+static inline void gt_set_bit(BIT_ARRAY *bits, size_t i, char value)
+{
+  if(value) bit_array_set(bits, i);
+  else bit_array_clear(bits, i);
+}
+
+static inline void gtmatrix_set_call(GtMatrix *gm, size_t offset, int allele)
+{
+  int code = allele == GT_MISSING ? GT_CODE_MISSING : allele;
+
+  if(allele > 1) {
+    code = GT_CODE_OVERFLOW;
+    if(gm->noverflow == gm->cap_overflow) {
+      gm->cap_overflow *= 2;
+      gm->overflow = realloc(gm->overflow,
+                             gm->cap_overflow * sizeof(GtOverflow));
+      if(gm->overflow == NULL) die("Out of memory");
+    }
+    gm->overflow[gm->noverflow++] = (GtOverflow){.key = offset,
+                                                 .allele = allele};
+  }
+
+  gt_set_bit(gm->bits, offset, code & 1);
+  gt_set_bit(gm->bits, offset+1, code >> 1);
+}
+
+// Sample columns arrive as pieces of text split anywhere, starting with the
+// tab before the first sample
+typedef struct {
+  GtMatrix *gm;
+  char where[64]; // CHROM:POS for errors, the line may have moved
+  size_t gt_field; // index of GT in FORMAT, SIZE_MAX if none
+  size_t sample, field, ncalls;
+  int calls[2], allele;
+  char in_gt, skip, phased;
+} GtParser;
+
+static void gtparser_end_call(GtParser *p)
+{
+  if(p->ncalls == 2)
+    die("Only haploid and diploid genotypes are supported: %s", p->where);
+  p->calls[p->ncalls++] = p->allele;
+  p->allele = GT_MISSING;
+}
+
+static void gtparser_end_sample(GtParser *p)
+{
+  GtMatrix *gm = p->gm;
+  size_t offset = gt_offset(gm, gm->nrows, p->sample);
+
+  if(p->in_gt) gtparser_end_call(p);
+  if(p->ncalls == 0) p->calls[p->ncalls++] = GT_MISSING;
+  if(p->sample >= gm->nsamples)
+    die("More samples than in the header: %s", p->where);
+
+  gtmatrix_set_call(gm, offset, p->calls[0]);
+  gtmatrix_set_call(gm, offset+2, p->ncalls == 2 ? p->calls[1] : 0);
+  gt_set_bit(gm->bits, offset+4, p->ncalls == 1);
+  gt_set_bit(gm->bits, offset+5, p->phased);
+}
+
+static void gtparser_next_sample(GtParser *p)
+{
+  if(p->sample != SIZE_MAX) gtparser_end_sample(p);
+  p->sample++;
+  p->field = p->ncalls = 0;
+  p->allele = GT_MISSING;
+  p->phased = 0;
+  p->in_gt = (p->gt_field == 0);
+  p->skip = (p->gt_field == SIZE_MAX);
+}
+
+static void gtparser_parse(GtParser *p, const char *str, size_t len)
+{
+  const char *end = str + len, *tab;
+  char c;
+
+  while(str < end) {
+    if(p->skip) {
+      // Not GT, move on to the next sample
+      if((tab = memchr(str, '\t', end - str)) == NULL) return;
+      str = tab;
+      p->skip = 0;
+    }
+
+    c = *str++;
+    if(c == '\t') gtparser_next_sample(p);
+    else if(!p->in_gt) {
+      if(c == ':' && ++p->field == p->gt_field) p->in_gt = 1;
+    }
+    else if(c >= '0' && c <= '9') {
+      p->allele = (p->allele == GT_MISSING ? 0 : p->allele * 10) + (c - '0');
+    }
+    else if(c == '/' || c == '|') {
+      gtparser_end_call(p);
+      p->phased = (c == '|');
+    }
+    else if(c == ':') {
+      gtparser_end_call(p);
+      p->in_gt = 0;
+      p->skip = 1;
+    }
+  }
+}
+
+// Index of GT in the FORMAT column, SIZE_MAX if not there
+static size_t format_gt_field(const VcfRecord *rec)
+{
+  const char *str = vcfrecord_col(rec, VFRMT), *colon;
+  const char *end = str + vcfrecord_collen(rec, VFRMT);
+  size_t i;
+
+  for(i = 0; str < end; i++, str = colon+1) {
+    if((colon = memchr(str, ':', end - str)) == NULL) colon = end;
+    if(colon - str == 2 && str[0] == 'G' && str[1] == 'T') return i;
+  }
+  return SIZE_MAX;
+}
+
+void gtmatrix_add(GtMatrix *gm, const VcfRecord *rec, LineReader *rdr)
+{
+  LineSpan part;
+  size_t nbits = (gm->nrows + 1) * gm->nsamples * SAMPLE_BITS;
+  size_t have = bit_array_length(gm->bits);
+  GtParser p = {.gm = gm, .sample = SIZE_MAX, .skip = 1};
+
+  if(have < nbits && !bit_array_resize(gm->bits, MAX2(nbits, 2*have)))
+    die("Out of memory");
+
+  snprintf(p.where, sizeof(p.where), "%.*s:%.*s",
+           (int)vcfrecord_collen(rec, VCHR), vcfrecord_col(rec, VCHR),
+           (int)vcfrecord_collen(rec, VPOS), vcfrecord_col(rec, VPOS));
+  p.gt_field = format_gt_field(rec);
+  if(rec->cols[9] <= rec->len)
+    gtparser_parse(&p, rec->line + rec->cols[9] - 1,
+                   rec->len - rec->cols[9] + 1);
+
+  while(rdr != NULL && linereader_samples(rdr, &part))
+    gtparser_parse(&p, part.b, part.len);
+
+  if(p.sample != SIZE_MAX) gtparser_end_sample(&p);
+
+  // Samples with no column are missing
+  for(p.sample++; p.sample < gm->nsamples; p.sample++) {
+    p.ncalls = p.in_gt = p.phased = 0;
+    gtparser_end_sample(&p);
+  }
+
+  gm->nrows++;
+}
+
+int gtmatrix_call(const GtMatrix *gm, size_t row, size_t sample, size_t call)
+{
+  size_t offset = gt_offset(gm, row, sample) + 2*call;
+  size_t lo = 0, hi = gm->noverflow, mid;
+  int code = bit_array_get(gm->bits, offset) |
+             (bit_array_get(gm->bits, offset+1) << 1);
+
+  if(code == GT_CODE_MISSING) return GT_MISSING;
+  if(code != GT_CODE_OVERFLOW) return code;
+
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(gm->overflow[mid].key < offset) lo = mid + 1;
+    else hi = mid;
+  }
+  return gm->overflow[lo].allele;
+}
+
+char gtmatrix_haploid(const GtMatrix *gm, size_t row, size_t sample)
+{
+  return bit_array_get(gm->bits, gt_offset(gm, row, sample) + 4);
+}
+
+char gtmatrix_phased(const GtMatrix *gm, size_t row, size_t sample)
+{
+  return bit_array_get(gm->bits, gt_offset(gm, row, sample) + 5);
+}
+
+static void gt_append_allele(StrBuf *out, int allele)
+{
+  if(allele == GT_MISSING) strbuf_append_char(out, '.');
+  else if(allele < 10) strbuf_append_char(out, '0' + allele);
+  else {
+    strbuf_ensure_capacity(out, out->end + 22);
+    out->end += ulong_to_str(allele, out->b + out->end);
+  }
+}
+
+void gt_append(StrBuf *out, int a0, int a1, char haploid, char phased)
+{
+  gt_append_allele(out, a0);
+  if(!haploid) {
+    strbuf_append_char(out, phased ? '|' : '/');
+    gt_append_allele(out, a1);
+  }
+}
+
+void gtmatrix_print_row(const GtMatrix *gm, size_t row, StrBuf *out)
+{
+  size_t s;
+  strbuf_append_str(out, "\tGT");
+  for(s = 0; s < gm->nsamples; s++) {
+    strbuf_append_char(out, '\t');
+    gt_append(out, gtmatrix_call(gm, row, s, 0), gtmatrix_call(gm, row, s, 1),
+              gtmatrix_haploid(gm, row, s), gtmatrix_phased(gm, row, s));
+  }
+}
+
+size_t vcf_header_samples(const char *line, size_t len)
+{
+  uint32_t tabs[9];
+  size_t n = 0;
+  const char *str, *end = line + len;
+
+  if(vcf_find_tabs(line, len, tabs, 9) < 9) return 0;
+  for(str = line + tabs[8]; str != NULL && str < end; n++)
+    str = memchr(str+1, '\t', end - str - 1);
+  return n;
+}
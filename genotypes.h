@@ -0,0 +1,55 @@
+#ifndef GENOTYPES_H_
+#define GENOTYPES_H_
+
+#include "bit_array.h"
+#include "string_buffer.h"
+#include "line_reader.h"
+#include "vcf_record.h"
+
+// Genotypes of the entries of a cluster, so that a combined entry can carry GT
+// with alleles renumbered. One row per entry, 6 bits per sample: two calls of
+// 2 bits each (0 ref, 1 first alt, 2 missing, 3 in overflow), a haploid bit
+// and a phased bit. Other alleles go in a sparse overflow list. GT is parsed
+// straight from the sample columns, which may still be in the reader, so the
+// sample text is never held in memory.
+
+#define GT_MISSING -1
+
+typedef struct {
+  size_t key; // bit offset of the call
+  int allele;
+} GtOverflow;
+
+typedef struct {
+  BIT_ARRAY *bits;
+  GtOverflow *overflow; // sorted by key
+  size_t noverflow, cap_overflow;
+  size_t nsamples, nrows;
+} GtMatrix;
+
+void gtmatrix_alloc(GtMatrix *gm);
+void gtmatrix_dealloc(GtMatrix *gm);
+
+// Remove all rows
+void gtmatrix_reset(GtMatrix *gm, size_t nsamples);
+
+// Add a row for rec. Sample columns are read from rec's line, then from rdr
+// if it is not NULL and still holds the samples of the entry. Reading from
+// rdr may move rec's line.
+void gtmatrix_add(GtMatrix *gm, const VcfRecord *rec, LineReader *rdr);
+
+// Allele of call 0 or 1, or GT_MISSING
+int gtmatrix_call(const GtMatrix *gm, size_t row, size_t sample, size_t call);
+char gtmatrix_haploid(const GtMatrix *gm, size_t row, size_t sample);
+char gtmatrix_phased(const GtMatrix *gm, size_t row, size_t sample);
+
+// Append one genotype e.g. "0|1", "1" or "./."
+void gt_append(StrBuf *out, int a0, int a1, char haploid, char phased);
+
+// Append "\tGT" then a tab and genotype for each sample of row
+void gtmatrix_print_row(const GtMatrix *gm, size_t row, StrBuf *out);
+
+// Number of samples on a #CHROM line
+size_t vcf_header_samples(const char *line, size_t len);
+
+#endif /* GENOTYPES_H_ */
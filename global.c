@@ -2,6 +2,11 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "global.h"
 
@@ -52,38 +57,233 @@ char parse_entire_int(char *str, int *result)
   return 1;
 }
 
-size_t count_char(const char *str, char c)
+char parse_entire_size(const char *str, size_t *result)
 {
-  const char *tmp = str;
-  size_t count = 0;
-  while((tmp = strchr(tmp, c)) != NULL) { count++; tmp++; }
-  return count;
+  char *end = NULL;
+  unsigned long tmp;
+  if(*str < '0' || *str > '9') return 0;
+  errno = 0;
+  tmp = strtoul(str, &end, 10);
+  if(errno == ERANGE || *end != '\0') return 0;
+  *result = tmp;
+  return 1;
 }
 
-void vcf_columns(char *vcfline, char *fields[9])
+char parse_entire_double(const char *str, double *result)
 {
-  size_t i;
-  fields[0] = vcfline;
-  for(i = 1; i < 9; i++) {
-    fields[i] = strchr(fields[i-1]+1, '\t');
-    if(fields[i] == NULL) die("Invalid VCF line: %s", vcfline);
-    fields[i]++;
+  char *end = NULL;
+  double tmp = strtod(str, &end);
+  if(end == str || *end != '\0') return 0;
+  *result = tmp;
+  return 1;
+}
+
+char parse_mem_size(const char *str, size_t *result)
+{
+  char *end = NULL;
+  unsigned long tmp;
+  int shift = 0;
+
+  // strtoul() would skip spaces and negate a leading '-'
+  if(*str < '0' || *str > '9') return 0;
+  errno = 0;
+  tmp = strtoul(str, &end, 10);
+  if(errno == ERANGE) return 0;
+  switch(*end) {
+    case 'g': case 'G': shift = 30; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'k': case 'K': shift = 10; end++; break;
+  }
+  if(*end == 'b' || *end == 'B') end++;
+  if(*end != '\0' || tmp > (SIZE_MAX >> shift)) return 0;
+  *result = (size_t)tmp << shift;
+  return 1;
+}
+
+static const char digit_pairs[201] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536"
+  "37383940414243444546474849505152535455565758596061626364656667686970717273"
+  "7475767778798081828384858687888990919293949596979899";
+
+size_t ulong_to_str(unsigned long num, char *str)
+{
+  char tmp[24], *p = tmp + sizeof(tmp);
+  size_t len;
+
+  while(num >= 100) {
+    p -= 2;
+    memcpy(p, digit_pairs + 2*(num % 100), 2);
+    num /= 100;
   }
+  if(num >= 10) { p -= 2; memcpy(p, digit_pairs + 2*num, 2); }
+  else *--p = '0' + num;
+
+  len = tmp + sizeof(tmp) - p;
+  memcpy(str, p, len);
+  str[len] = '\0';
+  return len;
 }
 
-void load_reads(const char *path, read_t **reads, size_t *capcty, size_t *nchroms)
+//
+// Stats
+//
+
+char stats_on = 0;
+
+static struct {
+  FILE *out;
+  const char *tool;
+  uint64_t start;
+  double interval;
+  StatsBlock *blocks; // every thread's block
+  pthread_mutex_t lock; // guards blocks and out
+  pthread_cond_t cond;
+  pthread_t reporter;
+  char stop;
+} stats;
+
+static __thread StatsBlock *stats_local = NULL;
+
+static const char *stat_names[NUM_STATS] = {
+  "entries_in", "entries_out", "ref_dropped", "ref_swapped", "clusters",
+  "haplotypes", "sort_runs"
+};
+
+static const char *phase_names[NUM_PHASES] = {
+  "ref_load", "read", "write", "combos", "sort"
+};
+
+uint64_t stats_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+StatsBlock* stats_block()
 {
-  seq_file_t *sf;
-  if((sf = seq_open(path)) == NULL) die("Cannot open file: %s\n", path);
-  while(1)
-  {
-    if(*nchroms == *capcty && (*reads = realloc(*reads, *capcty *= 2)) == NULL)
+  if(stats_local == NULL) {
+    if((stats_local = calloc(1, sizeof(StatsBlock))) == NULL)
       die("Out of memory");
-    read_t *r = *reads+*nchroms;
-    if(seq_read_alloc(r) == NULL) die("Out of memory");
-    if(seq_read(sf, r) <= 0) { seq_read_dealloc(r); break; }
-    seq_read_truncate_name(r);
-    (*nchroms)++;
+    pthread_mutex_lock(&stats.lock);
+    stats_local->next = stats.blocks;
+    stats.blocks = stats_local;
+    pthread_mutex_unlock(&stats.lock);
+  }
+  return stats_local;
+}
+
+void stats_cluster(size_t nvars)
+{
+  StatsBlock *b;
+  size_t bin;
+  if(!stats_on) return;
+  b = stats_block();
+  bin = MIN2(63 - (size_t)__builtin_clzl(nvars), STATS_HIST_BINS-1);
+  stats_inc(&b->counts[STAT_CLUSTERS], 1);
+  stats_inc(&b->cluster_sizes[bin], 1);
+  if(nvars > b->max_cluster) __atomic_store_n(&b->max_cluster, nvars,
+                                              __ATOMIC_RELAXED);
+}
+
+#define stats_get(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+
+// Sum the blocks and write a line of JSON. Caller holds the lock.
+static void stats_write(char final)
+{
+  StatsBlock sum;
+  const StatsBlock *b;
+  size_t i;
+
+  memset(&sum, 0, sizeof(sum));
+  for(b = stats.blocks; b != NULL; b = b->next) {
+    for(i = 0; i < NUM_STATS; i++) sum.counts[i] += stats_get(&b->counts[i]);
+    for(i = 0; i < NUM_PHASES; i++)
+      sum.phase_ns[i] += stats_get(&b->phase_ns[i]);
+    for(i = 0; i < STATS_HIST_BINS; i++)
+      sum.cluster_sizes[i] += stats_get(&b->cluster_sizes[i]);
+    sum.max_cluster = MAX2(sum.max_cluster, stats_get(&b->max_cluster));
+  }
+
+  fprintf(stats.out, "{\"tool\":\"%s\",\"final\":%s,\"secs\":%.3f",
+          stats.tool, final ? "true" : "false",
+          (stats_now() - stats.start) * 1e-9);
+  for(i = 0; i < NUM_STATS; i++)
+    fprintf(stats.out, ",\"%s\":%lu", stat_names[i],
+            (unsigned long)sum.counts[i]);
+  fprintf(stats.out, ",\"max_cluster\":%lu,\"cluster_sizes\":[",
+          (unsigned long)sum.max_cluster);
+  for(i = 0; i < STATS_HIST_BINS; i++)
+    fprintf(stats.out, "%s%lu", i ? "," : "",
+            (unsigned long)sum.cluster_sizes[i]);
+  fprintf(stats.out, "],\"phase_secs\":{");
+  for(i = 0; i < NUM_PHASES; i++)
+    fprintf(stats.out, "%s\"%s\":%.3f", i ? "," : "", phase_names[i],
+            sum.phase_ns[i] * 1e-9);
+  fprintf(stats.out, "}}\n");
+  fflush(stats.out);
+}
+
+static void* stats_reporter(void *arg)
+{
+  struct timespec ts;
+  double whole = (time_t)stats.interval;
+  (void)arg;
+
+  pthread_mutex_lock(&stats.lock);
+  clock_gettime(CLOCK_REALTIME, &ts); // the clock pthread_cond_timedwait uses
+  while(!stats.stop) {
+    ts.tv_sec += (time_t)whole;
+    ts.tv_nsec += (stats.interval - whole) * 1e9;
+    if(ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+    // Wait for the deadline or stats_close()
+    while(!stats.stop &&
+          pthread_cond_timedwait(&stats.cond, &stats.lock, &ts) == 0) {}
+    if(!stats.stop) stats_write(0);
   }
-  seq_close(sf);
+  pthread_mutex_unlock(&stats.lock);
+  return NULL;
+}
+
+void stats_open(const char *path, const char *tool, double interval)
+{
+  if(strcmp(path, "-") == 0) stats.out = stderr;
+  else if((stats.out = fopen(path, "w")) == NULL)
+    die("Cannot write stats to: %s", path);
+
+  stats.tool = tool;
+  stats.start = stats_now();
+  stats.interval = interval;
+  stats.blocks = NULL;
+  stats.stop = 0;
+  pthread_mutex_init(&stats.lock, NULL);
+  pthread_cond_init(&stats.cond, NULL);
+  stats_on = 1;
+
+  if(interval > 0 &&
+     pthread_create(&stats.reporter, NULL, stats_reporter, NULL) != 0)
+    die("Cannot start stats thread");
+}
+
+void stats_close()
+{
+  StatsBlock *b, *next;
+  if(!stats_on) return;
+
+  if(stats.interval > 0) {
+    pthread_mutex_lock(&stats.lock);
+    stats.stop = 1;
+    pthread_cond_signal(&stats.cond);
+    pthread_mutex_unlock(&stats.lock);
+    pthread_join(stats.reporter, NULL);
+  }
+
+  stats_write(1);
+  if(stats.out != stderr) fclose(stats.out);
+
+  stats_on = 0;
+  for(b = stats.blocks; b != NULL; b = next) { next = b->next; free(b); }
+  stats_local = NULL;
+  pthread_mutex_destroy(&stats.lock);
+  pthread_cond_destroy(&stats.cond);
 }
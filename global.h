@@ -1,7 +1,8 @@
 #ifndef GLOBAL_H_
 #define GLOBAL_H_
 
-#include "seq_file.h"
+#include <stddef.h>
+#include <stdint.h>
 
 #define SWAP(x,y,tmp) ((tmp) = (x), (x) = (y), (y) = (tmp))
 #define MAX2(x,y) ((x) >= (y) ? (x) : (y))
@@ -23,8 +24,79 @@ __attribute__((format(printf, 3, 4)));
 void print_usage(const char *usage, const char *errfmt,  ...);
 
 char parse_entire_int(char *str, int *result);
+// Returns 0 unless str is only decimal digits that fit in a size_t
+char parse_entire_size(const char *str, size_t *result);
+char parse_entire_double(const char *str, double *result);
 
-size_t count_char(const char *str, char c);
+// Parse a memory size with an optional K/M/G suffix e.g. 2G, 512M. Returns 0
+// if invalid, negative or too large for a size_t.
+char parse_mem_size(const char *str, size_t *result);
+
+// Write num in decimal, NUL terminated. Returns the number of digits.
+// str must have space for 21 bytes.
+size_t ulong_to_str(unsigned long num, char *str);
+
+//
+// --stats: counters and phase timers. Each thread updates its own block,
+// the blocks are summed when stats are written. With stats off an update is
+// a branch.
+//
+
+typedef enum {
+  STAT_ENTRIES_IN, STAT_ENTRIES_OUT, STAT_REF_DROPPED, STAT_REF_SWAPPED,
+  STAT_CLUSTERS, STAT_HAPLOTYPES, STAT_SORT_RUNS, NUM_STATS
+} StatCounter;
+
+// Time spent loading the reference, reading and decompressing input, writing
+// and compressing output, generating vcfcombo haplotypes and sorting and
+// spilling --sort runs. Summed over threads.
+typedef enum {
+  PHASE_REF_LOAD, PHASE_READ, PHASE_WRITE, PHASE_COMBOS, PHASE_SORT, NUM_PHASES
+} StatPhase;
+
+// Bin i counts clusters of 2^i to 2^(i+1)-1 entries, the last bin is open
+#define STATS_HIST_BINS 16
+
+typedef struct StatsBlock {
+  uint64_t counts[NUM_STATS], phase_ns[NUM_PHASES];
+  uint64_t cluster_sizes[STATS_HIST_BINS], max_cluster;
+  struct StatsBlock *next;
+} StatsBlock;
+
+extern char stats_on;
+
+// Start collecting. Stats are written to path ("-" for stderr) as one JSON
+// object per line by stats_close(), and every interval seconds if non-zero.
+void stats_open(const char *path, const char *tool, double interval);
+void stats_close();
+
+// This thread's block, created on first use
+StatsBlock* stats_block();
+uint64_t stats_now(); // nanoseconds
+
+// Only the owning thread writes a block, others may read it at any time
+#define stats_inc(ptr,n) \
+  __atomic_store_n(ptr, __atomic_load_n(ptr, __ATOMIC_RELAXED) + (n), \
+                   __ATOMIC_RELAXED)
+
+static inline void stats_add(StatCounter c, uint64_t n)
+{
+  if(stats_on) stats_inc(&stats_block()->counts[c], n);
+}
+
+// Count a cluster of nvars entries
+void stats_cluster(size_t nvars);
+
+// Returns a start time for stats_stop(), 0 if stats are off
+static inline uint64_t stats_start()
+{
+  return stats_on ? stats_now() : 0;
+}
+
+static inline void stats_stop(StatPhase phase, uint64_t start)
+{
+  if(start) stats_inc(&stats_block()->phase_ns[phase], stats_now() - start);
+}
 
 // VCF: CHROM-POS-ID-REF-ALT-QUAL-FILTER-INFO-FORMAT[-SAMPLE0...] '-' is '\t'
 #define VCHR  0
@@ -37,8 +109,4 @@ size_t count_char(const char *str, char c);
 #define VINFO 7
 #define VFRMT 8
 
-void vcf_columns(char *vcfline, char *fields[9]);
-
-void load_reads(const char *path, read_t **reads, size_t *capcty, size_t *nchroms);
-
 #endif /* GLOBAL_H_ */
@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "global.h"
+#include "line_pipeline.h"
+
+#define BATCH_BYTES (1<<20)
+
+// Slot states, a slot moves around this cycle
+enum { SLOT_FREE, SLOT_READ, SLOT_DONE };
+
+// Batch seq in a state, as one word so that a single load sees both. Batch
+// seq goes in slot seq % nslots, which is free for it once batch seq-nslots
+// has been written.
+#define slot_tag(seq,state) ((seq)*3 + (state))
+
+typedef struct {
+  LineBatch batch;
+  size_t tag; // see slot_tag()
+} PipeSlot;
+
+typedef struct {
+  PipeSlot *slots;
+  size_t nslots;
+  size_t next_work; // next batch for a worker to take
+  size_t nbatches; // SIZE_MAX until the reader hits EOF
+  LineWriter *wtr;
+  batch_func func;
+  batch_cut cut;
+  void *arg;
+  bcf_hdr_t *hdr; // BCF input, batches hold records. NULL for lines.
+} Pipeline;
+
+typedef struct {
+  Pipeline *pl;
+  size_t worker;
+} PipeWorker;
+
+// Spin briefly, then yield, then sleep. A stage may wait a long time on I/O.
+static void backoff(size_t *spins)
+{
+  struct timespec ts = {0, 50000};
+  if(++*spins < 128) return;
+  else if(*spins < 1024) sched_yield();
+  else nanosleep(&ts, NULL);
+}
+
+// Wait until slot holds batch seq in the given state.
+// Returns 0 if there is no such batch (reader hit EOF first).
+static char pipeline_wait(Pipeline *pl, size_t seq, int state)
+{
+  PipeSlot *slot = &pl->slots[seq % pl->nslots];
+  size_t spins = 0;
+  while(__atomic_load_n(&slot->tag, __ATOMIC_ACQUIRE) != slot_tag(seq, state))
+  {
+    if(seq >= __atomic_load_n(&pl->nbatches, __ATOMIC_ACQUIRE)) return 0;
+    backoff(&spins);
+  }
+  return 1;
+}
+
+void linebatch_emit(LineBatch *batch, char *line, size_t len)
+{
+  if(batch->nout == batch->cap_out) {
+    batch->cap_out = batch->cap_out ? batch->cap_out * 2 : 1024;
+    batch->out = realloc(batch->out, batch->cap_out * sizeof(LineSpan));
+    if(batch->out == NULL) die("Out of memory");
+  }
+  batch->out[batch->nout++] = (LineSpan){.b = line, .len = len};
+}
+
+void linebatch_print(LineBatch *batch, const char *line, size_t len)
+{
+  // Offsets may move as text grows, linebatch_fix() sets the pointers
+  strbuf_append_strn(&batch->text, line, len);
+  strbuf_append_char(&batch->text, '\n');
+  linebatch_emit(batch, NULL, len);
+}
+
+void linebatch_emit_rec(LineBatch *batch, bcf1_t *rec)
+{
+  // No more than the batch's records, so there is always room
+  batch->out_recs[batch->nout_recs++] = rec;
+}
+
+// Point spans added by linebatch_print() at their copies
+static void linebatch_fix(LineBatch *batch)
+{
+  size_t i, offset = 0;
+  for(i = 0; i < batch->nout; i++) {
+    if(batch->out[i].b == NULL) {
+      batch->out[i].b = batch->text.b + offset;
+      offset += batch->out[i].len + 1;
+    }
+  }
+}
+
+// Split the block into lines
+static void linebatch_split(LineBatch *batch)
+{
+  char *line = batch->block.b, *end = line + batch->block.end, *nl;
+
+  for(batch->nlines = 0; line < end; line = nl+1) {
+    nl = memchr(line, '\n', end - line);
+    if(batch->nlines == batch->cap_lines) {
+      batch->cap_lines = batch->cap_lines ? batch->cap_lines * 2 : 1024;
+      batch->lines = realloc(batch->lines, batch->cap_lines * sizeof(LineSpan));
+      if(batch->lines == NULL) die("Out of memory");
+    }
+    batch->lines[batch->nlines] = (LineSpan){.b = line, .len = nl - line};
+    if(nl > line && nl[-1] == '\r') batch->lines[batch->nlines].len--;
+    batch->nlines++;
+  }
+}
+
+static void* pipeline_worker(void *ptr)
+{
+  const PipeWorker *pw = ptr;
+  Pipeline *pl = pw->pl;
+  PipeSlot *slot;
+  size_t seq;
+
+  while(1) {
+    seq = __atomic_fetch_add(&pl->next_work, 1, __ATOMIC_RELAXED);
+    if(!pipeline_wait(pl, seq, SLOT_READ)) break;
+    slot = &pl->slots[seq % pl->nslots];
+    if(pl->hdr == NULL) linebatch_split(&slot->batch);
+    slot->batch.nout = slot->batch.nout_recs = 0;
+    strbuf_reset(&slot->batch.text);
+    pl->func(pw->worker, &slot->batch, pl->arg);
+    linebatch_fix(&slot->batch);
+    __atomic_store_n(&slot->tag, slot_tag(seq, SLOT_DONE), __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+static void* pipeline_writer(void *ptr)
+{
+  Pipeline *pl = ptr;
+  PipeSlot *slot;
+  size_t seq, i;
+
+  for(seq = 0; pipeline_wait(pl, seq, SLOT_DONE); seq++) {
+    slot = &pl->slots[seq % pl->nslots];
+    linewriter_write_spans(pl->wtr, slot->batch.out, slot->batch.nout);
+    for(i = 0; i < slot->batch.nout_recs; i++)
+      linewriter_write_rec(pl->wtr, pl->hdr, slot->batch.out_recs[i], 0);
+    __atomic_store_n(&slot->tag, slot_tag(seq + pl->nslots, SLOT_FREE),
+                     __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+// Fill block with the lines held back last time then the next batch of lines.
+// Returns 0 at EOF.
+static char pipeline_fill(Pipeline *pl, LineReader *rdr, StrBuf *block,
+                          StrBuf *rest)
+{
+  size_t keep, scanned = 0;
+
+  strbuf_reset(block);
+  strbuf_append_strn(block, rest->b, rest->end);
+  strbuf_reset(rest);
+
+  while(linereader_fill(rdr, block, block->end + BATCH_BYTES) > 0) {
+    if(pl->cut == NULL) return 1;
+    if((keep = pl->cut(block->b, block->end, &scanned, pl->arg)) > 0) {
+      strbuf_append_strn(rest, block->b + keep, block->end - keep);
+      strbuf_shrink(block, keep);
+      return 1;
+    }
+  }
+
+  return (block->end > 0);
+}
+
+// Read the next batch of records, up to BATCH_BYTES of them encoded. Records
+// are kept and read into again. Returns 0 at EOF.
+static char pipeline_fill_bcf(LineReader *rdr, LineBatch *batch)
+{
+  size_t i, bytes = 0;
+  bcf1_t *rec;
+
+  for(batch->nrecs = 0; bytes < BATCH_BYTES; batch->nrecs++) {
+    if(batch->nrecs == batch->cap_recs) {
+      batch->cap_recs = batch->cap_recs ? batch->cap_recs * 2 : 1024;
+      batch->recs = realloc(batch->recs, batch->cap_recs * sizeof(bcf1_t*));
+      batch->out_recs = realloc(batch->out_recs,
+                                batch->cap_recs * sizeof(bcf1_t*));
+      if(batch->recs == NULL || batch->out_recs == NULL) die("Out of memory");
+      for(i = batch->nrecs; i < batch->cap_recs; i++)
+        if((batch->recs[i] = bcf_init()) == NULL) die("Out of memory");
+    }
+    rec = batch->recs[batch->nrecs];
+    if(!linereader_read_rec(rdr, rec)) break;
+    bytes += rec->shared.l + rec->indiv.l;
+  }
+
+  return (batch->nrecs > 0);
+}
+
+static void pipeline_go(Pipeline *pl, LineReader *rdr, size_t nworkers)
+{
+  pthread_t threads[nworkers+1];
+  PipeWorker workers[nworkers];
+  PipeSlot *slot;
+  StrBuf rest;
+  size_t i, j, seq;
+
+  if((pl->slots = calloc(pl->nslots, sizeof(PipeSlot))) == NULL)
+    die("Out of memory");
+  for(i = 0; i < pl->nslots; i++) {
+    strbuf_alloc(&pl->slots[i].batch.block, BATCH_BYTES + BATCH_BYTES/4);
+    strbuf_alloc(&pl->slots[i].batch.text, 1024);
+    pl->slots[i].tag = slot_tag(i, SLOT_FREE);
+  }
+  strbuf_alloc(&rest, 1024);
+
+  for(i = 0; i < nworkers; i++) {
+    workers[i] = (PipeWorker){.pl = pl, .worker = i};
+    if(pthread_create(&threads[i], NULL, pipeline_worker, &workers[i]) != 0)
+      die("Cannot start thread");
+  }
+  if(pthread_create(&threads[nworkers], NULL, pipeline_writer, pl) != 0)
+    die("Cannot start thread");
+
+  // Read on this thread. A slot is free once its previous batch is written.
+  for(seq = 0; ; seq++)
+  {
+    // nbatches is not set yet, so this waits until the slot is free
+    slot = &pl->slots[seq % pl->nslots];
+    pipeline_wait(pl, seq, SLOT_FREE);
+
+    if(pl->hdr != NULL ? !pipeline_fill_bcf(rdr, &slot->batch)
+                       : !pipeline_fill(pl, rdr, &slot->batch.block, &rest))
+      break;
+    __atomic_store_n(&slot->tag, slot_tag(seq, SLOT_READ), __ATOMIC_RELEASE);
+  }
+
+  __atomic_store_n(&pl->nbatches, seq, __ATOMIC_RELEASE);
+
+  for(i = 0; i <= nworkers; i++) pthread_join(threads[i], NULL);
+
+  for(i = 0; i < pl->nslots; i++) {
+    strbuf_dealloc(&pl->slots[i].batch.block);
+    strbuf_dealloc(&pl->slots[i].batch.text);
+    free(pl->slots[i].batch.lines);
+    free(pl->slots[i].batch.out);
+    for(j = 0; j < pl->slots[i].batch.cap_recs; j++)
+      bcf_destroy(pl->slots[i].batch.recs[j]);
+    free(pl->slots[i].batch.recs);
+    free(pl->slots[i].batch.out_recs);
+  }
+  strbuf_dealloc(&rest);
+  free(pl->slots);
+}
+
+void pipeline_run(LineReader *rdr, LineWriter *wtr, size_t nworkers,
+                  batch_func func, batch_cut cut, void *arg)
+{
+  Pipeline pl = {.nslots = 2*nworkers+2, .next_work = 0,
+                 .nbatches = SIZE_MAX, .wtr = wtr, .func = func, .cut = cut,
+                 .arg = arg, .hdr = NULL};
+  pipeline_go(&pl, rdr, nworkers);
+}
+
+void pipeline_run_bcf(LineReader *rdr, LineWriter *wtr, size_t nworkers,
+                      batch_func func, void *arg)
+{
+  Pipeline pl = {.nslots = 2*nworkers+2, .next_work = 0,
+                 .nbatches = SIZE_MAX, .wtr = wtr, .func = func, .cut = NULL,
+                 .arg = arg, .hdr = rdr->hdr};
+  pipeline_go(&pl, rdr, nworkers);
+}
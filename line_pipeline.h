@@ -0,0 +1,64 @@
+#ifndef LINE_PIPELINE_H_
+#define LINE_PIPELINE_H_
+
+#include "line_reader.h"
+#include "line_writer.h"
+#include "string_buffer.h"
+
+// Three stage pipeline for tools where each line can be handled on its own.
+// The calling thread reads batches of lines, nworkers threads process
+// batches, and a writer thread writes the output of each batch in input order.
+// Stages hand batches to each other through a fixed ring of slots using
+// atomics, no locks. Each batch is a block of whole lines, split into spans
+// on the worker. Output is a list of spans, which can point into the block, so
+// lines that pass through unchanged are never copied. Batches are reused, so
+// nothing is allocated once buffers have grown to fit the input.
+// Tools where lines depend on their neighbours (e.g. vcfcombo clusters) give
+// a cut function so that each batch only holds whole groups of lines.
+// BCF input can instead be run as batches of records, which are never
+// formatted as text, see pipeline_run_bcf().
+
+typedef struct {
+  StrBuf block; // input lines, each ending with a newline
+  StrBuf text; // copies of output lines built by the worker
+  LineSpan *lines, *out; // spans of input and output lines
+  size_t nlines, cap_lines, nout, cap_out;
+  // Records for pipeline_run_bcf(), reused from batch to batch
+  bcf1_t **recs, **out_recs; // input, and output in the same order
+  size_t nrecs, nout_recs, cap_recs;
+} LineBatch;
+
+// Add an output line, which must stay valid until the batch is written
+void linebatch_emit(LineBatch *batch, char *line, size_t len);
+
+// Add a copy of an output line, for lines that will not stay valid
+void linebatch_print(LineBatch *batch, const char *line, size_t len);
+
+// Add an output record, one of the batch's recs
+void linebatch_emit_rec(LineBatch *batch, bcf1_t *rec);
+
+// Called on a worker thread. worker is in [0,nworkers) and no two threads use
+// the same worker at the same time, so it can index per-thread state.
+// Output is empty when called.
+typedef void (*batch_func)(size_t worker, LineBatch *batch, void *arg);
+
+// Called on the reading thread with a block of whole lines. Returns how many
+// bytes from the start of block to pass to a worker now, the rest is kept for
+// the next batch. Return 0 to read more lines first. Not called at EOF.
+// *scanned is 0 for a new block. When returning 0 set it to how far the block
+// was read, the next call gets the same block with more lines appended and
+// can resume from there rather than rescan.
+typedef size_t (*batch_cut)(const char *block, size_t len, size_t *scanned,
+                            void *arg);
+
+// cut may be NULL to cut batches anywhere between lines
+void pipeline_run(LineReader *rdr, LineWriter *wtr, size_t nworkers,
+                  batch_func func, batch_cut cut, void *arg);
+
+// For BCF input (rdr->hts set): batches hold records rather than lines, and
+// func passes on the records it keeps with linebatch_emit_rec(). They are
+// written with linewriter_write_rec(), so write the header first.
+void pipeline_run_bcf(LineReader *rdr, LineWriter *wtr, size_t nworkers,
+                      batch_func func, void *arg);
+
+#endif /* LINE_PIPELINE_H_ */
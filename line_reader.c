@@ -0,0 +1,341 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hfile.h"
+
+#include "global.h"
+#include "line_reader.h"
+#include "vcf_record.h"
+
+// Read the header of a BCF file, it is handed out a line at a time
+static void linereader_open_bcf(LineReader *rdr, hFILE *hf, int nthreads)
+{
+  if((rdr->hts = hts_hopen(hf, rdr->path, "r")) == NULL ||
+     (rdr->hdr = bcf_hdr_read(rdr->hts)) == NULL)
+    die("Cannot read file: %s", rdr->path);
+  if(nthreads > 1 && hts_set_threads(rdr->hts, nthreads) != 0)
+    die("Cannot start decompression threads");
+  if((rdr->rec = bcf_init()) == NULL) die("Out of memory");
+  if(bcf_hdr_format(rdr->hdr, 0, &rdr->htxt) != 0)
+    die("Cannot read header: %s", rdr->path);
+}
+
+void linereader_open(LineReader *rdr, const char *path, int nthreads)
+{
+  hFILE *hf;
+  htsFormat fmt;
+
+  rdr->path = path;
+  rdr->tbx = NULL;
+  rdr->itr = NULL;
+  rdr->ks = rdr->htxt = (kstring_t){0, 0, NULL};
+  rdr->sites_only = rdr->in_samples = 0;
+  rdr->bgzf = NULL;
+  rdr->hts = NULL;
+  rdr->hpos = rdr->samples_at = 0;
+  strbuf_alloc(&rdr->carry, 1024);
+  strbuf_alloc(&rdr->rest, 1024);
+
+  // Peek at the start of the file to spot BCF, "-" is stdin
+  if((hf = hopen(path, "r")) == NULL || hts_detect_format(hf, &fmt) < 0)
+    die("Cannot read file: %s", path);
+  if(fmt.format == bcf) {
+    linereader_open_bcf(rdr, hf, nthreads);
+    return;
+  }
+  if((rdr->bgzf = bgzf_hopen(hf, "r")) == NULL)
+    die("Cannot read file: %s", path);
+
+  if(nthreads > 1) {
+    if(bgzf_compression(rdr->bgzf) != bgzf)
+      warn("Not BGZF compressed, reading with one thread: %s", path);
+    else if(bgzf_mt(rdr->bgzf, nthreads, 256) != 0)
+      die("Cannot start decompression threads");
+  }
+}
+
+void linereader_close(LineReader *rdr)
+{
+  if(rdr->itr != NULL) hts_itr_destroy(rdr->itr);
+  free(rdr->ks.s);
+  strbuf_dealloc(&rdr->carry);
+  strbuf_dealloc(&rdr->rest);
+  if(rdr->hts != NULL) {
+    bcf_destroy(rdr->rec);
+    bcf_hdr_destroy(rdr->hdr);
+    free(rdr->htxt.s);
+    if(hts_close(rdr->hts) != 0) die("Cannot close file: %s", rdr->path);
+  }
+  else if(bgzf_close(rdr->bgzf) != 0) die("Cannot close file: %s", rdr->path);
+}
+
+void linereader_query(LineReader *rdr, const tbx_t *tbx, int tid)
+{
+  if(rdr->hts != NULL) die("Cannot query BCF by contig: %s", rdr->path);
+  if(rdr->itr != NULL) hts_itr_destroy(rdr->itr);
+  rdr->tbx = tbx;
+  if((rdr->itr = tbx_itr_queryi((tbx_t*)tbx, tid, 0, HTS_POS_MAX)) == NULL)
+    die("Cannot query index of: %s", rdr->path);
+}
+
+// Load the next block if we have used this one. Returns 0 at EOF.
+static char linereader_block(LineReader *rdr)
+{
+  BGZF *fp = rdr->bgzf;
+  uint64_t start;
+  if(fp->block_offset < fp->block_length) return 1;
+  start = stats_start();
+  if(bgzf_read_block(fp) != 0) die("Cannot read file: %s", rdr->path);
+  stats_stop(PHASE_READ, start);
+  return fp->block_length > 0;
+}
+
+// Take len bytes from the current block
+#define linereader_skip(fp,len) \
+  ((fp)->block_offset += (len), (fp)->uncompressed_address += (len))
+
+static void span_chomp(LineSpan *line)
+{
+  if(line->len > 0 && line->b[line->len-1] == '\r') line->len--;
+}
+
+void linereader_sites_only(LineReader *rdr)
+{
+  rdr->sites_only = 1;
+}
+
+char linereader_samples(LineReader *rdr, LineSpan *part)
+{
+  BGZF *fp = rdr->bgzf;
+  char *buf, *nl;
+  size_t len;
+
+  if(!rdr->in_samples) return 0;
+  if(rdr->hts != NULL) {
+    // The rest of the formatted record
+    *part = (LineSpan){.b = rdr->ks.s + rdr->samples_at,
+                       .len = rdr->ks.l - rdr->samples_at};
+    rdr->in_samples = 0;
+    return 1;
+  }
+  if(!linereader_block(rdr)) {
+    rdr->in_samples = 0;
+    return 0;
+  }
+
+  buf = (char*)fp->uncompressed_block + fp->block_offset;
+  len = fp->block_length - fp->block_offset;
+
+  if((nl = memchr(buf, '\n', len)) != NULL) {
+    len = nl - buf;
+    linereader_skip(fp, len + 1);
+    rdr->in_samples = 0;
+  }
+  else linereader_skip(fp, len);
+
+  *part = (LineSpan){.b = buf, .len = len};
+  if(nl != NULL) span_chomp(part);
+  return 1;
+}
+
+// Sites only mode: the entry ends at the tab before the first sample, which
+// is left in the reader. Nothing is copied unless the sites columns cross a
+// block boundary.
+static char linereader_next_sites(LineReader *rdr, LineSpan *line)
+{
+  BGZF *fp = rdr->bgzf;
+  uint32_t tabs[9];
+  size_t len, end, k, ntabs = 0;
+  char *buf, *nl;
+
+  strbuf_reset(&rdr->carry);
+
+  do {
+    buf = (char*)fp->uncompressed_block + fp->block_offset;
+    len = fp->block_length - fp->block_offset;
+    k = vcf_find_tabs(buf, len, tabs, 9 - ntabs);
+    end = (ntabs + k == 9) ? tabs[k-1] : len;
+    if((nl = memchr(buf, '\n', end)) != NULL) end = nl - buf;
+
+    if(nl != NULL || ntabs + k == 9) {
+      // Entry ends in this block, or its samples start in it
+      if(rdr->carry.end == 0) *line = (LineSpan){.b = buf, .len = end};
+      else {
+        strbuf_append_strn(&rdr->carry, buf, end);
+        *line = (LineSpan){.b = rdr->carry.b, .len = rdr->carry.end};
+      }
+      linereader_skip(fp, end + (nl != NULL));
+      rdr->in_samples = (nl == NULL);
+      if(nl != NULL) span_chomp(line);
+      return 1;
+    }
+
+    strbuf_append_strn(&rdr->carry, buf, len);
+    linereader_skip(fp, len);
+    ntabs += k;
+  } while(linereader_block(rdr));
+
+  // EOF without a newline
+  *line = (LineSpan){.b = rdr->carry.b, .len = rdr->carry.end};
+  span_chomp(line);
+  return 1;
+}
+
+// Next header line, then each record formatted as VCF. In sites only mode
+// the samples are left in ks for linereader_samples().
+static char linereader_next_bcf(LineReader *rdr, LineSpan *line)
+{
+  const char *nl;
+  uint32_t tabs[9];
+  uint64_t start;
+  int ret;
+
+  if(rdr->hpos < rdr->htxt.l) {
+    line->b = rdr->htxt.s + rdr->hpos;
+    nl = memchr(line->b, '\n', rdr->htxt.l - rdr->hpos);
+    line->len = nl != NULL ? (size_t)(nl - line->b) : rdr->htxt.l - rdr->hpos;
+    rdr->hpos += line->len + 1;
+    return 1;
+  }
+
+  start = stats_start();
+  if((ret = bcf_read(rdr->hts, rdr->hdr, rdr->rec)) < -1)
+    die("Cannot read file: %s", rdr->path);
+  if(ret == -1) return 0;
+
+  rdr->ks.l = 0;
+  if(vcf_format(rdr->hdr, rdr->rec, &rdr->ks) != 0)
+    die("Cannot format BCF record: %s", rdr->path);
+  stats_stop(PHASE_READ, start);
+  *line = (LineSpan){.b = rdr->ks.s, .len = rdr->ks.l};
+  if(line->len > 0 && line->b[line->len-1] == '\n') line->len--;
+  rdr->ks.l = line->len;
+
+  if(rdr->sites_only && vcf_find_tabs(line->b, line->len, tabs, 9) == 9) {
+    line->len = tabs[8];
+    rdr->samples_at = tabs[8];
+    rdr->in_samples = 1;
+  }
+  return 1;
+}
+
+char linereader_read_rec(LineReader *rdr, bcf1_t *rec)
+{
+  uint64_t start = stats_start();
+  int ret = bcf_read(rdr->hts, rdr->hdr, rec);
+  stats_stop(PHASE_READ, start);
+  if(ret < -1) die("Cannot read file: %s", rdr->path);
+  return ret != -1;
+}
+
+bcf1_t* linereader_next_rec(LineReader *rdr)
+{
+  return linereader_read_rec(rdr, rdr->rec) ? rdr->rec : NULL;
+}
+
+char linereader_next(LineReader *rdr, LineSpan *line)
+{
+  BGZF *fp = rdr->bgzf;
+  char *buf, *nl;
+  size_t len;
+  uint64_t start;
+  int ret;
+
+  if(rdr->itr != NULL) {
+    // Iterator returns lines without the newline
+    start = stats_start();
+    ret = hts_itr_next(fp, rdr->itr, &rdr->ks, (void*)rdr->tbx);
+    stats_stop(PHASE_READ, start);
+    if(ret < -1) die("Cannot read file: %s", rdr->path);
+    if(ret == -1) return 0;
+    *line = (LineSpan){.b = rdr->ks.s, .len = rdr->ks.l};
+    span_chomp(line);
+    return 1;
+  }
+
+  // Skip samples the caller did not want
+  while(linereader_samples(rdr, line)) {}
+
+  if(rdr->hts != NULL) return linereader_next_bcf(rdr, line);
+
+  if(!linereader_block(rdr)) return 0;
+
+  buf = (char*)fp->uncompressed_block + fp->block_offset;
+  len = fp->block_length - fp->block_offset;
+
+  if(rdr->sites_only && buf[0] != '#') return linereader_next_sites(rdr, line);
+
+  if((nl = memchr(buf, '\n', len)) != NULL) {
+    // Whole line is in this block
+    *line = (LineSpan){.b = buf, .len = nl - buf};
+    linereader_skip(fp, nl - buf + 1);
+    span_chomp(line);
+    return 1;
+  }
+
+  // Line crosses into the next block(s)
+  strbuf_reset(&rdr->carry);
+  do {
+    buf = (char*)fp->uncompressed_block + fp->block_offset;
+    len = fp->block_length - fp->block_offset;
+    if((nl = memchr(buf, '\n', len)) != NULL) len = nl - buf;
+    strbuf_append_strn(&rdr->carry, buf, len);
+    linereader_skip(fp, len + (nl != NULL));
+  } while(nl == NULL && linereader_block(rdr));
+
+  *line = (LineSpan){.b = rdr->carry.b, .len = rdr->carry.end};
+  span_chomp(line);
+  return 1;
+}
+
+size_t linereader_fill(LineReader *rdr, StrBuf *block, size_t size)
+{
+  BGZF *fp = rdr->bgzf;
+  const char *buf, *nl;
+  size_t len, start = block->end;
+  LineSpan line;
+
+  if(rdr->sites_only || rdr->hts != NULL) {
+    while(block->end < size && linereader_next(rdr, &line)) {
+      strbuf_append_strn(block, line.b, line.len);
+      strbuf_append_char(block, '\n');
+    }
+    return block->end - start;
+  }
+
+  // Start with the partial line left over from last time
+  strbuf_append_strn(block, rdr->rest.b, rdr->rest.end);
+  strbuf_reset(&rdr->rest);
+
+  while(block->end < size && linereader_block(rdr)) {
+    buf = (const char*)fp->uncompressed_block + fp->block_offset;
+    len = fp->block_length - fp->block_offset;
+    strbuf_append_strn(block, buf, len);
+    linereader_skip(fp, len);
+  }
+
+  // Keep going until we have at least one whole line
+  while(block->end > start &&
+        memchr(block->b+start, '\n', block->end-start) == NULL &&
+        linereader_block(rdr))
+  {
+    buf = (const char*)fp->uncompressed_block + fp->block_offset;
+    len = fp->block_length - fp->block_offset;
+    if((nl = memchr(buf, '\n', len)) != NULL) len = nl - buf + 1;
+    strbuf_append_strn(block, buf, len);
+    linereader_skip(fp, len);
+  }
+
+  // Hold back the partial last line, unless we are at EOF
+  if(block->end > start && block->b[block->end-1] != '\n') {
+    if(linereader_block(rdr)) {
+      for(nl = block->b + block->end - 1; *nl != '\n'; nl--) {}
+      strbuf_append_strn(&rdr->rest, nl+1, block->b + block->end - nl - 1);
+      strbuf_shrink(block, nl+1 - block->b);
+    }
+    else strbuf_append_char(block, '\n');
+  }
+
+  return block->end - start;
+}
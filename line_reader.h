@@ -0,0 +1,85 @@
+#ifndef LINE_READER_H_
+#define LINE_READER_H_
+
+#include "bgzf.h"
+#include "tbx.h"
+#include "kstring.h"
+#include "vcf.h"
+#include "string_buffer.h"
+
+// Read lines from a BGZF, gzip or uncompressed file through htslib. BGZF
+// blocks are decompressed by nthreads threads. An indexed BGZF file can be
+// restricted to a single contig with linereader_query().
+//
+// Lines are handed out as spans pointing into the decompressed block, so
+// they are not copied. Only a line that crosses a block boundary is put
+// together in a separate buffer. In sites only mode entries end at FORMAT and
+// their sample columns, which can be megabytes on wide VCFs, are skipped or
+// handed out a block at a time, never copied.
+//
+// BCF input is detected and read with htslib: the header and each record are
+// formatted as VCF text, so callers see the same lines either way. Callers
+// that can work on bcf1_t records use linereader_next_rec() instead.
+
+typedef struct {
+  char *b; // not NUL terminated, may be modified in place
+  size_t len; // not including the newline
+} LineSpan;
+
+typedef struct {
+  const char *path;
+  BGZF *bgzf;
+  StrBuf carry; // line crossing a block boundary
+  StrBuf rest; // partial last line held back by linereader_fill()
+  const tbx_t *tbx; // NULL unless reading a contig
+  hts_itr_t *itr;
+  kstring_t ks;
+  char sites_only; // entries end before their sample columns
+  char in_samples; // samples of the last entry have not been read
+  // BCF input, hts is NULL otherwise
+  htsFile *hts;
+  bcf_hdr_t *hdr;
+  bcf1_t *rec;
+  kstring_t htxt; // header as text
+  size_t hpos; // next header line in htxt
+  size_t samples_at; // offset of the samples of the last entry in ks
+} LineReader;
+
+// path may be "-" for stdin
+void linereader_open(LineReader *rdr, const char *path, int nthreads);
+void linereader_close(LineReader *rdr);
+
+// Only read entries on contig tid of the index. Header lines are skipped.
+// Not for BCF input.
+void linereader_query(LineReader *rdr, const tbx_t *tbx, int tid);
+
+// Get the next line. The span is only valid until the next call.
+// Returns 0 at EOF.
+char linereader_next(LineReader *rdr, LineSpan *line);
+
+// For BCF input (rdr->hts set), get the next record without formatting it as
+// text. Header lines are not handed out, see rdr->hdr. The record is only
+// valid until the next call. Returns NULL at EOF.
+bcf1_t* linereader_next_rec(LineReader *rdr);
+
+// As linereader_next_rec() reading into rec, for callers that keep several
+// records. Returns 0 at EOF.
+char linereader_read_rec(LineReader *rdr, bcf1_t *rec);
+
+// Return entries up to the end of FORMAT from now on. Header lines are still
+// whole, and so are lines read with linereader_query().
+void linereader_sites_only(LineReader *rdr);
+
+// In sites only mode, get the next piece of the sample columns of the last
+// entry, starting with the tab after FORMAT. Pieces point into the reader's
+// blocks and are only valid until the next call. Returns 0 once the entry is
+// finished. Samples not read are skipped by the next linereader_next().
+char linereader_samples(LineReader *rdr, LineSpan *part);
+
+// Append whole lines, each ending with a newline, to block until it holds at
+// least size bytes or we hit EOF. Returns bytes added, 0 at EOF. In sites only
+// mode only the sites columns of entries are added.
+// Not for use with linereader_query().
+size_t linereader_fill(LineReader *rdr, StrBuf *block, size_t size);
+
+#endif /* LINE_READER_H_ */
@@ -0,0 +1,573 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "global.h"
+#include "line_writer.h"
+#include "vcf_record.h"
+
+// Same settings as tabix / bcftools index
+#define IDX_MIN_SHIFT 14
+#define TBI_NUM_LEVELS 5
+#define CSI_NUM_LEVELS 6
+
+#define BUF_SIZE (4UL<<20)
+#define TMP_BUF_SIZE (256UL<<10)
+#define PIPE_FLUSH_SIZE (64UL<<10)
+#define LONG_LINE (64UL<<10) // longer lines are not copied into the buffer
+#define LONG_PIECE (16UL<<10) // nor are longer pieces of an entry
+
+#ifndef IOV_MAX
+  #define IOV_MAX 1024
+#endif
+
+static char ends_with(const char *str, const char *suffix)
+{
+  size_t len = strlen(str), slen = strlen(suffix);
+  return len >= slen && strcmp(str + len - slen, suffix) == 0;
+}
+
+void linewriter_open(LineWriter *wtr, const char *path, int nthreads, char csi,
+                     char type)
+{
+  char to_stdout;
+
+  wtr->path = path == NULL ? "-" : path;
+  wtr->fd = -1;
+  wtr->tmp = NULL;
+  wtr->buf = NULL;
+  wtr->buflen = 0;
+  wtr->bufsize = BUF_SIZE;
+  wtr->bgzf = NULL;
+  wtr->idx = NULL;
+  wtr->idx_fmt = -1;
+  wtr->tid = -1;
+  wtr->chrom_offset = wtr->chrom_len = 0;
+  wtr->hts = NULL;
+  wtr->hdr = NULL;
+  wtr->rec = NULL;
+  wtr->ks = (kstring_t){0, 0, NULL};
+  strbuf_alloc(&wtr->names, 1024);
+  strbuf_alloc(&wtr->htxt, 1024);
+  strbuf_alloc(&wtr->contigs, 256);
+
+  to_stdout = (strcmp(wtr->path, "-") == 0);
+  if(type == 0) {
+    if(ends_with(wtr->path, ".bcf")) type = OUT_BCF;
+    else if(ends_with(wtr->path, ".gz") || ends_with(wtr->path, ".bgz"))
+      type = OUT_BGZF;
+    else type = OUT_VCF;
+  }
+
+  if(type == OUT_BCF)
+  {
+    if((wtr->hts = hts_open(wtr->path, "wb")) == NULL)
+      die("Cannot write to file: %s", wtr->path);
+    if(nthreads > 1 && hts_set_threads(wtr->hts, nthreads) != 0)
+      die("Cannot start compression threads");
+    if((wtr->rec = bcf_init()) == NULL) die("Out of memory");
+    if(!to_stdout) wtr->idx_fmt = HTS_FMT_CSI;
+    return;
+  }
+  else if(type == OUT_BGZF)
+  {
+    if((wtr->bgzf = bgzf_open(wtr->path, "w")) == NULL)
+      die("Cannot write to file: %s", wtr->path);
+    if(nthreads > 1 && bgzf_mt(wtr->bgzf, nthreads, 256) != 0)
+      die("Cannot start compression threads");
+    if(!to_stdout) wtr->idx_fmt = csi ? HTS_FMT_CSI : HTS_FMT_TBI;
+    return;
+  }
+  else if(to_stdout) wtr->fd = STDOUT_FILENO;
+  else if((wtr->fd = open(wtr->path, O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+    die("Cannot write to file: %s", wtr->path);
+
+  struct stat st;
+  if(isatty(wtr->fd)) wtr->flush_size = 0;
+  else if(fstat(wtr->fd, &st) == 0 && !S_ISREG(st.st_mode))
+    wtr->flush_size = PIPE_FLUSH_SIZE;
+  else wtr->flush_size = wtr->bufsize;
+}
+
+void linewriter_open_tmp(LineWriter *wtr)
+{
+  linewriter_open(wtr, "-", 1, 0, OUT_VCF);
+  wtr->path = "temporary file";
+  if((wtr->tmp = tmpfile()) == NULL) die("Cannot create temporary file");
+  wtr->fd = fileno(wtr->tmp);
+  wtr->bufsize = wtr->flush_size = TMP_BUF_SIZE;
+}
+
+void linewriter_flush_size(LineWriter *wtr, size_t flush_size)
+{
+  wtr->flush_size = MIN2(flush_size, wtr->bufsize);
+}
+
+static void write_all(LineWriter *wtr, const char *ptr, size_t len)
+{
+  uint64_t start = stats_start();
+  ssize_t n;
+  while(len > 0) {
+    if((n = write(wtr->fd, ptr, len)) < 0) {
+      if(errno == EINTR) continue;
+      die("Cannot write to file: %s", wtr->path);
+    }
+    ptr += n;
+    len -= n;
+  }
+  stats_stop(PHASE_WRITE, start);
+}
+
+// iov is modified
+static void writev_all(LineWriter *wtr, struct iovec *iov, size_t n)
+{
+  uint64_t start = stats_start();
+  ssize_t len;
+  while(n > 0) {
+    if((len = writev(wtr->fd, iov, MIN2(n, IOV_MAX))) < 0) {
+      if(errno == EINTR) continue;
+      die("Cannot write to file: %s", wtr->path);
+    }
+    // Skip what was written
+    for(; n > 0 && (size_t)len >= iov->iov_len; iov++, n--) len -= iov->iov_len;
+    if(n > 0) {
+      iov->iov_base = (char*)iov->iov_base + len;
+      iov->iov_len -= len;
+    }
+  }
+  stats_stop(PHASE_WRITE, start);
+}
+
+// bgzf_write() compresses a block each time one fills, only those calls are
+// timed
+static void bgzf_write_all(LineWriter *wtr, const char *ptr, size_t len)
+{
+  uint64_t start = 0;
+  if(wtr->bgzf->block_offset + len >= BGZF_BLOCK_SIZE) start = stats_start();
+  if(bgzf_write(wtr->bgzf, ptr, len) != (ssize_t)len)
+    die("Cannot write to file: %s", wtr->path);
+  stats_stop(PHASE_WRITE, start);
+}
+
+static void linewriter_empty(LineWriter *wtr)
+{
+  write_all(wtr, wtr->buf, wtr->buflen);
+  wtr->buflen = 0;
+}
+
+void linewriter_flush(LineWriter *wtr)
+{
+  if(wtr->fd < 0) return;
+  linewriter_empty(wtr);
+  if(wtr->tmp != NULL) {
+    free(wtr->buf);
+    wtr->buf = NULL;
+  }
+}
+
+static void linewriter_init_index(LineWriter *wtr)
+{
+  int nlvls = wtr->idx_fmt == HTS_FMT_CSI ? CSI_NUM_LEVELS : TBI_NUM_LEVELS;
+  wtr->idx = hts_idx_init(0, wtr->idx_fmt, bgzf_tell(wtr->bgzf),
+                          IDX_MIN_SHIFT, nlvls);
+  if(wtr->idx == NULL) die("Cannot create index");
+}
+
+// Index meta data is the tabix config followed by contig names, written as
+// little endian int32s: preset, seq col, beg col, end col, meta char, skip,
+// length of names
+static void linewriter_set_meta(LineWriter *wtr)
+{
+  const uint32_t conf[7] = {2 /* TBX_VCF */, 1, 2, 0, '#', 0, wtr->names.end};
+  size_t i, j, len = sizeof(conf) + wtr->names.end;
+  uint8_t *meta = malloc(len);
+  if(meta == NULL) die("Out of memory");
+  for(i = 0; i < 7; i++)
+    for(j = 0; j < 4; j++)
+      meta[i*4+j] = (conf[i] >> (j*8)) & 0xff;
+  memcpy(meta + sizeof(conf), wtr->names.b, wtr->names.end);
+  if(hts_idx_set_meta(wtr->idx, len, meta, 0) != 0)
+    die("Cannot set index meta data");
+}
+
+// Add any contigs wtr->hdr does not define and write it
+static void linewriter_bcf_start(LineWriter *wtr)
+{
+  const char *name, *end = wtr->contigs.b + wtr->contigs.end;
+
+  for(name = wtr->contigs.b; name < end; name += strlen(name)+1) {
+    if(bcf_hdr_name2id(wtr->hdr, name) < 0 &&
+       bcf_hdr_printf(wtr->hdr, "##contig=<ID=%s>", name) != 0)
+      die("Cannot add contig to header: %s", name);
+  }
+  if(bcf_hdr_write(wtr->hts, wtr->hdr) != 0)
+    die("Cannot write to file: %s", wtr->path);
+  if(wtr->idx_fmt != -1 &&
+     bcf_idx_init(wtr->hts, wtr->hdr, IDX_MIN_SHIFT, NULL) != 0)
+    die("Cannot create index for: %s", wtr->path);
+}
+
+// Start BCF output with the header lines seen so far
+static void linewriter_bcf_header(LineWriter *wtr)
+{
+  if((wtr->hdr = bcf_hdr_init("r")) == NULL) die("Out of memory");
+  if(bcf_hdr_parse(wtr->hdr, wtr->htxt.b) != 0)
+    die("Invalid VCF header for BCF output: %s", wtr->path);
+  linewriter_bcf_start(wtr);
+}
+
+static void linewriter_close_bcf(LineWriter *wtr)
+{
+  if(wtr->hdr == NULL) linewriter_bcf_header(wtr);
+  if(wtr->idx_fmt != -1 && bcf_idx_save(wtr->hts) != 0)
+    die("Cannot save index for: %s", wtr->path);
+  if(hts_close(wtr->hts) != 0) die("Cannot write to file: %s", wtr->path);
+  bcf_hdr_destroy(wtr->hdr);
+  bcf_destroy(wtr->rec);
+}
+
+void linewriter_close(LineWriter *wtr)
+{
+  if(wtr->hts != NULL) linewriter_close_bcf(wtr);
+  else if(wtr->bgzf != NULL && wtr->idx_fmt == -1) {
+    if(bgzf_close(wtr->bgzf) != 0) die("Cannot write to file: %s", wtr->path);
+  }
+  else if(wtr->bgzf != NULL)
+  {
+    if(bgzf_flush(wtr->bgzf) != 0) die("Cannot write to file: %s", wtr->path);
+    if(wtr->idx == NULL) linewriter_init_index(wtr);
+    hts_idx_amend_last(wtr->idx, bgzf_tell(wtr->bgzf));
+    if(hts_idx_finish(wtr->idx, bgzf_tell(wtr->bgzf)) != 0)
+      die("Cannot build index for: %s", wtr->path);
+    linewriter_set_meta(wtr);
+    if(hts_idx_save_as(wtr->idx, wtr->path, NULL, wtr->idx_fmt) != 0)
+      die("Cannot save index for: %s", wtr->path);
+    hts_idx_destroy(wtr->idx);
+    if(bgzf_close(wtr->bgzf) != 0) die("Cannot write to file: %s", wtr->path);
+  }
+  else {
+    linewriter_empty(wtr);
+    if(wtr->tmp != NULL) fclose(wtr->tmp);
+    else if(wtr->fd != STDOUT_FILENO && close(wtr->fd) != 0)
+      die("Cannot write to file: %s", wtr->path);
+  }
+
+  free(wtr->buf);
+  free(wtr->ks.s);
+  strbuf_dealloc(&wtr->names);
+  strbuf_dealloc(&wtr->htxt);
+  strbuf_dealloc(&wtr->contigs);
+}
+
+void linewriter_contig(LineWriter *wtr, const char *name)
+{
+  if(wtr->hts == NULL) return;
+  if(wtr->hdr != NULL) die("Contig named after the BCF header: %s", name);
+  strbuf_append_str(&wtr->contigs, name);
+  strbuf_append_char(&wtr->contigs, '\0');
+}
+
+// Parse the entry in wtr->ks and write it as BCF
+static void linewriter_write_bcf(LineWriter *wtr)
+{
+  uint64_t start;
+  if(wtr->hdr == NULL) linewriter_bcf_header(wtr);
+  start = stats_start();
+  if(vcf_parse(&wtr->ks, wtr->hdr, wtr->rec) != 0)
+    die("Cannot convert to BCF: %.*s", (int)MIN2(wtr->ks.l, 200), wtr->ks.s);
+  if(bcf_write(wtr->hts, wtr->hdr, wtr->rec) != 0)
+    die("Cannot write to file: %s", wtr->path);
+  stats_stop(PHASE_WRITE, start);
+}
+
+void linewriter_bcf_hdr(LineWriter *wtr, const bcf_hdr_t *hdr)
+{
+  kstring_t ks = {0, 0, NULL};
+  const char *line, *nl, *end;
+
+  if(wtr->hts != NULL) {
+    if(wtr->hdr != NULL) die("BCF header written twice: %s", wtr->path);
+    if((wtr->hdr = bcf_hdr_dup(hdr)) == NULL) die("Out of memory");
+    linewriter_bcf_start(wtr);
+    return;
+  }
+
+  if(bcf_hdr_format(hdr, 0, &ks) != 0) die("Cannot format BCF header");
+  for(line = ks.s, end = ks.s + ks.l; line < end; line = nl+1) {
+    if((nl = memchr(line, '\n', end - line)) == NULL) nl = end;
+    linewriter_write(wtr, line, nl - line);
+  }
+  free(ks.s);
+}
+
+void linewriter_write_rec(LineWriter *wtr, bcf_hdr_t *hdr, bcf1_t *rec,
+                          char sites)
+{
+  uint64_t start = stats_start();
+
+  if(wtr->hts != NULL) {
+    if(wtr->hdr == NULL) linewriter_bcf_header(wtr);
+    if(sites) {
+      // Drop the encoded samples without decoding them
+      rec->n_sample = rec->n_fmt = 0;
+      rec->indiv.l = 0;
+    }
+    if(bcf_translate(wtr->hdr, hdr, rec) != 0 ||
+       bcf_write(wtr->hts, wtr->hdr, rec) != 0)
+      die("Cannot write to file: %s", wtr->path);
+    stats_stop(PHASE_WRITE, start);
+    return;
+  }
+
+  vcfrecord_format_bcf(hdr, rec, sites, &wtr->ks);
+  stats_stop(PHASE_WRITE, start);
+  linewriter_write(wtr, wtr->ks.s, wtr->ks.l);
+}
+
+// Get tid for a contig, adding it if it is new
+static int linewriter_tid(LineWriter *wtr, const char *chr, size_t len)
+{
+  const char *names = wtr->names.b, *end = names + wtr->names.end, *name;
+  size_t tid = 0;
+
+  for(name = names; name < end; name += strlen(name)+1, tid++) {
+    if(strlen(name) == len && strncmp(name, chr, len) == 0)
+      die("Cannot index unsorted output, %.*s seen twice", (int)len, chr);
+  }
+
+  wtr->chrom_offset = wtr->names.end;
+  wtr->chrom_len = len;
+  strbuf_append_strn(&wtr->names, chr, len);
+  strbuf_append_char(&wtr->names, '\0');
+  return tid;
+}
+
+// Set tid and get the span of a VCF entry, for the index
+// VCF: CHROM-POS-ID-REF-ALT-... '-' is '\t'
+static void linewriter_locate(LineWriter *wtr, const char *line, size_t len,
+                              long *beg, long *end)
+{
+  uint32_t tabs[4];
+  size_t chrlen;
+
+  if(vcf_find_tabs(line, len, tabs, 4) < 4)
+    die("Invalid VCF line: %.*s", (int)len, line);
+
+  chrlen = tabs[0];
+  if(wtr->tid < 0 || chrlen != wtr->chrom_len ||
+     strncmp(wtr->names.b + wtr->chrom_offset, line, chrlen) != 0)
+    wtr->tid = linewriter_tid(wtr, line, chrlen);
+
+  *beg = vcf_parse_uint(line+tabs[0]+1, tabs[1]-tabs[0]-1) - 1;
+  if(*beg < 0) die("Invalid VCF line: %.*s", (int)len, line);
+  *end = *beg + (tabs[3]-tabs[2]-1);
+}
+
+// Push an entry that ends at the current file offset
+static void linewriter_push(LineWriter *wtr, long beg, long end)
+{
+  if(bgzf_idx_push(wtr->bgzf, wtr->idx, wtr->tid, beg, end,
+                   bgzf_tell(wtr->bgzf), 1) != 0)
+    die("Cannot index unsorted output: %s:%li",
+        wtr->names.b + wtr->chrom_offset, beg+1);
+}
+
+static void linewriter_index(LineWriter *wtr, const char *line, size_t len)
+{
+  long beg, end;
+  linewriter_locate(wtr, line, len, &beg, &end);
+  linewriter_push(wtr, beg, end);
+}
+
+void linewriter_append(LineWriter *dst, LineWriter *src)
+{
+  size_t size = 1UL<<20, have = 0;
+  char *buf = malloc(size), *line, *end, *nl;
+  ssize_t n;
+
+  if(buf == NULL) die("Out of memory");
+  linewriter_flush(src);
+  if(lseek(src->fd, 0, SEEK_SET) != 0) die("Cannot read %s", src->path);
+
+  if(dst->fd >= 0) {
+    // Plain output, copy blocks
+    linewriter_empty(dst);
+    while((n = read(src->fd, buf, size)) > 0) write_all(dst, buf, n);
+  }
+  else {
+    // Lines go through linewriter_write() to be indexed
+    while((n = read(src->fd, buf+have, size-have)) > 0) {
+      end = buf + have + n;
+      for(line = buf; (nl = memchr(line, '\n', end-line)) != NULL; line = nl+1)
+        linewriter_write(dst, line, nl - line);
+      have = end - line;
+      memmove(buf, line, have);
+      if(have == size && (buf = realloc(buf, size *= 2)) == NULL)
+        die("Out of memory");
+    }
+  }
+
+  if(n < 0) die("Cannot read %s", src->path);
+  free(buf);
+}
+
+// Copy into the buffer, or send long lines straight to writev()
+static void linewriter_write_plain(LineWriter *wtr, const char *line,
+                                   size_t len)
+{
+  if(len >= LONG_LINE) {
+    struct iovec iov[2] = {{.iov_base = (char*)line, .iov_len = len},
+                           {.iov_base = "\n", .iov_len = 1}};
+    linewriter_empty(wtr);
+    writev_all(wtr, iov, 2);
+    return;
+  }
+
+  if(wtr->buf == NULL && (wtr->buf = malloc(wtr->bufsize)) == NULL)
+    die("Out of memory");
+  if(wtr->buflen + len + 1 > wtr->bufsize) linewriter_empty(wtr);
+
+  memcpy(wtr->buf + wtr->buflen, line, len);
+  wtr->buf[wtr->buflen + len] = '\n';
+  wtr->buflen += len + 1;
+
+  if(wtr->buflen > wtr->flush_size) linewriter_empty(wtr);
+}
+
+void linewriter_write(LineWriter *wtr, const char *line, size_t len)
+{
+  if(wtr->fd >= 0) {
+    linewriter_write_plain(wtr, line, len);
+    return;
+  }
+
+  if(wtr->hts != NULL) {
+    if(line[0] == '#') {
+      // Held until the first entry, contigs may still be added
+      strbuf_append_strn(&wtr->htxt, line, len);
+      strbuf_append_char(&wtr->htxt, '\n');
+      return;
+    }
+    wtr->ks.l = 0;
+    kputsn(line, len, &wtr->ks);
+    linewriter_write_bcf(wtr);
+    return;
+  }
+
+  if(wtr->idx_fmt != -1 && wtr->idx == NULL && line[0] != '#') {
+    // First entry, start a new block after the header
+    if(bgzf_flush(wtr->bgzf) != 0) die("Cannot write to file: %s", wtr->path);
+    linewriter_init_index(wtr);
+  }
+
+  bgzf_write_all(wtr, line, len);
+  bgzf_write_all(wtr, "\n", 1);
+
+  if(wtr->idx_fmt != -1 && line[0] != '#') linewriter_index(wtr, line, len);
+}
+
+// Copy into the buffer without a newline, or write long pieces directly
+static void linewriter_put(LineWriter *wtr, const char *ptr, size_t len)
+{
+  if(len >= LONG_PIECE) {
+    linewriter_empty(wtr);
+    write_all(wtr, ptr, len);
+    return;
+  }
+
+  if(wtr->buf == NULL && (wtr->buf = malloc(wtr->bufsize)) == NULL)
+    die("Out of memory");
+  if(wtr->buflen + len > wtr->bufsize) linewriter_empty(wtr);
+
+  memcpy(wtr->buf + wtr->buflen, ptr, len);
+  wtr->buflen += len;
+}
+
+void linewriter_write_entry(LineWriter *wtr, const char *line, size_t len,
+                            LineReader *rdr)
+{
+  LineSpan part;
+  long beg, end;
+
+  if(!rdr->in_samples) {
+    linewriter_write(wtr, line, len);
+    return;
+  }
+
+  if(wtr->hts != NULL) {
+    wtr->ks.l = 0;
+    kputsn(line, len, &wtr->ks);
+    while(linereader_samples(rdr, &part)) kputsn(part.b, part.len, &wtr->ks);
+    linewriter_write_bcf(wtr);
+    return;
+  }
+
+  if(wtr->bgzf == NULL) {
+    linewriter_put(wtr, line, len);
+    while(linereader_samples(rdr, &part)) linewriter_put(wtr, part.b, part.len);
+    linewriter_put(wtr, "\n", 1);
+    if(wtr->buflen > wtr->flush_size) linewriter_empty(wtr);
+    return;
+  }
+
+  if(wtr->idx_fmt != -1) {
+    if(wtr->idx == NULL) {
+      if(bgzf_flush(wtr->bgzf) != 0)
+        die("Cannot write to file: %s", wtr->path);
+      linewriter_init_index(wtr);
+    }
+    // line may be in a block that reading the samples replaces
+    linewriter_locate(wtr, line, len, &beg, &end);
+  }
+
+  bgzf_write_all(wtr, line, len);
+  while(linereader_samples(rdr, &part)) bgzf_write_all(wtr, part.b, part.len);
+  bgzf_write_all(wtr, "\n", 1);
+
+  if(wtr->idx_fmt != -1) linewriter_push(wtr, beg, end);
+}
+
+// Plain output: lines go to writev() without copying. Lines that are followed
+// by a newline in memory (as in the reader's blocks) and lines that follow
+// each other are joined into one iovec.
+void linewriter_write_spans(LineWriter *wtr, const LineSpan *lines, size_t n)
+{
+  struct iovec iov[IOV_MAX], *last = NULL;
+  size_t i, niov = 0;
+  const char *end;
+
+  if(wtr->fd < 0 || n < 8) {
+    for(i = 0; i < n; i++) linewriter_write(wtr, lines[i].b, lines[i].len);
+    return;
+  }
+
+  linewriter_empty(wtr);
+
+  for(i = 0; i < n; i++) {
+    if(niov + 2 > IOV_MAX) {
+      writev_all(wtr, iov, niov);
+      niov = 0;
+      last = NULL;
+    }
+    end = lines[i].b + lines[i].len;
+    if(last != NULL && (char*)last->iov_base + last->iov_len == lines[i].b)
+      last->iov_len += lines[i].len;
+    else {
+      last = &iov[niov++];
+      *last = (struct iovec){.iov_base = lines[i].b, .iov_len = lines[i].len};
+    }
+    if(*end == '\n') last->iov_len++;
+    else {
+      iov[niov++] = (struct iovec){.iov_base = "\n", .iov_len = 1};
+      last = NULL;
+    }
+  }
+
+  writev_all(wtr, iov, niov);
+}
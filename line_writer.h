@@ -0,0 +1,98 @@
+#ifndef LINE_WRITER_H_
+#define LINE_WRITER_H_
+
+#include <stdio.h>
+#include "hts.h"
+#include "bgzf.h"
+#include "vcf.h"
+#include "string_buffer.h"
+#include "line_reader.h"
+
+// Write VCF lines to stdout, a plain file, a BGZF file or BCF. BGZF output is
+// compressed by nthreads threads and, if written to a file, indexed as it is
+// written: path.tbi, or path.csi if csi is set. BCF is written by htslib,
+// which parses each line, and indexed as path.csi.
+//
+// Plain output skips stdio: lines are copied into a large buffer that is
+// written with write(2). Long lines and batches of spans are sent with
+// writev(2) without being copied.
+
+typedef struct {
+  const char *path;
+  int fd; // -1 if BGZF
+  FILE *tmp; // temporary file, if any
+  char *buf; // allocated on first write
+  size_t buflen, bufsize, flush_size;
+  BGZF *bgzf;
+  hts_idx_t *idx;
+  int idx_fmt; // -1 if not indexing
+  StrBuf names; // NUL separated contig names seen so far, index is tid
+  size_t chrom_offset, chrom_len; // current contig name in names
+  int tid;
+  // BCF output, hts is NULL otherwise
+  htsFile *hts;
+  bcf_hdr_t *hdr; // NULL until the first entry
+  bcf1_t *rec;
+  kstring_t ks;
+  StrBuf htxt; // header lines until the first entry
+  StrBuf contigs; // NUL separated, see linewriter_contig()
+} LineWriter;
+
+// Output types for linewriter_open()
+#define OUT_VCF 'v'
+#define OUT_BGZF 'z'
+#define OUT_BCF 'b'
+
+// path may be NULL or "-" for stdout. type is OUT_VCF, OUT_BGZF, OUT_BCF or
+// 0 to go by the path: .gz or .bgz for BGZF, .bcf for BCF, VCF otherwise.
+void linewriter_open(LineWriter *wtr, const char *path, int nthreads, char csi,
+                     char type);
+void linewriter_close(LineWriter *wtr);
+
+// Write to an anonymous temporary file, deleted on close
+void linewriter_open_tmp(LineWriter *wtr);
+
+// Copy everything written to temporary file src so far to the end of dst
+void linewriter_append(LineWriter *dst, LineWriter *src);
+
+// Name a contig to add to the header of BCF output if the VCF header does not
+// define it, as BCF entries can only be on contigs in the header. Must be
+// called before the first entry is written. Ignored for VCF output.
+void linewriter_contig(LineWriter *wtr, const char *name);
+
+// Write the header of BCF input, instead of its header lines. BCF output
+// copies it, adding contigs named with linewriter_contig(), so that records
+// read with linereader_next_rec() are written as they are. Other output gets
+// the header as text.
+void linewriter_bcf_hdr(LineWriter *wtr, const bcf_hdr_t *hdr);
+
+// Write a record read from BCF input with header hdr, formatted as VCF
+// unless the output is BCF. The header is written first, either with
+// linewriter_bcf_hdr() or as header lines; BCF output then maps hdr's ids to
+// its own, which sets up a table in hdr on the first call. If sites is set
+// only the columns up to FORMAT are written, and BCF output drops the samples
+// from rec.
+void linewriter_write_rec(LineWriter *wtr, bcf_hdr_t *hdr, bcf1_t *rec,
+                          char sites);
+
+// Write a line, len does not include a newline, which is added
+void linewriter_write(LineWriter *wtr, const char *line, size_t len);
+
+// Write an entry read in sites only mode followed by its sample columns,
+// which are passed from the reader's blocks to the output without being
+// gathered into one line first
+void linewriter_write_entry(LineWriter *wtr, const char *line, size_t len,
+                            LineReader *rdr);
+
+// Write lines, a newline is added to each. lines[i].b[len] must be readable.
+void linewriter_write_spans(LineWriter *wtr, const LineSpan *lines, size_t n);
+
+// Buffered output is written once flush_size bytes are waiting. Defaults to
+// the buffer size for regular files, 64K for pipes and sockets so the next
+// program gets output as it is produced, and 0 (every line) for terminals.
+void linewriter_flush_size(LineWriter *wtr, size_t flush_size);
+
+// Write out buffered data. Temporary files also free their buffer.
+void linewriter_flush(LineWriter *wtr);
+
+#endif /* LINE_WRITER_H_ */
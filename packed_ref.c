@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "global.h"
+#include "packed_ref.h"
+
+// 1 + 2bit code for A,C,G,T; 0 for any other base
+static const uint8_t base_code[256] = {
+  ['A'] = 1, ['C'] = 2, ['G'] = 3, ['T'] = 4,
+  ['a'] = 1, ['c'] = 2, ['g'] = 3, ['t'] = 4
+};
+
+// Returns 0-3, or >3 if not A,C,G,T
+static inline uint8_t base_to_code(char c) {
+  return (uint8_t)(base_code[(uint8_t)c] - 1);
+}
+
+static const char code_base[4] = "ACGT";
+
+static void packedref_add_exception(PackedRef *pref, size_t pos, char base)
+{
+  RefRun *run;
+  if(pref->nruns > 0) {
+    run = pref->runs + pref->nruns - 1;
+    if(run->start + run->len == pos && run->base == base) { run->len++; return; }
+  }
+  if(pref->nruns == pref->cap_runs) {
+    pref->cap_runs = pref->cap_runs ? pref->cap_runs * 2 : 16;
+    pref->runs = realloc(pref->runs, pref->cap_runs * sizeof(RefRun));
+    if(pref->runs == NULL) die("Out of memory");
+  }
+  // zero padding so that runs can be written out byte-for-byte
+  run = pref->runs + pref->nruns++;
+  memset(run, 0, sizeof(RefRun));
+  run->start = pos;
+  run->len = 1;
+  run->base = base;
+}
+
+void packedref_pack(PackedRef *pref, const char *name,
+                    const char *seq, size_t len)
+{
+  size_t i;
+  uint8_t c;
+
+  pref->name = strdup(name);
+  pref->len = len;
+  pref->words = calloc(MAX2(packedref_nwords(len), 1), sizeof(uint64_t));
+  pref->runs = NULL;
+  pref->nruns = pref->cap_runs = 0;
+  if(pref->name == NULL || pref->words == NULL) die("Out of memory");
+
+  for(i = 0; i < len; i++) {
+    if((c = base_to_code(seq[i])) > 3)
+      packedref_add_exception(pref, i, toupper(seq[i]));
+    else
+      pref->words[i>>5] |= (uint64_t)c << ((i&31)*2);
+  }
+}
+
+void packedref_dealloc(PackedRef *pref)
+{
+  free(pref->name);
+  free(pref->words);
+  free(pref->runs);
+}
+
+// Index of the first run that ends after pos
+static size_t packedref_find_run(const PackedRef *pref, size_t pos)
+{
+  size_t lo = 0, hi = pref->nruns, mid;
+  while(lo < hi) {
+    mid = (lo+hi)/2;
+    if(pref->runs[mid].start + pref->runs[mid].len <= pos) lo = mid+1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// 32 bases starting at pos, bases past the end are zero
+static inline uint64_t packedref_word(const PackedRef *pref, size_t pos)
+{
+  size_t w = pos>>5, shift = (pos&31)*2;
+  uint64_t word = pref->words[w] >> shift;
+  if(shift > 0 && w+1 < packedref_nwords(pref->len))
+    word |= pref->words[w+1] << (64-shift);
+  return word;
+}
+
+char packedref_base(const PackedRef *pref, size_t pos)
+{
+  size_t i = packedref_find_run(pref, pos);
+  if(i < pref->nruns && pref->runs[i].start <= pos) return pref->runs[i].base;
+  return code_base[(pref->words[pos>>5] >> ((pos&31)*2)) & 3];
+}
+
+int packedref_casecmp(const PackedRef *pref, size_t pos,
+                      const char *str, size_t len)
+{
+  size_t i, j, n, r = packedref_find_run(pref, pos);
+  uint64_t word, mask;
+  uint8_t c;
+
+  if(r < pref->nruns && pref->runs[r].start < pos+len) {
+    // Region contains non-ACGT bases, compare one base at a time
+    for(i = 0; i < len; i++)
+      if(packedref_base(pref, pos+i) != toupper(str[i])) return 1;
+    return 0;
+  }
+
+  for(i = 0; i < len; i += 32) {
+    n = MIN2(32, len-i);
+    for(word = 0, j = 0; j < n; j++) {
+      if((c = base_to_code(str[i+j])) > 3) return 1;
+      word |= (uint64_t)c << (j*2);
+    }
+    mask = n == 32 ? ~0UL : (1UL << (n*2)) - 1;
+    if((packedref_word(pref, pos+i) ^ word) & mask) return 1;
+  }
+
+  return 0;
+}
+
+void packedref_copy(const PackedRef *pref, size_t pos, size_t len, char *out)
+{
+  size_t i, j, n, r, end = pos+len;
+  uint64_t word;
+  char *ptr = out;
+
+  for(i = pos; i < end; i += n) {
+    word = pref->words[i>>5] >> ((i&31)*2);
+    n = MIN2(32 - (i&31), end - i);
+    for(j = 0; j < n; j++, word >>= 2) *(ptr++) = code_base[word & 3];
+  }
+
+  for(r = packedref_find_run(pref, pos);
+      r < pref->nruns && pref->runs[r].start < end; r++)
+  {
+    i = MAX2(pref->runs[r].start, pos);
+    n = MIN2(pref->runs[r].start + pref->runs[r].len, end) - i;
+    memset(out + (i - pos), pref->runs[r].base, n);
+  }
+}
+
+void packedref_append(const PackedRef *pref, size_t pos, size_t len,
+                      StrBuf *sbuf)
+{
+  strbuf_ensure_capacity(sbuf, sbuf->end + len);
+  packedref_copy(pref, pos, len, sbuf->b + sbuf->end);
+  sbuf->end += len;
+  sbuf->b[sbuf->end] = '\0';
+}
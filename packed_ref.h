@@ -0,0 +1,46 @@
+#ifndef PACKED_REF_H_
+#define PACKED_REF_H_
+
+#include <inttypes.h>
+#include "string_buffer.h"
+
+// Reference sequence packed at 2 bits per base, 32 bases per 64bit word.
+// A,C,G,T are stored as 0,1,2,3. Any other base (N, IUPAC codes) is stored as
+// 0 and recorded in a sorted run-length list of exceptions. Case is not kept,
+// all accessors return upper case bases.
+
+typedef struct {
+  size_t start, len;
+  char base;
+} RefRun;
+
+typedef struct {
+  char *name;
+  size_t len; // number of bases
+  uint64_t *words;
+  RefRun *runs;
+  size_t nruns, cap_runs;
+} PackedRef;
+
+#define packedref_nwords(len) (((len)+31)/32)
+
+void packedref_pack(PackedRef *pref, const char *name,
+                    const char *seq, size_t len);
+void packedref_dealloc(PackedRef *pref);
+
+// Get an upper case base
+char packedref_base(const PackedRef *pref, size_t pos);
+
+// Compare str against ref[pos..pos+len), ignoring case. pos+len must be <= the
+// length of the ref. Returns 0 if they match, like strncasecmp
+int packedref_casecmp(const PackedRef *pref, size_t pos,
+                      const char *str, size_t len);
+
+// Copy upper case bases ref[pos..pos+len) to out (not NUL terminated)
+void packedref_copy(const PackedRef *pref, size_t pos, size_t len, char *out);
+
+// Append upper case bases ref[pos..pos+len) to sbuf
+void packedref_append(const PackedRef *pref, size_t pos, size_t len,
+                      StrBuf *sbuf);
+
+#endif /* PACKED_REF_H_ */
@@ -0,0 +1,136 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "global.h"
+#include "vcf_record.h"
+#include "vcf_stage.h"
+
+typedef struct {
+  Genome *genome;
+  char swap_alleles;
+  GenomeCursor cursor;
+} RefFilter;
+
+char ref_filter_line(LineSpan *line, VcfRecord *rec, GenomeCursor *gc,
+                     Genome *genome, char swap_alleles)
+{
+  const PackedRef *r;
+  long pos;
+  size_t reflen, altlen;
+
+  r = genomecursor_get(gc, genome, line->b, vcfrecord_collen(rec, VCHR));
+  pos = rec->pos;
+  reflen = vcfrecord_collen(rec, VREF);
+  altlen = vcfrecord_collen(rec, VALT);
+  if(r == NULL) warn("Cannot find chrom: %s", gc->name.b);
+  else if(pos < 0) warn("Bad line: %.*s\n", (int)line->len, line->b);
+  else if((reflen == 1 && altlen == 1) ||
+          *vcfrecord_col(rec, VREF) == *vcfrecord_col(rec, VALT))
+  {
+    if(pos + reflen <= r->len &&
+       packedref_casecmp(r, pos, vcfrecord_col(rec, VREF), reflen) == 0)
+    {
+      return 1;
+    }
+    else if(swap_alleles && pos + altlen <= r->len &&
+            packedref_casecmp(r, pos, vcfrecord_col(rec, VALT), altlen) == 0)
+    {
+      // swap alleles, ALT now starts after the old ALT and neither has commas
+      char tmp[altlen], *ref = line->b + rec->cols[VREF];
+      memcpy(tmp, ref+reflen+1, altlen);
+      memmove(ref+altlen+1, ref, reflen);
+      memcpy(ref, tmp, altlen);
+      ref[altlen] = '\t';
+      rec->cols[VALT] = rec->cols[VREF] + altlen + 1;
+      stats_add(STAT_REF_SWAPPED, 1);
+      return 1;
+    }
+    // else printf("FAIL0\n");
+  }
+  // else printf("FAIL1\n");
+  stats_add(STAT_REF_DROPPED, 1);
+  return 0;
+}
+
+char ref_filter_rec(bcf1_t *rec, const bcf_hdr_t *hdr, GenomeCursor *gc,
+                    Genome *genome, char swap_alleles)
+{
+  const PackedRef *r;
+  const char *chr, *ref, *alt, *swapped[2];
+  size_t reflen, altlen;
+  char multi;
+
+  if(bcf_unpack(rec, BCF_UN_STR) != 0) die("Cannot unpack BCF record");
+  chr = bcf_seqname(hdr, rec);
+  // rid comes from one header, so works as a contig id
+  r = genomecursor_get_id(gc, genome, rec->rid, chr, strlen(chr));
+  ref = rec->d.allele[0];
+  alt = rec->n_allele > 1 ? rec->d.allele[1] : ".";
+  reflen = strlen(ref);
+  altlen = strlen(alt);
+  // In text, ALT holds every alternate allele, so never matches a single base
+  // or the reference
+  multi = (rec->n_allele > 2);
+  if(r == NULL) warn("Cannot find chrom: %s", chr);
+  else if(rec->pos < 0) warn("Bad entry at %s:%"PRId64, chr, rec->pos+1);
+  else if((!multi && reflen == 1 && altlen == 1) || *ref == *alt)
+  {
+    if(rec->pos + reflen <= r->len &&
+       packedref_casecmp(r, rec->pos, ref, reflen) == 0)
+    {
+      return 1;
+    }
+    else if(swap_alleles && !multi && rec->pos + altlen <= r->len &&
+            packedref_casecmp(r, rec->pos, alt, altlen) == 0)
+    {
+      swapped[0] = alt;
+      swapped[1] = ref;
+      if(bcf_update_alleles(hdr, rec, swapped, 2) != 0)
+        die("Cannot swap alleles at %s:%"PRId64, chr, rec->pos+1);
+      stats_add(STAT_REF_SWAPPED, 1);
+      return 1;
+    }
+  }
+  stats_add(STAT_REF_DROPPED, 1);
+  return 0;
+}
+
+static void ref_entry(VcfStage *stage, LineSpan *line, VcfRecord *rec)
+{
+  RefFilter *rf = stage->state;
+  if(ref_filter_line(line, rec, &rf->cursor, rf->genome, rf->swap_alleles))
+    vcfstage_emit_rec(stage, line, rec);
+}
+
+static void ref_entry_bcf(VcfStage *stage, bcf1_t *rec, char sites)
+{
+  RefFilter *rf = stage->state;
+  if(ref_filter_rec(rec, stage->hdr, &rf->cursor, rf->genome,
+                    rf->swap_alleles))
+    vcfstage_emit_bcf(stage, rec, sites);
+}
+
+static void ref_dealloc(VcfStage *stage)
+{
+  RefFilter *rf = stage->state;
+  genomecursor_dealloc(&rf->cursor, rf->genome);
+  free(rf);
+}
+
+void refstage_alloc(VcfStage *stage, Genome *genome, char swap_alleles)
+{
+  RefFilter *rf = malloc(sizeof(RefFilter));
+  if(rf == NULL) die("Out of memory");
+  rf->genome = genome;
+  rf->swap_alleles = swap_alleles;
+  genomecursor_alloc(&rf->cursor);
+
+  memset(stage, 0, sizeof(VcfStage));
+  stage->entry = ref_entry;
+  stage->entry_bcf = ref_entry_bcf;
+  stage->dealloc = ref_dealloc;
+  stage->pass_samples = 1;
+  stage->state = rf;
+}
@@ -0,0 +1,86 @@
+#!/bin/bash
+# Check the tools on the files in tests/. Called by `make test`. Each check
+# runs two commands that should give the same output and diffs them. Set
+# TEST_BIN to check binaries built elsewhere.
+
+set -o pipefail
+
+bin=${TEST_BIN:-./bin}
+out=$(mktemp -d)
+trap 'rm -rf $out' EXIT
+failed=0
+
+# same <name> <cmd1> <cmd2>: both commands write to stdout
+same() {
+  if ! bash -c "$2" > $out/a 2>$out/a.log; then
+    echo "FAIL $1: $2"; cat $out/a.log; failed=1; return
+  fi
+  if ! bash -c "$3" > $out/b 2>$out/b.log; then
+    echo "FAIL $1: $3"; cat $out/b.log; failed=1; return
+  fi
+  if diff -q $out/a $out/b > /dev/null; then echo "ok   $1"
+  else echo "FAIL $1"; diff $out/a $out/b | head -20; failed=1; fi
+}
+
+ref=tests/ref.fa
+
+# --sort on unsorted input gives the output of the sorted file, in memory and
+# when spilling runs to disk
+for tool in vcfcombine vcfcombo; do
+  same "$tool --sort" \
+    "$bin/$tool 10 tests/calls.vcf $ref" \
+    "$bin/$tool --sort 10 tests/calls_unsorted.vcf $ref"
+  same "$tool --sort spilled" \
+    "$bin/$tool 10 tests/calls.vcf $ref" \
+    "$bin/$tool --sort --sort-mem 200 10 tests/calls_unsorted.vcf $ref"
+done
+
+# --threads gives the output of one thread: the pipeline on plain VCF and the
+# contig pool on indexed BGZF. tests/ only has a few lines on one contig, so
+# also check generated data that spans several batches and contigs.
+if ! $bin/vcfbench gen -C 4 -L 500000 -n 20000 $out/gen.fa $out/gen.vcf \
+       2>$out/gen.log; then
+  echo "FAIL vcfbench gen"; cat $out/gen.log; exit 1
+fi
+
+for vcf in tests/calls.vcf tests/dupes.vcf $out/gen.vcf; do
+  fa=$ref name=$(basename $vcf)
+  [ $vcf == $out/gen.vcf ] && fa=$out/gen.fa
+  fixed=$out/${name%.vcf}.fixed.vcf
+
+  same "vcfref -t 4 $name" \
+    "$bin/vcfref -s -t 1 $vcf $fa" \
+    "$bin/vcfref -s -t 4 $vcf $fa"
+
+  # vcfcombo reads vcfref's output, as it would in practice
+  $bin/vcfref -s $vcf $fa > $fixed 2>/dev/null &&
+  $bin/vcfref -s -o $fixed.gz $vcf $fa 2>/dev/null ||
+    { echo "FAIL vcfref $name"; failed=1; continue; }
+
+  same "vcfcombo -t 4 $name" \
+    "$bin/vcfcombo -t 1 10 $fixed $fa" \
+    "$bin/vcfcombo -t 4 10 $fixed $fa"
+  for tool in vcfcombine vcfcombo; do
+    same "$tool -t 4 $name.gz" \
+      "$bin/$tool -t 1 10 $fixed.gz $fa" \
+      "$bin/$tool -t 4 10 $fixed.gz $fa"
+  done
+done
+
+# BCF input goes down the stages as records: output matches the same entries
+# read as text, and --threads matches one thread
+bcf=$out/gen.bcf fa=$out/gen.fa
+$bin/vcfref -s -o $bcf $out/gen.vcf $fa 2>/dev/null &&
+$bin/vcfref $bcf $fa > $out/gen.bcf.vcf 2>/dev/null ||
+  { echo "FAIL vcfref gen.bcf"; exit 1; }
+
+same "vcfref -t 4 gen.bcf" \
+  "$bin/vcfref -s -t 1 $bcf $fa" \
+  "$bin/vcfref -s -t 4 $bcf $fa"
+for tool in vcfcombine vcfcombo; do
+  same "$tool gen.bcf" \
+    "$bin/$tool 10 $out/gen.bcf.vcf $fa" \
+    "$bin/$tool 10 $bcf $fa"
+done
+
+exit $failed
@@ -0,0 +1,393 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "global.h"
+#include "line_reader.h"
+#include "line_writer.h"
+
+static const char usage[] =
+"usage: vcfbench <command> [options] <args>\n"
+"  Commands:\n"
+"    gen    write a synthetic reference and VCF\n"
+"    time   run a command, print its speed and peak memory\n";
+
+static const char gen_usage[] =
+"usage: vcfbench gen [options] <out.fa> <out.vcf[.gz]>\n"
+"  Write a random reference and a sorted VCF of variants on it. The same\n"
+"  options and seed always give the same files. BGZF (.gz) output is indexed.\n"
+"  -r, --seed <N>        random seed [default: 1]\n"
+"  -C, --contigs <N>     number of contigs [default: 4]\n"
+"  -L, --length <N>      bases per contig [default: 1000000]\n"
+"  -n, --entries <N>     entries per contig [default: 50000]\n"
+"  -i, --indels <F>      fraction of entries that are indels [default: 0.2]\n"
+"  -M, --multi <F>       fraction of entries with two ALTs [default: 0.05]\n"
+"  -d, --clusters <F>    fraction within 10bp of the last [default: 0.3]\n"
+"  -x, --mismatch <F>    fraction with REF and ALT swapped [default: 0.01]\n"
+"  -S, --samples <N>     sample columns, each with a GT [default: 1]\n"
+"  -@, --io-threads <N>  threads for BGZF compression [default: 1]\n";
+
+static const char time_usage[] =
+"usage: vcfbench time [options] <name> <in.vcf> <cmd> [args ...]\n"
+"  Run cmd, which reads in.vcf, and print a tab separated line:\n"
+"    name entries bytes secs cpu_secs entries_per_sec mb_per_sec max_rss_kb\n"
+"  bytes is the size of in.vcf as text, uncompressed.\n"
+"  -o, --out <file>      where cmd's stdout goes [default: /dev/null]\n"
+"  -H, --header          print the column names first\n";
+
+static const struct option gen_longopts[] = {
+  {"seed",       required_argument, NULL, 'r'},
+  {"contigs",    required_argument, NULL, 'C'},
+  {"length",     required_argument, NULL, 'L'},
+  {"entries",    required_argument, NULL, 'n'},
+  {"indels",     required_argument, NULL, 'i'},
+  {"multi",      required_argument, NULL, 'M'},
+  {"clusters",   required_argument, NULL, 'd'},
+  {"mismatch",   required_argument, NULL, 'x'},
+  {"samples",    required_argument, NULL, 'S'},
+  {"io-threads", required_argument, NULL, '@'},
+  {NULL, 0, NULL, 0}
+};
+
+static const struct option time_longopts[] = {
+  {"out",    required_argument, NULL, 'o'},
+  {"header", no_argument,       NULL, 'H'},
+  {NULL, 0, NULL, 0}
+};
+
+#define MAX_INDEL 10
+#define CLUSTER_DIST 10
+#define FASTA_WIDTH 60
+
+// xorshift64*, so files are the same on every platform
+static uint64_t rng_state;
+
+static inline uint64_t rng_next()
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0,n)
+static inline size_t rng_below(size_t n)
+{
+  return rng_next() % n;
+}
+
+static inline char rng_chance(double p)
+{
+  return (rng_next() >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+static inline char rng_base()
+{
+  return "ACGT"[rng_next() & 3];
+}
+
+static char parse_fraction(const char *str, double *result)
+{
+  char *end;
+  double f = strtod(str, &end);
+  if(*str == '\0' || *end != '\0' || f < 0 || f > 1) return 0;
+  *result = f;
+  return 1;
+}
+
+typedef struct {
+  size_t ncontigs, length, nentries, nsamples;
+  double indels, multi, clusters, mismatch;
+} GenArgs;
+
+static void gen_fasta(const char *path, const char *name, const char *seq,
+                      size_t len, char append)
+{
+  FILE *fh = fopen(path, append ? "a" : "w");
+  size_t i;
+  if(fh == NULL) die("Cannot write: %s", path);
+  fprintf(fh, ">%s\n", name);
+  for(i = 0; i < len; i += FASTA_WIDTH) {
+    fwrite(seq + i, 1, MIN2(FASTA_WIDTH, len - i), fh);
+    fputc('\n', fh);
+  }
+  if(fclose(fh) != 0) die("Cannot write: %s", path);
+}
+
+// Set ref and alts for an entry at seq[pos]. Returns the REF length, 0 if
+// it would run off the end of the contig.
+static size_t gen_alleles(const GenArgs *args, const char *seq, size_t len,
+                          size_t pos, StrBuf *ref, StrBuf *alts,
+                          size_t *nalts)
+{
+  size_t k, reflen = 1;
+  char indel = rng_chance(args->indels), multi = rng_chance(args->multi);
+  char del = indel && (rng_next() & 1), b;
+
+  if(del) reflen += 1 + rng_below(MAX_INDEL);
+  if(pos + reflen > len) return 0;
+
+  strbuf_reset(ref);
+  strbuf_reset(alts);
+  strbuf_append_strn(ref, seq + pos, reflen);
+  *nalts = 1 + multi;
+
+  if(!indel) {
+    while((b = rng_base()) == seq[pos]) {}
+    strbuf_append_char(alts, b);
+    if(multi) {
+      strbuf_append_char(alts, ',');
+      while((b = rng_base()) == seq[pos] || b == alts->b[0]) {}
+      strbuf_append_char(alts, b);
+    }
+  }
+  else {
+    // Deletion: first base only. Insertion: REF then 1-MAX_INDEL bases.
+    strbuf_append_char(alts, seq[pos]);
+    if(!del) {
+      for(k = 1 + rng_below(MAX_INDEL); k > 0; k--)
+        strbuf_append_char(alts, rng_base());
+    }
+    if(multi) {
+      // ALT 1 with a base added, which must not make it REF
+      strbuf_ensure_capacity(alts, 2*alts->end + 2);
+      strbuf_append_char(alts, ',');
+      strbuf_append_strn(alts, alts->b, alts->end - 1);
+      while((b = rng_base()) == seq[pos+1] && reflen == 2) {}
+      strbuf_append_char(alts, b);
+    }
+  }
+
+  return reflen;
+}
+
+static void gen_entries(const GenArgs *args, const char *name,
+                        const char *seq, LineWriter *wtr)
+{
+  StrBuf line, ref, alts;
+  size_t i, s, pos = 0, gap, nalts, reflen;
+  size_t mean_gap = MAX2(args->length / MAX2(args->nentries, 1), 2);
+
+  strbuf_alloc(&line, 1024);
+  strbuf_alloc(&ref, 64);
+  strbuf_alloc(&alts, 64);
+
+  for(i = 0; i < args->nentries; i++)
+  {
+    if(i > 0 && rng_chance(args->clusters)) gap = 1 + rng_below(CLUSTER_DIST);
+    else gap = 1 + rng_below(2*mean_gap);
+    pos += gap;
+    if(pos >= args->length) break;
+
+    reflen = gen_alleles(args, seq, args->length, pos, &ref, &alts, &nalts);
+    if(reflen == 0) break;
+
+    strbuf_reset(&line);
+    strbuf_sprintf(&line, "%s\t%zu\t.\t", name, pos+1);
+
+    // Swapped entries have REF from the first ALT, vcfref -s fixes them
+    if(nalts == 1 && rng_chance(args->mismatch)) {
+      strbuf_append_strn(&line, alts.b, alts.end);
+      strbuf_append_char(&line, '\t');
+      strbuf_append_strn(&line, ref.b, ref.end);
+    } else {
+      strbuf_append_strn(&line, ref.b, ref.end);
+      strbuf_append_char(&line, '\t');
+      strbuf_append_strn(&line, alts.b, alts.end);
+    }
+    strbuf_append_str(&line, "\t.\tPASS\t.");
+
+    strbuf_append_str(&line, "\tGT");
+    for(s = 0; s < args->nsamples; s++) {
+      strbuf_append_char(&line, '\t');
+      strbuf_append_char(&line, '0' + rng_below(nalts+1));
+      strbuf_append_char(&line, '/');
+      strbuf_append_char(&line, '0' + rng_below(nalts+1));
+    }
+
+    linewriter_write(wtr, line.b, line.end);
+  }
+
+  strbuf_dealloc(&line);
+  strbuf_dealloc(&ref);
+  strbuf_dealloc(&alts);
+}
+
+static int gen(int argc, char **argv)
+{
+  GenArgs args = {.ncontigs = 4, .length = 1000000, .nentries = 50000,
+                  .nsamples = 1, .indels = 0.2, .multi = 0.05,
+                  .clusters = 0.3, .mismatch = 0.01};
+  size_t i, j, seed = 1;
+  int io_threads = 1;
+  double *frac;
+
+  int c;
+  while((c = getopt_long(argc, argv, "r:C:L:n:i:M:d:x:S:@:", gen_longopts,
+                         NULL)) >= 0) {
+    switch (c) {
+      case 'r':
+        if(!parse_entire_size(optarg, &seed))
+          print_usage(gen_usage, "Invalid --seed value: %s", optarg);
+        break;
+      case 'C':
+        if(!parse_entire_size(optarg, &args.ncontigs) || args.ncontigs == 0)
+          print_usage(gen_usage, "Invalid --contigs value: %s", optarg);
+        break;
+      case 'L':
+        if(!parse_entire_size(optarg, &args.length) || args.length == 0)
+          print_usage(gen_usage, "Invalid --length value: %s", optarg);
+        break;
+      case 'n':
+        if(!parse_entire_size(optarg, &args.nentries))
+          print_usage(gen_usage, "Invalid --entries value: %s", optarg);
+        break;
+      case 'S':
+        // Our tools expect a FORMAT column, so at least one sample
+        if(!parse_entire_size(optarg, &args.nsamples) || args.nsamples == 0)
+          print_usage(gen_usage, "Invalid --samples value: %s", optarg);
+        break;
+      case '@':
+        if(!parse_entire_int(optarg, &io_threads) || io_threads < 1)
+          print_usage(gen_usage, "Invalid --io-threads value: %s", optarg);
+        break;
+      case 'i': case 'M': case 'd': case 'x':
+        frac = c == 'i' ? &args.indels : c == 'M' ? &args.multi :
+               c == 'd' ? &args.clusters : &args.mismatch;
+        if(!parse_fraction(optarg, frac))
+          print_usage(gen_usage, "Invalid fraction for -%c: %s", c, optarg);
+        break;
+      default: die("Unknown option: %c", c);
+    }
+  }
+
+  if(argc - optind != 2) print_usage(gen_usage, "Expected two arguments");
+
+  const char *fapath = argv[optind], *vcfpath = argv[optind+1];
+  char *seq = malloc(args.length), name[32];
+  if(seq == NULL) die("Out of memory");
+  rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+
+  LineWriter writer;
+  linewriter_open(&writer, vcfpath, io_threads, 0, 0);
+
+  StrBuf hdr;
+  strbuf_alloc(&hdr, 1024);
+  strbuf_append_str(&hdr, "##fileformat=VCFv4.1");
+  linewriter_write(&writer, hdr.b, hdr.end);
+  for(i = 0; i < args.ncontigs; i++) {
+    strbuf_reset(&hdr);
+    strbuf_sprintf(&hdr, "##contig=<ID=chr%zu,length=%zu>", i+1, args.length);
+    linewriter_write(&writer, hdr.b, hdr.end);
+  }
+  strbuf_reset(&hdr);
+  strbuf_append_str(&hdr, "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO"
+                          "\tFORMAT");
+  for(i = 0; i < args.nsamples; i++) strbuf_sprintf(&hdr, "\tS%zu", i);
+  linewriter_write(&writer, hdr.b, hdr.end);
+  strbuf_dealloc(&hdr);
+
+  for(i = 0; i < args.ncontigs; i++) {
+    sprintf(name, "chr%zu", i+1);
+    for(j = 0; j < args.length; j++) seq[j] = rng_base();
+    gen_fasta(fapath, name, seq, args.length, i > 0);
+    gen_entries(&args, name, seq, &writer);
+  }
+
+  linewriter_close(&writer);
+  free(seq);
+  return 0;
+}
+
+static double now_secs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int run_time(int argc, char **argv)
+{
+  const char *outpath = "/dev/null";
+  char header = 0;
+
+  int c;
+  // + stops at cmd so its options are left alone
+  while((c = getopt_long(argc, argv, "+o:H", time_longopts, NULL)) >= 0) {
+    switch (c) {
+      case 'o': outpath = optarg; break;
+      case 'H': header = 1; break;
+      default: die("Unknown option: %c", c);
+    }
+  }
+
+  if(argc - optind < 3) print_usage(time_usage, "Not enough arguments");
+
+  const char *name = argv[optind], *inputpath = argv[optind+1];
+  char **cmd = argv + optind + 2;
+
+  // Count entries and text bytes first, this also warms the page cache
+  LineReader reader;
+  LineSpan line;
+  size_t nentries = 0, nbytes = 0;
+  linereader_open(&reader, inputpath, 1);
+  while(linereader_next(&reader, &line)) {
+    nentries += (line.len > 0 && line.b[0] != '#');
+    nbytes += line.len + 1;
+  }
+  linereader_close(&reader);
+
+  double start = now_secs();
+  pid_t pid = fork();
+  int fd, status;
+  struct rusage usage;
+
+  if(pid < 0) die("Cannot fork");
+  if(pid == 0) {
+    if((fd = open(outpath, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0 ||
+       dup2(fd, STDOUT_FILENO) < 0) die("Cannot write: %s", outpath);
+    close(fd);
+    execvp(cmd[0], cmd);
+    die("Cannot run: %s", cmd[0]);
+  }
+
+  if(wait4(pid, &status, 0, &usage) < 0) die("wait4 failed");
+  double secs = now_secs() - start;
+  if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    die("Command failed: %s", cmd[0]);
+
+  double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+               usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+  long rss = usage.ru_maxrss;
+  #ifdef __APPLE__
+    rss /= 1024; // bytes on macOS
+  #endif
+
+  if(header) {
+    printf("name\tentries\tbytes\tsecs\tcpu_secs\tentries_per_sec\t"
+           "mb_per_sec\tmax_rss_kb\n");
+  }
+  printf("%s\t%zu\t%zu\t%.3f\t%.3f\t%.0f\t%.2f\t%ld\n", name, nentries, nbytes,
+         secs, cpu, nentries / MAX2(secs, 1e-9),
+         nbytes / MAX2(secs, 1e-9) / 1e6, rss);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if(argc < 2) print_usage(usage, NULL);
+
+  const char *cmd = argv[1];
+
+  if(strcmp(cmd, "gen") == 0) return gen(argc-1, argv+1);
+  if(strcmp(cmd, "time") == 0) return run_time(argc-1, argv+1);
+
+  print_usage(usage, "Unknown command: %s", cmd);
+}
@@ -0,0 +1,383 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+
+#include "global.h"
+#include "genome.h"
+#include "line_reader.h"
+#include "line_writer.h"
+#include "vcf_stage.h"
+#include "contig_pool.h"
+#include "vcf_record.h"
+
+static const char usage[] =
+"usage: vcfhack <command> [options] <args>\n"
+"  Commands:\n"
+"    ref-index   write a binary reference image for fast loading\n"
+"    run         run vcfref, vcfcombine and vcfcombo steps in one process\n"
+"    top         list the most expensive clusters in a vcfcombo --trace\n";
+
+static const char ref_index_usage[] =
+"usage: vcfhack ref-index [options] <out.img> <in.fa> [in.fa ...]\n"
+"  Write a reference image that vcfref, vcfcombine and vcfcombo can mmap\n"
+"  instead of parsing FASTA. Pass out.img in place of in.fa to use it.\n"
+"  -m, --ref-mem <M>     memory limit for indexed (.fai) references [e.g. 2G]\n";
+
+static const struct option ref_index_longopts[] = {
+  {"ref-mem", required_argument, NULL, 'm'},
+  {NULL, 0, NULL, 0}
+};
+
+static int ref_index(int argc, char **argv)
+{
+  size_t i, ref_mem = 1;
+
+  int c;
+  while((c = getopt_long(argc, argv, "m:", ref_index_longopts, NULL)) >= 0) {
+    switch (c) {
+      case 'm':
+        if(!parse_mem_size(optarg, &ref_mem))
+          print_usage(ref_index_usage, "Invalid --ref-mem value: %s", optarg);
+        break;
+      default: die("Unknown option: %c", c);
+    }
+  }
+
+  if(argc - optind < 2) print_usage(ref_index_usage, "Not enough arguments");
+
+  const char *outpath = argv[optind];
+  char **refpaths = argv + optind + 1;
+  size_t num_refs = argc - optind - 1;
+
+  // By default only hold one indexed chromosome at a time
+  Genome genome;
+  genome_alloc(&genome, ref_mem);
+
+  for(i = 0; i < num_refs; i++) {
+    fprintf(stderr, "Loading %s\n", refpaths[i]);
+    genome_load(&genome, refpaths[i]);
+  }
+
+  if(genome.nchroms == 0) die("No chromosomes loaded");
+
+  fprintf(stderr, "Writing %s\n", outpath);
+  genome_save_image(&genome, outpath);
+  genome_dealloc(&genome);
+
+  fprintf(stderr, " Done.\n");
+  return 0;
+}
+
+static const char run_usage[] =
+"usage: vcfhack run [options] -S <stages> <in.vcf[.gz]|in.bcf> [in.fa ...]\n"
+"  Run several steps in one process. The reference is loaded once and entries\n"
+"  go from one step to the next in memory.\n"
+"  -S, --stages <list>   comma separated steps, run in order:\n"
+"                          ref          as vcfref\n"
+"                          ref:swap     as vcfref --swap\n"
+"                          combine:<k>  as vcfcombine <k>\n"
+"                          combo:<k>    as vcfcombo <k>\n"
+"                          combo:<k>:<N>  as vcfcombo -H <N> <k>\n"
+"  -m, --ref-mem <M>     memory limit for indexed (.fai) references [e.g. 2G]\n"
+"  -o, --out <file>      output file, indexed if BGZF (.gz) or BCF (.bcf)\n"
+"  -O, --output-type <t> v: VCF, z: BGZF VCF, b: BCF [default: from --out]\n"
+"  -c, --csi             write a CSI index (.csi) instead of tabix (.tbi)\n"
+"  -@, --io-threads <N>  threads for BGZF (de)compression [default: 1]\n"
+"  -j, --stats <file>    write counters and timings as JSON, - for stderr\n"
+"  -J, --stats-every <S> also write them every S seconds\n"
+"  -T, --trace <file>    write the cost of each cluster combined, as tab\n"
+"                        separated lines, - for stderr. See vcfhack top\n"
+"  -t, --threads <N>     process contigs in parallel, needs indexed input\n"
+"  -g, --genotypes       keep GT through combine and combo steps\n"
+"  e.g. vcfhack run -S ref:swap,combo:10 calls.vcf ref.fa > combo.vcf\n";
+
+static const struct option run_longopts[] = {
+  {"stages",     required_argument, NULL, 'S'},
+  {"ref-mem",    required_argument, NULL, 'm'},
+  {"out",        required_argument, NULL, 'o'},
+  {"output-type", required_argument, NULL, 'O'},
+  {"csi",        no_argument,       NULL, 'c'},
+  {"io-threads", required_argument, NULL, '@'},
+  {"threads",    required_argument, NULL, 't'},
+  {"stats",      required_argument, NULL, 'j'},
+  {"stats-every", required_argument, NULL, 'J'},
+  {"trace",      required_argument, NULL, 'T'},
+  {"genotypes",  no_argument,       NULL, 'g'},
+  {NULL, 0, NULL, 0}
+};
+
+// Parse n comma separated stage specs into stages[0..n-1] and chain them
+static void parse_stages(const char *list, VcfStage *stages, size_t n,
+                           Genome *genome, char genotypes)
+{
+  char spec[strlen(list)+1], *str, *comma;
+  size_t i;
+
+  strcpy(spec, list);
+  for(i = 0, str = spec; i < n; i++, str = comma+1) {
+    if((comma = strchr(str, ',')) != NULL) *comma = '\0';
+    if(!vcfstage_parse(&stages[i], str, genome, genotypes))
+      print_usage(run_usage, "Invalid stage: %s", str);
+    if(i > 0) stages[i-1].next = &stages[i];
+  }
+}
+
+static int run(int argc, char **argv)
+{
+  size_t i, nstages = 0, ref_mem = 0;
+  int io_threads = 1, threads = 1;
+  char *stagelist = NULL, *outpath = NULL, csi = 0, outtype = 0, genotypes = 0;
+  const char *statspath = NULL, *tracepath = NULL;
+  double stats_every = 0;
+  const char *str;
+
+  int c;
+  while((c = getopt_long(argc, argv, "S:m:o:c@:t:gO:j:J:T:", run_longopts,
+                         NULL)) >= 0) {
+    switch (c) {
+      case 'S': stagelist = optarg; break;
+      case 'm':
+        if(!parse_mem_size(optarg, &ref_mem))
+          print_usage(run_usage, "Invalid --ref-mem value: %s", optarg);
+        break;
+      case 'o': outpath = optarg; break;
+      case 'O':
+        if(strlen(optarg) != 1 || strchr("vzb", optarg[0]) == NULL)
+          print_usage(run_usage, "Invalid --output-type value: %s", optarg);
+        outtype = optarg[0];
+        break;
+      case 'c': csi = 1; break;
+      case '@':
+        if(!parse_entire_int(optarg, &io_threads) || io_threads < 1)
+          print_usage(run_usage, "Invalid --io-threads value: %s", optarg);
+        break;
+      case 't':
+        if(!parse_entire_int(optarg, &threads) || threads < 1)
+          print_usage(run_usage, "Invalid --threads value: %s", optarg);
+        break;
+      case 'g': genotypes = 1; break;
+      case 'j': statspath = optarg; break;
+      case 'J':
+        if(!parse_entire_double(optarg, &stats_every) || stats_every <= 0)
+          print_usage(run_usage, "Invalid --stats-every value: %s", optarg);
+        break;
+      case 'T': tracepath = optarg; break;
+      default: die("Unknown option: %c", c);
+    }
+  }
+
+  if(stagelist == NULL) print_usage(run_usage, "No --stages given");
+  if(optind == argc) print_usage(run_usage, "Not enough arguments");
+  if(statspath != NULL) stats_open(statspath, "vcfhack run", stats_every);
+
+  ComboTrace trace;
+  if(tracepath != NULL) combotrace_open(&trace, tracepath);
+
+  const char *inputpath = argv[optind];
+  char **refpaths = argv + optind + 1;
+  size_t num_refs = argc - optind - 1;
+
+  for(str = stagelist, nstages = 1; *str; str++) nstages += (*str == ',');
+
+  Genome genome;
+  genome_alloc(&genome, ref_mem);
+
+  // One chain of stages per thread
+  VcfStage *stages = malloc(threads * nstages * sizeof(VcfStage));
+  VcfStage *heads[threads];
+  if(stages == NULL) die("Out of memory");
+
+  for(i = 0; i < (size_t)threads; i++) {
+    heads[i] = &stages[i*nstages];
+    parse_stages(stagelist, heads[i], nstages, &genome, genotypes);
+    if(tracepath != NULL) combostage_trace(heads[i], &trace);
+  }
+
+  LineReader reader;
+  linereader_open(&reader, inputpath, io_threads);
+
+  LineWriter writer;
+  linewriter_open(&writer, outpath, io_threads, csi, outtype);
+
+  for(i = 0; i < num_refs; i++) {
+    fprintf(stderr, "Loading %s\n", refpaths[i]);
+    genome_load(&genome, refpaths[i]);
+  }
+
+  if(num_refs == 0) {
+    fprintf(stderr, "Loading from stdin\n");
+    genome_load(&genome, "-");
+  }
+
+  if(genome.nchroms == 0) die("No chromosomes loaded");
+
+  // BCF output needs every contig in its header
+  for(i = 0; i < genome.nchroms; i++)
+    linewriter_contig(&writer, genome.chroms[i]->name);
+
+  // Now read VCF
+  vcfstage_last(heads[0])->wtr = &writer;
+  vcfstage_header(heads[0], &reader);
+  for(i = 1; i < (size_t)threads; i++) vcfstage_copy_header(heads[i], heads[0]);
+
+  if(threads == 1) vcfstage_run(heads[0], &reader);
+  else contigpool_run(inputpath, threads, &writer, vcfstage_run_contig, heads);
+
+  for(i = 0; i < threads * nstages; i++) vcfstage_dealloc(&stages[i]);
+  free(stages);
+  genome_dealloc(&genome);
+  linereader_close(&reader);
+  linewriter_close(&writer);
+  if(tracepath != NULL) combotrace_close(&trace);
+  stats_close();
+
+  fprintf(stderr, " Done.\n");
+  return 0;
+}
+
+static const char top_usage[] =
+"usage: vcfhack top [options] <trace.tsv[.gz]>\n"
+"  List the clusters that took longest to combine, from the --trace of\n"
+"  vcfcombo or vcfhack run, most expensive first. Each trace line is printed\n"
+"  with the percent of the total time.\n"
+"  -n, --num <N>         number of clusters to list [default: 20]\n"
+"  -b, --bed             print regions as BED instead, e.g. to exclude them\n";
+
+static const struct option top_longopts[] = {
+  {"num", required_argument, NULL, 'n'},
+  {"bed", no_argument,       NULL, 'b'},
+  {NULL, 0, NULL, 0}
+};
+
+typedef struct {
+  uint64_t ns;
+  StrBuf line;
+} TopCluster;
+
+#define TRACE_COLS 9
+
+// Min-heap on ns, so the cheapest of the clusters kept is at the top
+static void top_sift_down(TopCluster *heap, size_t n, size_t i)
+{
+  size_t child;
+  TopCluster tmp;
+  for(; (child = 2*i+1) < n; i = child) {
+    if(child+1 < n && heap[child+1].ns < heap[child].ns) child++;
+    if(heap[i].ns <= heap[child].ns) break;
+    SWAP(heap[i], heap[child], tmp);
+  }
+}
+
+static void top_sift_up(TopCluster *heap, size_t i)
+{
+  TopCluster tmp;
+  for(; i > 0 && heap[(i-1)/2].ns > heap[i].ns; i = (i-1)/2)
+    SWAP(heap[i], heap[(i-1)/2], tmp);
+}
+
+static int top(int argc, char **argv)
+{
+  size_t i, num = 20, n = 0, nclusters = 0;
+  uint64_t total = 0, topns = 0;
+  char bed = 0;
+  const char *str;
+  uint32_t tabs[TRACE_COLS];
+  long ns;
+  LineSpan line;
+  TopCluster tmp;
+
+  int c;
+  while((c = getopt_long(argc, argv, "n:b", top_longopts, NULL)) >= 0) {
+    switch (c) {
+      case 'n':
+        if(!parse_entire_size(optarg, &num) || num == 0)
+          print_usage(top_usage, "Invalid --num value: %s", optarg);
+        break;
+      case 'b': bed = 1; break;
+      default: die("Unknown option: %c", c);
+    }
+  }
+
+  if(optind + 1 != argc) print_usage(top_usage, "Expected one trace file");
+
+  TopCluster *heap = malloc(num * sizeof(TopCluster));
+  if(heap == NULL) die("Out of memory");
+
+  LineReader reader;
+  linereader_open(&reader, argv[optind], 1);
+
+  while(linereader_next(&reader, &line)) {
+    if(line.len == 0 || line.b[0] == '#') continue;
+    if(vcf_find_tabs(line.b, line.len, tabs, TRACE_COLS) != TRACE_COLS-1 ||
+       (ns = vcf_parse_uint(line.b + tabs[6] + 1, tabs[7] - tabs[6] - 1)) < 0)
+      die("Bad trace line: %.*s", (int)line.len, line.b);
+
+    nclusters++;
+    total += ns;
+    if(n == num) {
+      if((uint64_t)ns <= heap[0].ns) continue;
+      strbuf_reset(&heap[0].line);
+      strbuf_append_strn(&heap[0].line, line.b, line.len);
+      heap[0].ns = ns;
+      top_sift_down(heap, n, 0);
+    }
+    else {
+      strbuf_alloc(&heap[n].line, line.len + 1);
+      strbuf_append_strn(&heap[n].line, line.b, line.len);
+      heap[n].ns = ns;
+      top_sift_up(heap, n++);
+    }
+  }
+
+  linereader_close(&reader);
+
+  // Pop the cheapest to the end, leaving the most expensive first
+  for(i = n; i > 1; i--) {
+    SWAP(heap[0], heap[i-1], tmp);
+    top_sift_down(heap, i-1, 0);
+  }
+
+  if(!bed) {
+    printf("#chrom\tstart\tend\tnvars\tsubsets\tgenotypes\talleles\tns\t"
+           "combined\tpercent\n");
+  }
+
+  for(i = 0; i < n; i++) {
+    topns += heap[i].ns;
+    if(bed) {
+      // start is 1-based, BED is 0-based half open
+      str = heap[i].line.b;
+      vcf_find_tabs(str, heap[i].line.end, tabs, 3);
+      printf("%.*s\t%li\t%.*s\t%lu\n", (int)tabs[0], str,
+             vcf_parse_uint(str + tabs[0] + 1, tabs[1] - tabs[0] - 1) - 1,
+             (int)(tabs[2] - tabs[1] - 1), str + tabs[1] + 1,
+             (unsigned long)heap[i].ns);
+    }
+    else {
+      printf("%s\t%.2f\n", heap[i].line.b,
+             total ? 100.0 * heap[i].ns / total : 0);
+    }
+    strbuf_dealloc(&heap[i].line);
+  }
+  free(heap);
+
+  fprintf(stderr, "%zu of %zu clusters, %.3f of %.3f secs (%.1f%%)\n",
+          n, nclusters, topns * 1e-9, total * 1e-9,
+          total ? 100.0 * topns / total : 0);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if(argc < 2) print_usage(usage, NULL);
+
+  const char *cmd = argv[1];
+
+  if(strcmp(cmd, "ref-index") == 0) return ref_index(argc-1, argv+1);
+  if(strcmp(cmd, "run") == 0) return run(argc-1, argv+1);
+  if(strcmp(cmd, "top") == 0) return top(argc-1, argv+1);
+
+  print_usage(usage, "Unknown command: %s", cmd);
+}
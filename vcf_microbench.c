@@ -0,0 +1,359 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "global.h"
+#include "string_buffer.h"
+#include "arena.h"
+#include "vcf_record.h"
+#include "vcf_stage.h"
+#include "genome.h"
+#include "combo_kernels.h"
+
+static const char usage[] =
+"usage: vcfmicrobench [options] [fixture ...]\n"
+"  Time vcfcombo's and vcfcombine's kernels on fixed clusters, all fixtures by\n"
+"  default.\n"
+"  Prints a tab separated line per fixture and kernel:\n"
+"    fixture kernel nvars haplotypes ns_per_op allocs_per_op\n"
+"  Allocations are counted with glibc only, '-' otherwise. Kernels:\n"
+"    parse      vcfrecord_parse() each line\n"
+"    construct  parse and copy each line into the cluster's arena\n"
+"    trim       construct, then trim, sort and dedup each var's alleles\n"
+"    merge      vars_merge() the first var with each of the others\n"
+"    combos     compat_build() and generate_var_combinations()\n"
+"    combine    vcfcombine's Combiner over the entries, from the first\n"
+"               entry to the merged line\n"
+"  -s, --secs <S>        minimum seconds per kernel [default: 0.5]\n"
+"  Fixtures: typical, snps, indels, overlaps\n";
+
+static const struct option longopts[] = {
+  {"secs", required_argument, NULL, 's'},
+  {NULL, 0, NULL, 0}
+};
+
+#ifdef __GLIBC__
+// Count every allocation, including those of the string and arena libraries
+static size_t nallocs = 0;
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+void *malloc(size_t size) { nallocs++; return __libc_malloc(size); }
+void *calloc(size_t n, size_t size) { nallocs++; return __libc_calloc(n,size); }
+void *realloc(void *ptr, size_t size) {
+  nallocs++;
+  return __libc_realloc(ptr, size);
+}
+#endif
+
+#define MAX_VARS 64
+
+// Entries within a base of the cluster join it, so neighbouring SNPs are one
+// cluster for the Combiner as they are for the other kernels
+#define COMBINE_OVERLAP 1
+
+// A cluster of entries on a made up reference. Lines are built so that REF
+// matches ref, with POS 1 at ref[0].
+typedef struct {
+  const char *name;
+  char ref[MAX_VARS*2];
+  StrBuf lines; // newline separated
+  size_t nlines;
+  VcfRecord recs[MAX_VARS];
+  VarSet vset;
+  CompatMatrix compat;
+  AlleleSet alleles;
+  Arena merge_arena;
+  Genome genome; // chr1 is ref
+  VcfStage combine;
+  LineBatch out; // output of combine
+  const char *minref; // ref of the trimmed cluster
+  size_t reflen, nhaplotypes;
+} Cluster;
+
+static void cluster_alloc(Cluster *c, const char *name)
+{
+  size_t i;
+  c->name = name;
+  for(i = 0; i+1 < sizeof(c->ref); i++) c->ref[i] = "ACCAGTTGCA"[i % 10];
+  c->ref[i] = '\0';
+  strbuf_alloc(&c->lines, 1024);
+  c->nlines = 0;
+  varset_alloc(&c->vset);
+  compat_alloc(&c->compat);
+  alleleset_alloc(&c->alleles);
+  arena_alloc(&c->merge_arena, 1UL<<12);
+  genome_alloc(&c->genome, 0);
+  genome_add_seq(&c->genome, "chr1", c->ref, strlen(c->ref));
+  combinestage_alloc(&c->combine, &c->genome, COMBINE_OVERLAP, 0);
+  memset(&c->out, 0, sizeof(LineBatch));
+  strbuf_alloc(&c->out.text, 1024);
+  c->combine.batch = &c->out;
+}
+
+static void cluster_dealloc(Cluster *c)
+{
+  strbuf_dealloc(&c->lines);
+  varset_dealloc(&c->vset);
+  compat_dealloc(&c->compat);
+  alleleset_dealloc(&c->alleles);
+  arena_dealloc(&c->merge_arena);
+  vcfstage_dealloc(&c->combine);
+  genome_dealloc(&c->genome);
+  strbuf_dealloc(&c->out.text);
+  free(c->out.out);
+}
+
+// Add an entry with reflen bases of ref from pos (1-based)
+static void cluster_add(Cluster *c, size_t pos, size_t reflen,
+                        const char *alts)
+{
+  if(c->nlines == MAX_VARS) die("Too many entries in fixture %s", c->name);
+  strbuf_sprintf(&c->lines, "chr1\t%zu\t.\t%.*s\t%s\t.\tPASS\t.\tGT\t0/1\n",
+                 pos, (int)reflen, c->ref + pos - 1, alts);
+  c->nlines++;
+}
+
+// The ACCA cluster worked through in the comments in combo_stage.c: a SNP,
+// two overlapping deletions and a multi-allelic SNP
+static void fixture_typical(Cluster *c)
+{
+  cluster_alloc(c, "typical");
+  cluster_add(c, 1, 1, "T");
+  cluster_add(c, 1, 2, "A");
+  cluster_add(c, 2, 3, "C");
+  cluster_add(c, 4, 1, "C,T");
+}
+
+// Neighbouring SNPs each with all three alts, every combination is valid
+static void fixture_snps(Cluster *c)
+{
+  size_t i;
+  char alts[6], b;
+  cluster_alloc(c, "snps");
+  for(i = 1; i <= 6; i++) {
+    b = c->ref[i-1];
+    sprintf(alts, "%c,%c,%c", b == 'A' ? 'T' : 'A', b == 'C' ? 'T' : 'C',
+            b == 'G' ? 'T' : 'G');
+    cluster_add(c, i, 1, alts);
+  }
+}
+
+// 20 overlapping indels: a 5 base deletion at each position, alternating
+// with a one base insertion
+static void fixture_indels(Cluster *c)
+{
+  size_t i;
+  char alts[3] = {0};
+  cluster_alloc(c, "indels");
+  for(i = 1; i <= 20; i++) {
+    alts[0] = c->ref[i-1];
+    if(i & 1) cluster_add(c, i, 6, alts);
+    else {
+      alts[1] = 'G';
+      cluster_add(c, i, 1, alts);
+      alts[1] = '\0';
+    }
+  }
+}
+
+// Entries that each overlap all of the others: from each position a deletion
+// to the end of the cluster and a SNP. Every pair of vars clashes so there are
+// few combinations, while the Combiner's merged alleles are long.
+static void fixture_overlaps(Cluster *c)
+{
+  size_t i;
+  char alts[MAX_VARS*2];
+  cluster_alloc(c, "overlaps");
+  for(i = 1; i <= 30; i++) {
+    // REF is ref[i-1..40)
+    sprintf(alts, "%c,%c%.*s", c->ref[i-1], c->ref[i-1] == 'A' ? 'T' : 'A',
+            (int)(40-i), c->ref + i);
+    cluster_add(c, i, 41-i, alts);
+  }
+}
+
+//
+// Kernels
+//
+
+static void kernel_parse(Cluster *c)
+{
+  const char *line = c->lines.b;
+  size_t i;
+  for(i = 0; i < c->nlines; i++) {
+    vcfrecord_parse(&c->recs[i], line, strchr(line, '\n') - line);
+    line += c->recs[i].len + 1;
+  }
+}
+
+static void kernel_construct(Cluster *c)
+{
+  size_t i;
+  kernel_parse(c);
+  varset_reset(&c->vset);
+  for(i = 0; i < c->nlines; i++) varset_add(&c->vset, &c->recs[i]);
+}
+
+static void kernel_trim(Cluster *c)
+{
+  size_t i;
+  Var *var;
+  kernel_construct(c);
+  for(i = 0; i < c->vset.nvars; i++) {
+    var = &c->vset.vars[i];
+    var_trim_alts_starts(var);
+    var_trim_alts_ends(var);
+    var_sort_alts(var);
+    var_remove_dup_alts(var);
+  }
+}
+
+static void kernel_merge(Cluster *c)
+{
+  Var dst = c->vset.vars[0];
+  size_t i;
+  arena_reset(&c->merge_arena);
+  for(i = 1; i < c->vset.nvars; i++)
+    vars_merge(&dst, &c->vset.vars[i], &c->merge_arena);
+}
+
+static void kernel_combos(Cluster *c)
+{
+  size_t nsets;
+  compat_build(&c->compat, c->vset.vars, c->vset.nvars);
+  generate_var_combinations(c->vset.vars, &c->compat, c->minref, c->reflen,
+                            &c->alleles, &nsets);
+}
+
+static void kernel_combine(Cluster *c)
+{
+  LineSpan line = {.b = c->lines.b};
+  size_t i;
+  c->out.nout = 0;
+  strbuf_reset(&c->out.text);
+  for(i = 0; i < c->nlines; i++) {
+    line.len = strchr(line.b, '\n') - line.b;
+    vcfstage_push(&c->combine, &line);
+    line.b += line.len + 1;
+  }
+  vcfstage_flush(&c->combine);
+}
+
+// Get the cluster to where varset_print() generates combinations
+static void cluster_prepare(Cluster *c)
+{
+  size_t i, minstart = SIZE_MAX, maxend = 0;
+  VarSet *vset = &c->vset;
+
+  kernel_trim(c);
+  for(i = 0; i < vset->nvars; i++) {
+    minstart = MIN2(minstart, vset->vars[i].pos);
+    maxend = MAX2(maxend, vset->vars[i].pos + vset->vars[i].reflen);
+  }
+  vars_sort(vset->vars, vset->nvars);
+  varset_remove_duplicates(vset);
+  for(i = 0; i < vset->nvars; i++) vset->vars[i].pos -= minstart;
+  c->minref = c->ref + minstart;
+  c->reflen = maxend - minstart;
+}
+
+static double now_secs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Run func, doubling the iterations until it takes min_secs
+static void bench_kernel(Cluster *c, const char *kernel,
+                         void (*func)(Cluster *c), double min_secs)
+{
+  size_t i, iters = 1;
+  double start, secs;
+  #ifdef __GLIBC__
+    size_t allocs = 0;
+  #endif
+
+  func(c); // first run grows the buffers
+
+  while(1) {
+    #ifdef __GLIBC__
+      allocs = nallocs;
+    #endif
+    start = now_secs();
+    for(i = 0; i < iters; i++) func(c);
+    secs = now_secs() - start;
+    if(secs >= min_secs) break;
+    iters *= 2;
+  }
+
+  printf("%s\t%s\t%zu\t%zu\t%.1f\t", c->name, kernel, c->nlines,
+         c->nhaplotypes, secs * 1e9 / iters);
+  #ifdef __GLIBC__
+    printf("%.2f\n", (double)(nallocs - allocs) / iters);
+  #else
+    printf("-\n");
+  #endif
+}
+
+static void bench_cluster(Cluster *c, double min_secs)
+{
+  cluster_prepare(c);
+  kernel_combos(c);
+  c->nhaplotypes = c->alleles.num;
+
+  bench_kernel(c, "parse", kernel_parse, min_secs);
+  bench_kernel(c, "construct", kernel_construct, min_secs);
+  bench_kernel(c, "trim", kernel_trim, min_secs);
+  cluster_prepare(c); // trim leaves the vars unsorted
+  bench_kernel(c, "merge", kernel_merge, min_secs);
+  bench_kernel(c, "combos", kernel_combos, min_secs);
+  bench_kernel(c, "combine", kernel_combine, min_secs);
+}
+
+int main(int argc, char **argv)
+{
+  double min_secs = 0.5;
+  char *end;
+  size_t i, j;
+
+  int c;
+  while((c = getopt_long(argc, argv, "s:", longopts, NULL)) >= 0) {
+    switch (c) {
+      case 's':
+        min_secs = strtod(optarg, &end);
+        if(*end != '\0' || min_secs <= 0)
+          print_usage(usage, "Invalid --secs value: %s", optarg);
+        break;
+      default: die("Unknown option: %c", c);
+    }
+  }
+
+  void (*fixtures[])(Cluster *c) = {fixture_typical, fixture_snps,
+                                    fixture_indels, fixture_overlaps};
+  size_t nfixtures = sizeof(fixtures) / sizeof(fixtures[0]);
+  Cluster clusters[nfixtures];
+  char run[nfixtures];
+
+  for(i = 0; i < nfixtures; i++) {
+    fixtures[i](&clusters[i]);
+    run[i] = (optind == argc);
+  }
+
+  for(j = optind; j < (size_t)argc; j++) {
+    for(i = 0; i < nfixtures && strcmp(clusters[i].name, argv[j]); i++) {}
+    if(i == nfixtures) print_usage(usage, "Unknown fixture: %s", argv[j]);
+    run[i] = 1;
+  }
+
+  printf("fixture\tkernel\tnvars\thaplotypes\tns_per_op\tallocs_per_op\n");
+  for(i = 0; i < nfixtures; i++) {
+    if(run[i]) bench_cluster(&clusters[i], min_secs);
+    cluster_dealloc(&clusters[i]);
+  }
+
+  return 0;
+}
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define VEC_BYTES 32
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  #define VEC_BYTES 16
+#endif
+
+#include "global.h"
+#include "vcf_record.h"
+
+#ifdef VEC_BYTES
+// Bitmask of tabs in the VEC_BYTES bytes at str
+static inline uint32_t tab_mask(const char *str)
+{
+  #if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i*)str);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+  #else
+    __m128i v = _mm_loadu_si128((const __m128i*)str);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+  #endif
+}
+
+// Bitmasks of tabs and commas in the VEC_BYTES bytes at str, from one load
+static inline void delim_masks(const char *str, uint32_t *tabs,
+                               uint32_t *commas)
+{
+  #if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i*)str);
+    *tabs = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    *commas = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')));
+  #else
+    __m128i v = _mm_loadu_si128((const __m128i*)str);
+    *tabs = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    *commas = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+  #endif
+}
+#endif
+
+size_t vcf_find_tabs(const char *str, size_t len, uint32_t *tabs, size_t max)
+{
+  size_t i = 0, n = 0;
+  const char *ptr;
+
+  if(max == 0) return 0;
+
+  #ifdef VEC_BYTES
+  uint32_t mask;
+  for(; i + VEC_BYTES <= len; i += VEC_BYTES) {
+    for(mask = tab_mask(str+i); mask != 0; mask &= mask-1) {
+      tabs[n++] = i + __builtin_ctz(mask);
+      if(n == max) return n;
+    }
+  }
+  #endif
+
+  // Tail shorter than a vector
+  while((ptr = memchr(str+i, '\t', len-i)) != NULL) {
+    tabs[n++] = ptr - str;
+    if(n == max) return n;
+    i = ptr - str + 1;
+  }
+
+  return n;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Non-zero if any of 8 bytes is not '0'..'9'
+static inline uint64_t swar_nondigits(uint64_t x)
+{
+  return ((x & 0xF0F0F0F0F0F0F0F0UL) ^ 0x3030303030303030UL) |
+         (((x + 0x0606060606060606UL) & 0xF0F0F0F0F0F0F0F0UL) ^ 0x3030303030303030UL);
+}
+
+// 8 ASCII digits, first digit in the lowest byte
+static inline uint64_t swar_parse8(uint64_t x)
+{
+  x -= 0x3030303030303030UL;
+  x = (x * 10) + (x >> 8);
+  return (((x & 0x000000FF000000FFUL) * (100 + (1000000UL << 32))) +
+          (((x >> 16) & 0x000000FF000000FFUL) * (1 + (10000UL << 32)))) >> 32;
+}
+
+long vcf_parse_uint(const char *str, size_t len)
+{
+  char buf[16];
+  uint64_t hi, lo, bad;
+
+  if(len == 0 || len > 16) return -1;
+
+  // Left pad with zeros to 16 digits
+  memset(buf, '0', 16);
+  memcpy(buf + 16 - len, str, len);
+  memcpy(&hi, buf, 8);
+  memcpy(&lo, buf+8, 8);
+
+  bad = swar_nondigits(hi) | swar_nondigits(lo);
+  hi = swar_parse8(hi) * 100000000UL + swar_parse8(lo);
+
+  // All bits set (-1) if bad
+  return (long)(hi | -(uint64_t)(bad != 0));
+}
+#else
+long vcf_parse_uint(const char *str, size_t len)
+{
+  size_t i;
+  long x = 0;
+  if(len == 0 || len > 16) return -1;
+  for(i = 0; i < len; i++) {
+    if(str[i] < '0' || str[i] > '9') return -1;
+    x = x * 10 + (str[i] - '0');
+  }
+  return x;
+}
+#endif
+
+// Find up to nine tabs as vcf_find_tabs() does, and count the commas in ALT
+// (between the fourth and fifth tab) in the same pass over the line
+#ifdef VEC_BYTES
+static size_t vcf_find_cols(const char *str, size_t len, uint32_t *tabs,
+                            size_t *ncommas)
+{
+  size_t i = 0, n = 0, c = 0;
+  uint32_t tmask, cmask, mask, bit;
+
+  for(; i + VEC_BYTES <= len; i += VEC_BYTES) {
+    delim_masks(str+i, &tmask, &cmask);
+    if(n > 4) cmask = 0; // past ALT
+    for(mask = tmask | cmask; mask != 0; mask &= mask-1) {
+      bit = __builtin_ctz(mask);
+      if(tmask & (1U << bit)) {
+        tabs[n++] = i + bit;
+        if(n == 9) goto done;
+      }
+      else c += (n == 4);
+    }
+  }
+
+  // Tail shorter than a vector
+  for(; i < len; i++) {
+    if(str[i] == '\t') {
+      tabs[n++] = i;
+      if(n == 9) break;
+    }
+    else c += (str[i] == ',' && n == 4);
+  }
+
+  done:
+  *ncommas = c;
+  return n;
+}
+#else
+static size_t vcf_find_cols(const char *str, size_t len, uint32_t *tabs,
+                            size_t *ncommas)
+{
+  size_t n = vcf_find_tabs(str, len, tabs, 9);
+  const char *alt, *end;
+
+  *ncommas = 0;
+  if(n < 5) return n;
+  for(alt = str + tabs[3] + 1, end = str + tabs[4]; alt < end; alt++)
+    *ncommas += (*alt == ',');
+  return n;
+}
+#endif
+
+void vcfrecord_parse(VcfRecord *rec, const char *line, size_t len)
+{
+  uint32_t tabs[9];
+  size_t i, ntabs, ncommas;
+  long pos;
+
+  if(len > 0 && line[len-1] == '\n') len--;
+  if(len > UINT32_MAX) die("VCF line too long: %.*s...", 100, line);
+
+  ntabs = vcf_find_cols(line, len, tabs, &ncommas);
+  if(ntabs < 8) die("Invalid VCF line: %.*s", (int)len, line);
+
+  rec->line = line;
+  rec->len = len;
+  rec->cols[0] = 0;
+  for(i = 0; i < ntabs; i++) rec->cols[i+1] = tabs[i]+1;
+  if(ntabs == 8) rec->cols[9] = len+1;
+
+  pos = vcf_parse_uint(line + rec->cols[VPOS], vcfrecord_collen(rec, VPOS));
+  rec->pos = pos > 0 ? pos-1 : -1;
+  rec->nalts = ncommas + 1;
+}
+
+void vcfrecord_copy_sites(VcfRecord *rec, StrBuf *sbuf)
+{
+  size_t len = MIN2(rec->len, rec->cols[9]-1);
+  strbuf_reset(sbuf);
+  strbuf_append_strn(sbuf, rec->line, len);
+  rec->line = sbuf->b;
+  rec->len = len;
+  rec->cols[9] = len+1;
+}
+
+void vcfrecord_format_bcf(const bcf_hdr_t *hdr, const bcf1_t *rec, char sites,
+                          kstring_t *ks)
+{
+  uint32_t tabs[9];
+  ks->l = 0;
+  if(vcf_format(hdr, rec, ks) != 0) die("Cannot format BCF record");
+  if(ks->l > 0 && ks->s[ks->l-1] == '\n') ks->l--;
+  if(sites && vcf_find_tabs(ks->s, ks->l, tabs, 9) == 9) ks->l = tabs[8];
+  ks->s[ks->l] = '\0';
+}
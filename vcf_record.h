@@ -0,0 +1,45 @@
+#ifndef VCF_RECORD_H_
+#define VCF_RECORD_H_
+
+#include <inttypes.h>
+#include "string_buffer.h"
+#include "vcf.h"
+
+// Offsets of the first nine columns of a VCF line and the number of ALT
+// alleles, found in one vectorised pass that compares each block of bytes
+// against tab and comma (AVX2 or SSE2, memchr otherwise). The line is not
+// modified.
+// VCF: CHROM-POS-ID-REF-ALT-QUAL-FILTER-INFO-FORMAT[-SAMPLE0...] '-' is '\t'
+
+typedef struct {
+  const char *line;
+  size_t len; // not including any newline
+  uint32_t cols[10]; // start of each column, cols[9] is start of samples
+                     // or len+1 if there are none
+  long pos; // 0-based, -1 if POS is not a positive integer
+  size_t nalts; // number of comma separated ALT alleles
+} VcfRecord;
+
+#define vcfrecord_col(rec,i) ((rec)->line + (rec)->cols[i])
+#define vcfrecord_collen(rec,i) ((size_t)((rec)->cols[(i)+1] - (rec)->cols[i] - 1))
+
+// Dies if there are fewer than nine columns
+void vcfrecord_parse(VcfRecord *rec, const char *line, size_t len);
+
+// Copy the line up to the end of the FORMAT column (no samples) into sbuf,
+// and point rec at the copy
+void vcfrecord_copy_sites(VcfRecord *rec, StrBuf *sbuf);
+
+// Format a BCF record as a VCF line in ks, without a newline. If sites is set
+// the line ends after FORMAT, as vcfrecord_copy_sites() leaves it.
+void vcfrecord_format_bcf(const bcf_hdr_t *hdr, const bcf1_t *rec, char sites,
+                          kstring_t *ks);
+
+// Store offsets of up to max tabs in str[0..len). Returns number found.
+size_t vcf_find_tabs(const char *str, size_t len, uint32_t *tabs, size_t max);
+
+// Parse 1 to 16 decimal digits, without branching on the digits.
+// Returns -1 if invalid.
+long vcf_parse_uint(const char *str, size_t len);
+
+#endif /* VCF_RECORD_H_ */
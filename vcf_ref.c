@@ -1,131 +1,222 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
-#include <strings.h>
-#include <zlib.h>
 
 #include "global.h"
-#include "seq_file.h"
-#include "string_buffer.h"
-#include "khash.h"
+#include "genome.h"
+#include "line_reader.h"
+#include "line_writer.h"
+#include "line_pipeline.h"
+#include "vcf_stage.h"
 
 static const char usage[] =
-"usage: vcfref [-s] <in.vcf[.gz]> [in.fa ...]\n"
+"usage: vcfref [options] <in.vcf[.gz]|in.bcf> [in.fa ...]\n"
 "  Remove VCF entries that do not match the reference. Biallelic only.\n"
-"  -s swaps alleles if it fixes ref mismatch\n";
+"  -s, --swap            swaps alleles if it fixes ref mismatch\n"
+"  -m, --ref-mem <M>     memory limit for indexed (.fai) references [e.g. 2G]\n"
+"  -o, --out <file>      output file, indexed if BGZF (.gz) or BCF (.bcf)\n"
+"  -O, --output-type <t> v: VCF, z: BGZF VCF, b: BCF [default: from --out]\n"
+"  -c, --csi             write a CSI index (.csi) instead of tabix (.tbi)\n"
+"  -@, --io-threads <N>  threads for BGZF (de)compression [default: 1]\n"
+"  -j, --stats <file>    write counters and timings as JSON, - for stderr\n"
+"  -J, --stats-every <S> also write them every S seconds\n"
+"  -t, --threads <N>     worker threads checking entries [default: 1]\n";
+
+static const struct option longopts[] = {
+  {"swap",       no_argument,       NULL, 's'},
+  {"ref-mem",    required_argument, NULL, 'm'},
+  {"out",        required_argument, NULL, 'o'},
+  {"output-type", required_argument, NULL, 'O'},
+  {"csi",        no_argument,       NULL, 'c'},
+  {"io-threads", required_argument, NULL, '@'},
+  {"threads",    required_argument, NULL, 't'},
+  {"stats",      required_argument, NULL, 'j'},
+  {"stats-every", required_argument, NULL, 'J'},
+  {NULL, 0, NULL, 0}
+};
+
+typedef struct {
+  Genome *genome;
+  char swap_alleles;
+  GenomeCursor *cursors; // one per worker
+  const bcf_hdr_t *hdr; // BCF input
+} RefArgs;
+
+static void filter_batch(size_t worker, LineBatch *batch, void *ptr)
+{
+  RefArgs *args = ptr;
+  LineSpan *line;
+  VcfRecord rec;
+  size_t i, nin = 0, nout = 0;
+
+  for(i = 0; i < batch->nlines; i++) {
+    line = &batch->lines[i];
+    if(line->len > 0 && line->b[0] == '#') {
+      linebatch_emit(batch, line->b, line->len);
+      continue;
+    }
+    nin++;
+    vcfrecord_parse(&rec, line->b, line->len);
+    if(ref_filter_line(line, &rec, &args->cursors[worker], args->genome,
+                       args->swap_alleles))
+    {
+      nout++;
+      linebatch_emit(batch, line->b, line->len);
+    }
+  }
 
-KHASH_MAP_INIT_STR(ghash, read_t*)
+  stats_add(STAT_ENTRIES_IN, nin);
+  stats_add(STAT_ENTRIES_OUT, nout);
+}
 
-int main(int argc, char **argv)
+// batch_func for pipeline_run_bcf()
+static void filter_recs(size_t worker, LineBatch *batch, void *ptr)
 {
-  // compiler complains about unused function without these linese
-  (void)kh_clear_ghash;
-  (void)kh_del_ghash;
+  RefArgs *args = ptr;
+  size_t i;
 
+  for(i = 0; i < batch->nrecs; i++) {
+    if(ref_filter_rec(batch->recs[i], args->hdr, &args->cursors[worker],
+                      args->genome, args->swap_alleles))
+      linebatch_emit_rec(batch, batch->recs[i]);
+  }
+
+  stats_add(STAT_ENTRIES_IN, batch->nrecs);
+  stats_add(STAT_ENTRIES_OUT, batch->nout_recs);
+}
+
+// BCF input is checked as it is read: entries are only unpacked as far as
+// REF and ALT, and are never formatted as text for BCF output
+static void filter_bcf(LineReader *rdr, LineWriter *wtr, Genome *genome,
+                       char swap_alleles)
+{
+  GenomeCursor gc;
+  bcf1_t *rec;
+  size_t nin = 0, nout = 0;
+
+  genomecursor_alloc(&gc);
+  linewriter_bcf_hdr(wtr, rdr->hdr);
+  while((rec = linereader_next_rec(rdr)) != NULL) {
+    nin++;
+    if(ref_filter_rec(rec, rdr->hdr, &gc, genome, swap_alleles)) {
+      nout++;
+      linewriter_write_rec(wtr, rdr->hdr, rec, 0);
+    }
+  }
+  genomecursor_dealloc(&gc, genome);
+
+  stats_add(STAT_ENTRIES_IN, nin);
+  stats_add(STAT_ENTRIES_OUT, nout);
+}
+
+int main(int argc, char **argv)
+{
   if(argc < 2) print_usage(usage, NULL);
 
   char swap_alleles = 0;
+  size_t ref_mem = 0;
+  int io_threads = 1, threads = 1;
+  char *outpath = NULL, csi = 0, outtype = 0;
+  const char *statspath = NULL;
+  double stats_every = 0;
 
   int c;
-  while((c = getopt(argc, argv, "s")) >= 0) {
+  while((c = getopt_long(argc, argv, "sm:o:c@:t:O:j:J:", longopts,
+                         NULL)) >= 0) {
     switch (c) {
       case 's': swap_alleles = 1; break;
+      case 'm':
+        if(!parse_mem_size(optarg, &ref_mem))
+          print_usage(usage, "Invalid --ref-mem value: %s", optarg);
+        break;
+      case 'o': outpath = optarg; break;
+      case 'O':
+        if(strlen(optarg) != 1 || strchr("vzb", optarg[0]) == NULL)
+          print_usage(usage, "Invalid --output-type value: %s", optarg);
+        outtype = optarg[0];
+        break;
+      case 'c': csi = 1; break;
+      case '@':
+        if(!parse_entire_int(optarg, &io_threads) || io_threads < 1)
+          print_usage(usage, "Invalid --io-threads value: %s", optarg);
+        break;
+      case 't':
+        if(!parse_entire_int(optarg, &threads) || threads < 1)
+          print_usage(usage, "Invalid --threads value: %s", optarg);
+        break;
+      case 'j': statspath = optarg; break;
+      case 'J':
+        if(!parse_entire_double(optarg, &stats_every) || stats_every <= 0)
+          print_usage(usage, "Invalid --stats-every value: %s", optarg);
+        break;
       default: die("Unknown option: %c", c);
     }
   }
 
   if(optind == argc) print_usage(usage, "Not enough arguments");
+  if(statspath != NULL) stats_open(statspath, "vcfref", stats_every);
 
   char *inputpath = argv[optind];
   char **refpaths = argv + optind + 1;
   size_t num_refs = argc - optind - 1;
 
-  gzFile gzin = gzopen(inputpath, "r");
-  if(gzin == NULL) die("Cannot read file: %s", inputpath);
+  LineReader reader;
+  linereader_open(&reader, inputpath, io_threads);
 
-  size_t i, nchroms = 0, capacity = 1024;
-  khash_t(ghash) *genome = kh_init(ghash);
-  read_t *reads = malloc(capacity * sizeof(read_t)), *r;
-  int hret;
-  khiter_t k;
+  LineWriter writer;
+  linewriter_open(&writer, outpath, io_threads, csi, outtype);
+
+  size_t i;
+  Genome genome;
+
+  genome_alloc(&genome, ref_mem);
 
   for(i = 0; i < num_refs; i++) {
     fprintf(stderr, "Loading %s\n", refpaths[i]);
-    load_reads(refpaths[i], &reads, &capacity, &nchroms);
+    genome_load(&genome, refpaths[i]);
   }
 
   if(num_refs == 0) {
     fprintf(stderr, "Loading from stdin\n");
-    load_reads("-", &reads, &capacity, &nchroms);
+    genome_load(&genome, "-");
   }
 
-  if(nchroms == 0) die("No chromosomes loaded");
+  if(genome.nchroms == 0) die("No chromosomes loaded");
 
-  for(i = 0; i < nchroms; i++) {
-    r = reads + i;
-    fprintf(stderr, "Loaded: '%s'\n", r->name.b);
-    k = kh_put(ghash, genome, r->name.b, &hret);
-    if(hret == 0) warn("Duplicate read name (taking first): %s", r->name.b);
-    else kh_value(genome, k) = r;
-  }
+  // BCF output needs every contig in its header
+  for(i = 0; i < genome.nchroms; i++)
+    linewriter_contig(&writer, genome.chroms[i]->name);
 
   // Now read VCF
-  StrBuf line;
-  strbuf_alloc(&line, 1024);
-  char *fields[9];
-  char *chr;
-  int pos, reflen, altlen;
-
-  while(strbuf_reset_gzreadline(&line, gzin) > 0)
-  {
-    if(line.b[0] == '#') fputs(line.b, stdout);
-    else
-    {
-      strbuf_chomp(&line);
-      vcf_columns(line.b, fields);
-      fields[1][-1] = fields[2][-1] = '\0';
-      chr = line.b;
-      pos = atoi(fields[1])-1;
-      k = kh_get(ghash, genome, chr);
-      r = kh_value(genome, k);
-      fields[1][-1] = fields[2][-1] = '\t';
-      reflen = fields[4] - fields[3] - 1;
-      altlen = fields[5] - fields[4] - 1;
-      if(k == kh_end(genome)) warn("Cannot find chrom: %s", chr);
-      else if(pos < 0) warn("Bad line: %s\n", line.b);
-      else if((reflen == 1 && altlen == 1) || fields[3][0] == fields[4][0])
-      {
-        if((unsigned)pos + reflen <= r->seq.end &&
-           strncasecmp(r->seq.b+pos,fields[3],reflen) == 0)
-        {
-          fputs(line.b, stdout);
-          fputc('\n', stdout);
-        }
-        else if(swap_alleles && (unsigned)pos + altlen <= r->seq.end &&
-                strncasecmp(r->seq.b+pos,fields[4],altlen) == 0)
-        {
-          // swap alleles
-          char tmp[altlen], *ref = fields[3], *alt = fields[4];
-          memcpy(tmp, alt, altlen);
-          memmove(ref+altlen+1, ref, reflen);
-          memcpy(ref, tmp, altlen);
-          ref[altlen] = '\t';
-          fputs(line.b, stdout);
-          fputc('\n', stdout);
-        }
-        // else printf("FAIL0\n");
-      }
-      // else printf("FAIL1\n");
+  if(reader.hts != NULL && threads == 1)
+    filter_bcf(&reader, &writer, &genome, swap_alleles);
+  else if(threads == 1) {
+    VcfStage stage;
+    refstage_alloc(&stage, &genome, swap_alleles);
+    stage.wtr = &writer;
+    vcfstage_run(&stage, &reader);
+    vcfstage_dealloc(&stage);
+  }
+  else {
+    GenomeCursor cursors[threads];
+    for(i = 0; i < (size_t)threads; i++) genomecursor_alloc(&cursors[i]);
+    RefArgs args = {.genome = &genome, .swap_alleles = swap_alleles,
+                    .cursors = cursors, .hdr = reader.hdr};
+    if(reader.hts != NULL) {
+      linewriter_bcf_hdr(&writer, reader.hdr);
+      pipeline_run_bcf(&reader, &writer, threads, filter_recs, &args);
     }
+    else pipeline_run(&reader, &writer, threads, filter_batch, NULL, &args);
+    for(i = 0; i < (size_t)threads; i++)
+      genomecursor_dealloc(&cursors[i], &genome);
   }
 
-  kh_destroy(ghash, genome);
-  strbuf_dealloc(&line);
-  gzclose(gzin);
-
-  for(i = 0; i < nchroms; i++) seq_read_dealloc(reads+i);
-  free(reads);
+  genome_dealloc(&genome);
+  linereader_close(&reader);
+  linewriter_close(&writer);
+  stats_close();
 
   fprintf(stderr, " Done.\n");
 
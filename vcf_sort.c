@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include "global.h"
+#include "vcf_sort.h"
+#include "vcf_record.h"
+
+void vcfsorter_alloc(VcfSorter *vs, size_t max_mem, const char *tmpdir)
+{
+  struct rlimit rl;
+
+  if(tmpdir == NULL && (tmpdir = getenv("TMPDIR")) == NULL) tmpdir = "/tmp";
+  contigids_alloc(&vs->contigs);
+  vs->max_mem = max_mem;
+  vs->tmpdir = tmpdir;
+  strbuf_alloc(&vs->lines, 1UL<<20);
+  vs->nrecs = vs->next = vs->nruns = vs->nheap = 0;
+  vs->cap_recs = 1024;
+  vs->max_runs = SORT_MAX_RUNS;
+  if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur / 4 < vs->max_runs)
+    vs->max_runs = MAX2(rl.rlim_cur / 4, 2);
+  vs->recs = malloc(vs->cap_recs * sizeof(SortRec));
+  vs->tmp = malloc(vs->cap_recs * sizeof(SortRec));
+  vs->runs = malloc(vs->max_runs * sizeof(SortRun));
+  vs->heap = malloc(vs->max_runs * sizeof(size_t));
+  if(vs->recs == NULL || vs->tmp == NULL || vs->runs == NULL ||
+     vs->heap == NULL) die("Out of memory");
+  vs->last = SIZE_MAX;
+}
+
+void vcfsorter_dealloc(VcfSorter *vs)
+{
+  size_t i;
+  for(i = 0; i < vs->nruns; i++) {
+    if(vs->runs[i].bgzf != NULL) bgzf_close(vs->runs[i].bgzf);
+    else close(vs->runs[i].fd);
+    strbuf_dealloc(&vs->runs[i].line);
+  }
+  contigids_dealloc(&vs->contigs);
+  strbuf_dealloc(&vs->lines);
+  free(vs->recs);
+  free(vs->tmp);
+  free(vs->runs);
+  free(vs->heap);
+}
+
+void vcfsorter_contig(VcfSorter *vs, const char *name)
+{
+  contigids_get(&vs->contigs, name, strlen(name));
+}
+
+// LSD radix sort on key, a byte at a time. Stable, so entries at the same
+// position keep their order. Passes where every key has the same byte are
+// skipped: on one contig with positions under 16M that is all but three.
+static void sortrecs_radix(SortRec *recs, SortRec *tmp, size_t n)
+{
+  size_t counts[8][256], i, b, c, sum, cnt;
+  SortRec *src = recs, *dst = tmp, *swp;
+
+  if(n < 2) return;
+  memset(counts, 0, sizeof(counts));
+  for(i = 0; i < n; i++)
+    for(b = 0; b < 8; b++) counts[b][(recs[i].key >> (8*b)) & 0xff]++;
+
+  for(b = 0; b < 8; b++) {
+    if(counts[b][(recs[0].key >> (8*b)) & 0xff] == n) continue;
+    for(c = sum = 0; c < 256; c++) {
+      cnt = counts[b][c];
+      counts[b][c] = sum;
+      sum += cnt;
+    }
+    for(i = 0; i < n; i++)
+      dst[counts[b][(src[i].key >> (8*b)) & 0xff]++] = src[i];
+    SWAP(src, dst, swp);
+  }
+
+  if(src != recs) memcpy(recs, src, n * sizeof(SortRec));
+}
+
+// Start a run in a new temporary file, returns it open for writing
+static BGZF* sortrun_create(VcfSorter *vs, SortRun *run)
+{
+  char path[PATH_MAX];
+  BGZF *bgzf;
+  int fd;
+
+  // Unlink straight away so the file goes when we exit, however we exit
+  snprintf(path, sizeof(path), "%s/vcfhack_sort.XXXXXX", vs->tmpdir);
+  if((fd = mkstemp(path)) == -1)
+    die("Cannot create temporary file in: %s", vs->tmpdir);
+  run->bgzf = NULL;
+  if((run->fd = open(path, O_RDONLY)) == -1)
+    die("Cannot open temporary file: %s", path);
+  unlink(path);
+  strbuf_alloc(&run->line, 1024);
+
+  if((bgzf = bgzf_dopen(fd, "w1")) == NULL)
+    die("Cannot write temporary file: %s", path);
+  return bgzf;
+}
+
+// Each entry is its key, its length as a uint32_t and the line, without a
+// newline
+static void sortrun_write(BGZF *bgzf, uint64_t key, const char *line,
+                          uint32_t len)
+{
+  if(bgzf_write(bgzf, &key, sizeof(key)) != sizeof(key) ||
+     bgzf_write(bgzf, &len, sizeof(len)) != sizeof(len) ||
+     bgzf_write(bgzf, line, len) != (ssize_t)len)
+    die("Cannot write temporary file, out of space?");
+}
+
+static void sortrun_finish(BGZF *bgzf)
+{
+  if(bgzf_close(bgzf) != 0)
+    die("Cannot write temporary file, out of space?");
+}
+
+static void vcfsorter_merge(VcfSorter *vs);
+
+// Sort the entries held and write them to a new run
+static void vcfsorter_spill(VcfSorter *vs)
+{
+  const SortRec *r;
+  BGZF *bgzf;
+  size_t i;
+  uint64_t start = stats_start();
+
+  sortrecs_radix(vs->recs, vs->tmp, vs->nrecs);
+
+  // Merging opens one more file, for the merged run
+  if(vs->nruns + 1 == vs->max_runs) vcfsorter_merge(vs);
+
+  bgzf = sortrun_create(vs, &vs->runs[vs->nruns++]);
+  for(i = 0; i < vs->nrecs; i++) {
+    r = &vs->recs[i];
+    sortrun_write(bgzf, r->key, vs->lines.b + r->offset, r->len);
+  }
+  sortrun_finish(bgzf);
+
+  vs->nrecs = 0;
+  strbuf_reset(&vs->lines);
+  stats_add(STAT_SORT_RUNS, 1);
+  stats_stop(PHASE_SORT, start);
+}
+
+void vcfsorter_add(VcfSorter *vs, const char *line, size_t len)
+{
+  uint32_t tabs[2];
+  long pos;
+  int id;
+  SortRec *r;
+
+  if(vcf_find_tabs(line, len, tabs, 2) < 2 ||
+     (pos = vcf_parse_uint(line + tabs[0] + 1, tabs[1] - tabs[0] - 1)) <= 0)
+    die("Bad line: %.*s", (int)len, line);
+  if(pos > UINT32_MAX || len > UINT32_MAX)
+    die("Entry too large to sort: %.*s", (int)MIN2(len, 200), line);
+
+  // Lines plus both record arrays
+  if(vs->nrecs > 0 &&
+     vs->lines.end + len + 2 * vs->nrecs * sizeof(SortRec) >= vs->max_mem)
+    vcfsorter_spill(vs);
+
+  if(vs->nrecs == vs->cap_recs) {
+    vs->cap_recs *= 2;
+    vs->recs = realloc(vs->recs, vs->cap_recs * sizeof(SortRec));
+    vs->tmp = realloc(vs->tmp, vs->cap_recs * sizeof(SortRec));
+    if(vs->recs == NULL || vs->tmp == NULL) die("Out of memory");
+  }
+
+  id = contigids_get(&vs->contigs, line, tabs[0]);
+  r = &vs->recs[vs->nrecs++];
+  r->key = ((uint64_t)id << 32) | (uint64_t)(pos - 1);
+  r->offset = vs->lines.end;
+  r->len = len;
+  strbuf_append_strn(&vs->lines, line, len);
+  strbuf_append_char(&vs->lines, '\n');
+}
+
+// Read the next entry of a run, returns 0 at the end
+static char sortrun_read(SortRun *run)
+{
+  uint32_t len;
+  ssize_t n;
+
+  if((n = bgzf_read(run->bgzf, &run->key, sizeof(run->key))) == 0) return 0;
+  if(n != sizeof(run->key) ||
+     bgzf_read(run->bgzf, &len, sizeof(len)) != sizeof(len))
+    die("Cannot read temporary file");
+
+  strbuf_ensure_capacity(&run->line, len+1);
+  if(bgzf_read(run->bgzf, run->line.b, len) != (ssize_t)len)
+    die("Cannot read temporary file");
+  run->line.b[len] = '\0';
+  run->line.end = len;
+  return 1;
+}
+
+// Ties go to the earlier run, which holds the earlier entries
+#define sortheap_less(vs,a,b) ((vs)->runs[a].key < (vs)->runs[b].key || \
+                               ((vs)->runs[a].key == (vs)->runs[b].key && \
+                                (a) < (b)))
+
+static void sortheap_down(VcfSorter *vs, size_t i)
+{
+  size_t child, tmp, *heap = vs->heap;
+  for(; (child = 2*i+1) < vs->nheap; i = child) {
+    if(child+1 < vs->nheap && sortheap_less(vs, heap[child+1], heap[child]))
+      child++;
+    if(!sortheap_less(vs, heap[child], heap[i])) break;
+    SWAP(heap[i], heap[child], tmp);
+  }
+}
+
+// Open every run for reading and heap them on their first entries
+static void vcfsorter_open_runs(VcfSorter *vs)
+{
+  size_t i;
+  SortRun *run;
+
+  fprintf(stderr, "Merging %zu sorted runs\n", vs->nruns);
+
+  vs->nheap = 0;
+  vs->last = SIZE_MAX;
+  for(i = 0; i < vs->nruns; i++) {
+    run = &vs->runs[i];
+    if((run->bgzf = bgzf_dopen(run->fd, "r")) == NULL)
+      die("Cannot read temporary file");
+    if(sortrun_read(run)) vs->heap[vs->nheap++] = i;
+  }
+
+  for(i = vs->nheap/2; i-- > 0; ) sortheap_down(vs, i);
+}
+
+// Returns the run holding the next entry, SIZE_MAX when all are done
+static size_t vcfsorter_pop(VcfSorter *vs)
+{
+  // The run handed out last is still at the top of the heap
+  if(vs->last != SIZE_MAX) {
+    if(!sortrun_read(&vs->runs[vs->last]))
+      vs->heap[0] = vs->heap[--vs->nheap];
+    sortheap_down(vs, 0);
+  }
+
+  vs->last = vs->nheap == 0 ? SIZE_MAX : vs->heap[0];
+  return vs->last;
+}
+
+// Merge all runs into one, which holds the earliest entries so goes first
+static void vcfsorter_merge(VcfSorter *vs)
+{
+  SortRun merged;
+  const SortRun *run;
+  BGZF *bgzf;
+  size_t i;
+
+  vcfsorter_open_runs(vs);
+  bgzf = sortrun_create(vs, &merged);
+  while((i = vcfsorter_pop(vs)) != SIZE_MAX) {
+    run = &vs->runs[i];
+    sortrun_write(bgzf, run->key, run->line.b, run->line.end);
+  }
+  sortrun_finish(bgzf);
+
+  for(i = 0; i < vs->nruns; i++) {
+    bgzf_close(vs->runs[i].bgzf);
+    strbuf_dealloc(&vs->runs[i].line);
+  }
+  vs->runs[0] = merged;
+  vs->nruns = 1;
+}
+
+void vcfsorter_finish(VcfSorter *vs)
+{
+  uint64_t start;
+
+  if(vs->nruns == 0) {
+    // Everything fits in memory
+    start = stats_start();
+    sortrecs_radix(vs->recs, vs->tmp, vs->nrecs);
+    stats_stop(PHASE_SORT, start);
+    vs->next = 0;
+    return;
+  }
+
+  if(vs->nrecs > 0) vcfsorter_spill(vs);
+  vcfsorter_open_runs(vs);
+}
+
+char vcfsorter_next(VcfSorter *vs, LineSpan *line)
+{
+  const SortRec *r;
+  SortRun *run;
+  size_t i;
+
+  if(vs->nruns == 0) {
+    if(vs->next == vs->nrecs) return 0;
+    r = &vs->recs[vs->next++];
+    line->b = vs->lines.b + r->offset;
+    line->len = r->len;
+    return 1;
+  }
+
+  if((i = vcfsorter_pop(vs)) == SIZE_MAX) return 0;
+  run = &vs->runs[i];
+  line->b = run->line.b;
+  line->len = run->line.end;
+  return 1;
+}
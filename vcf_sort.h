@@ -0,0 +1,66 @@
+#ifndef VCF_SORT_H_
+#define VCF_SORT_H_
+
+#include <stdint.h>
+#include "bgzf.h"
+#include "string_buffer.h"
+#include "line_reader.h"
+#include "contig_ids.h"
+
+// Most runs open at once, lowered to a quarter of the open file limit
+#define SORT_MAX_RUNS 256
+
+// External sort of VCF entries by contig then position, in bounded memory.
+// Entries are held until they fill max_mem, then radix sorted on
+// (contig id, pos) and spilled as a BGZF run to a temporary file. At the end
+// the runs are merged with a heap. If everything fits in memory nothing is
+// written. Entries at the same position keep their input order.
+// Each run holds a file descriptor, so once there are max_runs of them they
+// are merged into one run before the next is spilled.
+//
+// Contigs are ordered by vcfsorter_contig() calls, then by first sight.
+
+typedef struct {
+  uint64_t key; // contig id << 32 | pos
+  uint64_t offset; // of the line in lines
+  uint32_t len;
+} SortRec;
+
+typedef struct {
+  int fd; // unlinked temporary file
+  BGZF *bgzf; // reading, once merging
+  uint64_t key;
+  StrBuf line; // next entry of the run
+} SortRun;
+
+typedef struct {
+  ContigIds contigs;
+  size_t max_mem;
+  const char *tmpdir;
+  StrBuf lines; // entries of the run being filled, each ending '\n'
+  SortRec *recs, *tmp;
+  size_t nrecs, cap_recs, next;
+  SortRun *runs;
+  size_t nruns, max_runs;
+  size_t *heap; // run indices, smallest key first
+  size_t nheap, last; // last is the run handed out by vcfsorter_next()
+} VcfSorter;
+
+// tmpdir NULL for $TMPDIR or /tmp
+void vcfsorter_alloc(VcfSorter *vs, size_t max_mem, const char *tmpdir);
+void vcfsorter_dealloc(VcfSorter *vs);
+
+// Put contig name after those already given, call before adding entries
+void vcfsorter_contig(VcfSorter *vs, const char *name);
+
+// Add an entry, without a newline. Dies if it has no valid POS.
+void vcfsorter_add(VcfSorter *vs, const char *line, size_t len);
+
+// Call once all entries are added
+void vcfsorter_finish(VcfSorter *vs);
+
+// Get entries in order. The line may be modified and is only valid until the
+// next call. Returns 0 when done.
+char vcfsorter_next(VcfSorter *vs, LineSpan *line);
+
+#endif /* VCF_SORT_H_ */
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "global.h"
+#include "vcf_record.h"
+#include "vcf_stage.h"
+#include "genotypes.h"
+
+char vcfstage_parse(VcfStage *stage, const char *spec, Genome *genome,
+                    char genotypes)
+{
+  const char *arg = strchr(spec, ':');
+  size_t len = arg == NULL ? strlen(spec) : (size_t)(arg - spec);
+  size_t max_haplotypes = COMBO_MAX_HAPLOTYPES;
+  char argbuf[32], *max;
+  int overlap;
+
+  if(arg != NULL) {
+    if(strlen(++arg) >= sizeof(argbuf)) return 0;
+    strcpy(argbuf, arg);
+  }
+
+  if(len == 3 && strncmp(spec, "ref", 3) == 0) {
+    if(arg != NULL && strcmp(arg, "swap") != 0) return 0;
+    refstage_alloc(stage, genome, arg != NULL);
+  }
+  else if(len == 7 && strncmp(spec, "combine", 7) == 0) {
+    if(arg == NULL || !parse_entire_int(argbuf, &overlap) || overlap < 0)
+      return 0;
+    combinestage_alloc(stage, genome, overlap, genotypes);
+  }
+  else if(len == 5 && strncmp(spec, "combo", 5) == 0) {
+    if(arg == NULL) return 0;
+    if((max = strchr(argbuf, ':')) != NULL) {
+      *max++ = '\0';
+      if(!parse_entire_size(max, &max_haplotypes)) return 0;
+    }
+    if(!parse_entire_int(argbuf, &overlap) || overlap < 0) return 0;
+    combostage_alloc(stage, genome, overlap, max_haplotypes, genotypes);
+  }
+  else return 0;
+
+  return 1;
+}
+
+void vcfstage_dealloc(VcfStage *stage)
+{
+  free(stage->ks.s);
+  stage->dealloc(stage);
+}
+
+void vcfstage_push(VcfStage *stage, LineSpan *line)
+{
+  if(line->len > 0 && line->b[0] == '#') {
+    if(line->len >= 6 && strncmp(line->b, "#CHROM", 6) == 0)
+      stage->nsamples = vcf_header_samples(line->b, line->len);
+    if(stage->header != NULL) stage->header(stage, line);
+    else vcfstage_emit(stage, line->b, line->len);
+  }
+  else if(line->len > 0) {
+    VcfRecord rec;
+    vcfrecord_parse(&rec, line->b, line->len);
+    vcfstage_push_rec(stage, line, &rec);
+  }
+}
+
+void vcfstage_push_rec(VcfStage *stage, LineSpan *line, VcfRecord *rec)
+{
+  stage->nentries++;
+  stage->entry(stage, line, rec);
+}
+
+void vcfstage_push_bcf(VcfStage *stage, bcf1_t *rec, char sites)
+{
+  LineSpan line;
+  VcfRecord vrec;
+
+  if(stage->entry_bcf != NULL) {
+    stage->nentries++;
+    stage->entry_bcf(stage, rec, sites);
+    return;
+  }
+
+  vcfrecord_format_bcf(stage->hdr, rec, sites, &stage->ks);
+  line = (LineSpan){.b = stage->ks.s, .len = stage->ks.l};
+  vcfrecord_parse(&vrec, line.b, line.len);
+  vcfstage_push_rec(stage, &line, &vrec);
+}
+
+void vcfstage_emit(VcfStage *stage, char *line, size_t len)
+{
+  if(stage->next == NULL) {
+    stage->nemitted += (len > 0 && line[0] != '#');
+    if(stage->batch != NULL) linebatch_print(stage->batch, line, len);
+    else if(stage->samples != NULL && stage->pass_samples)
+      linewriter_write_entry(stage->wtr, line, len, stage->samples);
+    else linewriter_write(stage->wtr, line, len);
+  }
+  else {
+    LineSpan span = {.b = line, .len = len};
+    vcfstage_push(stage->next, &span);
+  }
+}
+
+void vcfstage_emit_rec(VcfStage *stage, LineSpan *line, VcfRecord *rec)
+{
+  if(stage->next == NULL) vcfstage_emit(stage, line->b, line->len);
+  else vcfstage_push_rec(stage->next, line, rec);
+}
+
+void vcfstage_emit_bcf(VcfStage *stage, bcf1_t *rec, char sites)
+{
+  if(stage->next != NULL) vcfstage_push_bcf(stage->next, rec, sites);
+  else if(stage->batch != NULL) {
+    vcfrecord_format_bcf(stage->hdr, rec, sites, &stage->ks);
+    vcfstage_emit(stage, stage->ks.s, stage->ks.l);
+  }
+  else {
+    stage->nemitted++;
+    linewriter_write_rec(stage->wtr, stage->hdr, rec, sites);
+  }
+}
+
+void vcfstage_flush(VcfStage *stage)
+{
+  for(; stage != NULL; stage = stage->next)
+    if(stage->flush != NULL) stage->flush(stage);
+}
+
+VcfStage* vcfstage_last(VcfStage *stage)
+{
+  while(stage->next != NULL) stage = stage->next;
+  return stage;
+}
+
+void vcfstage_copy_header(VcfStage *dst, const VcfStage *src)
+{
+  for(; dst != NULL && src != NULL; dst = dst->next, src = src->next)
+    dst->nsamples = src->nsamples;
+}
+
+void vcfstage_sites_header(VcfStage *stage, LineSpan *line)
+{
+  VcfRecord rec;
+  if(line->len >= 6 && strncmp(line->b, "#CHROM", 6) == 0) {
+    vcfrecord_parse(&rec, line->b, line->len);
+    vcfstage_emit(stage, line->b, MIN2(rec.len, rec.cols[9]-1));
+  }
+  else vcfstage_emit(stage, line->b, line->len);
+}
+
+void vcfstage_header(VcfStage *stage, LineReader *rdr)
+{
+  LineSpan line = {.b = NULL, .len = 0};
+
+  while(linereader_next(rdr, &line)) {
+    if(line.len >= 2 && strncmp(line.b, "##", 2) == 0)
+      vcfstage_push(stage, &line);
+    else if(line.len > 0) break;
+  }
+
+  if(line.len < 6 || strncmp(line.b,"#CHROM",6) != 0)
+    die("Expected header: '%.*s'", (int)line.len, line.b);
+
+  vcfstage_push(stage, &line);
+}
+
+// Entries between stats updates in vcfstage_run(), so periodic stats move
+#define STATS_BATCH 65536
+
+// Add the entries a chain took in and passed on since the counts were nin
+// and nout to the stats, then update nin and nout
+static void vcfstage_stats(VcfStage *stage, size_t *nin, size_t *nout)
+{
+  size_t emitted = vcfstage_last(stage)->nemitted;
+  stats_add(STAT_ENTRIES_IN, stage->nentries - *nin);
+  stats_add(STAT_ENTRIES_OUT, emitted - *nout);
+  *nin = stage->nentries;
+  *nout = emitted;
+}
+
+// vcfstage_run() on BCF input, which is never formatted as text by the
+// reader. The header has already been passed through as text.
+static void vcfstage_run_bcf(VcfStage *stage, LineReader *rdr)
+{
+  VcfStage *s;
+  bcf1_t *rec;
+  size_t nin = stage->nentries, nout = vcfstage_last(stage)->nemitted;
+
+  for(s = stage; s != NULL; s = s->next) s->hdr = rdr->hdr;
+
+  while((rec = linereader_next_rec(rdr)) != NULL) {
+    vcfstage_push_bcf(stage, rec, 0);
+    if(stage->nentries - nin >= STATS_BATCH) vcfstage_stats(stage, &nin, &nout);
+  }
+  vcfstage_flush(stage);
+  vcfstage_stats(stage, &nin, &nout);
+}
+
+void vcfstage_run(VcfStage *stage, LineReader *rdr)
+{
+  VcfStage *s;
+  LineSpan line;
+  size_t nin = stage->nentries, nout = vcfstage_last(stage)->nemitted;
+
+  if(rdr->hts != NULL) {
+    vcfstage_run_bcf(stage, rdr);
+    return;
+  }
+
+  // Later stages get entries built by an earlier one, not the one in rdr
+  for(s = stage; s != NULL; s = s->next) {
+    s->samples = rdr;
+    if(!s->pass_samples) break;
+  }
+  linereader_sites_only(rdr);
+
+  while(linereader_next(rdr, &line)) {
+    vcfstage_push(stage, &line);
+    if(stage->nentries - nin >= STATS_BATCH) vcfstage_stats(stage, &nin, &nout);
+  }
+  vcfstage_flush(stage);
+  for(s = stage; s != NULL; s = s->next) s->samples = NULL;
+  vcfstage_stats(stage, &nin, &nout);
+}
+
+void vcfstage_run_sorted(VcfStage *stage, LineReader *rdr, VcfSorter *vs)
+{
+  LineSpan line;
+  size_t nin = stage->nentries, nout = vcfstage_last(stage)->nemitted;
+
+  // Header lines out of place are dropped, they would be out of order anyway
+  while(linereader_next(rdr, &line))
+    if(line.len > 0 && line.b[0] != '#') vcfsorter_add(vs, line.b, line.len);
+  vcfsorter_finish(vs);
+
+  while(vcfsorter_next(vs, &line)) {
+    vcfstage_push(stage, &line);
+    if(stage->nentries - nin >= STATS_BATCH) vcfstage_stats(stage, &nin, &nout);
+  }
+  vcfstage_flush(stage);
+  vcfstage_stats(stage, &nin, &nout);
+}
+
+void vcfstage_run_contig(size_t worker, const char *contig,
+                         LineReader *rdr, LineWriter *wtr, void *arg)
+{
+  VcfStage *stage = ((VcfStage**)arg)[worker];
+  (void)contig;
+  vcfstage_last(stage)->wtr = wtr;
+  vcfstage_run(stage, rdr);
+}
+
+void vcfstage_run_batch(size_t worker, LineBatch *batch, void *arg)
+{
+  VcfStage *stage = ((VcfStage**)arg)[worker];
+  size_t i, nin = stage->nentries, nout = vcfstage_last(stage)->nemitted;
+  vcfstage_last(stage)->batch = batch;
+  for(i = 0; i < batch->nlines; i++) vcfstage_push(stage, &batch->lines[i]);
+  vcfstage_flush(stage);
+  vcfstage_last(stage)->batch = NULL;
+  vcfstage_stats(stage, &nin, &nout);
+}
+
+size_t vcfstage_cut(const char *block, size_t len, size_t *scanned,
+                    void *arg)
+{
+  const VcfStage *stage = ((VcfStage**)arg)[0];
+  return stage->cut(stage, block, len, scanned);
+}
@@ -0,0 +1,178 @@
+#ifndef VCF_STAGE_H_
+#define VCF_STAGE_H_
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "genome.h"
+#include "line_reader.h"
+#include "line_writer.h"
+#include "line_pipeline.h"
+#include "vcf_record.h"
+#include "vcf_sort.h"
+
+// A stage takes VCF lines one at a time and passes the lines it keeps or
+// builds on to the next stage, or to a LineWriter if it is the last. vcfref,
+// vcfcombine and vcfcombo are each one stage; `vcfhack run` chains several,
+// so the reference is loaded once and entries go from one step to the next
+// in memory rather than through a file. An entry is split into columns once
+// for the whole chain: a stage that passes an entry on as it is, or edits it
+// in place, passes its VcfRecord along with it. Entries of BCF input go down
+// the chain as bcf1_t records, to stages that take them, and are only
+// formatted as text for a stage that does not.
+
+typedef struct VcfStage VcfStage;
+
+struct VcfStage {
+  // Called with each entry and its columns. The line may be modified if rec
+  // is kept up to date. Both are only valid for the duration of the call.
+  void (*entry)(VcfStage *stage, LineSpan *line, VcfRecord *rec);
+  // Called with each entry of BCF input, NULL to format them as text for
+  // entry(). If sites is set only the columns up to FORMAT are wanted. The
+  // record may be modified, and only stays valid for the duration of the call.
+  void (*entry_bcf)(VcfStage *stage, bcf1_t *rec, char sites);
+  // Called with each header line, NULL to pass them on unchanged
+  void (*header)(VcfStage *stage, LineSpan *line);
+  // End of input or of a contig, pass on anything held back
+  void (*flush)(VcfStage *stage);
+  void (*dealloc)(VcfStage *stage);
+  // Optional batch_cut for pipeline_run(). Only reads settings, it is called
+  // while other threads use the stage.
+  size_t (*cut)(const VcfStage *stage, const char *block, size_t len,
+                size_t *scanned);
+  void *state;
+  VcfStage *next; // NULL if last
+  LineWriter *wtr; // output of the last stage
+  LineBatch *batch; // if set, output of the last stage goes here instead
+  // If set, the sample columns of the entry being pushed are still in this
+  // reader, see linereader_samples(). Unread samples are skipped.
+  LineReader *samples;
+  bcf_hdr_t *hdr; // header of BCF input, NULL otherwise
+  kstring_t ks; // entry_bcf records formatted for entry()
+  // Set if the stage emits each entry it keeps from its entry() call,
+  // unchanged apart from the sites columns. Samples can then go straight
+  // from the reader to the output.
+  char pass_samples;
+  size_t nsamples; // sample columns on the #CHROM line passed in
+  size_t nentries; // entries passed in
+  size_t nemitted; // entries passed on, only counted by the last stage
+};
+
+// Remove entries that do not match the reference, swap alleles if that fixes
+// the mismatch and swap_alleles is set
+void refstage_alloc(VcfStage *stage, Genome *genome, char swap_alleles);
+
+// Merge entries within overlap bases of each other into one. Sample columns
+// are dropped, unless genotypes is set: then GT is kept, with alleles
+// renumbered for merged entries.
+void combinestage_alloc(VcfStage *stage, Genome *genome, int overlap,
+                        char genotypes);
+
+// Merge entries within overlap bases into one with every compatible
+// combination of their alleles. Clusters with more than max_haplotypes
+// combinations are passed through unchanged, 0 for no limit, as are clusters
+// of more than COMBO_MAX_VARS entries. genotypes as for combinestage_alloc().
+void combostage_alloc(VcfStage *stage, Genome *genome, int overlap,
+                      size_t max_haplotypes, char genotypes);
+
+#define COMBO_MAX_HAPLOTYPES 100000
+#define COMBO_MAX_VARS 4096
+
+// Cost of each cluster combo stages merge, one tab separated line per
+// cluster: chrom start end nvars subsets genotypes alleles ns combined.
+// subsets is the number of sets of vars tried, genotypes the haplotypes
+// built from them and alleles the distinct haplotypes. Shared by threads,
+// lines are in no particular order.
+typedef struct {
+  FILE *fh;
+  pthread_mutex_t lock;
+} ComboTrace;
+
+// path may be - for stderr
+void combotrace_open(ComboTrace *trace, const char *path);
+// Call after the stages writing to trace are deallocated
+void combotrace_close(ComboTrace *trace);
+
+// Write a line per cluster of each combo stage in stage's chain to trace
+void combostage_trace(VcfStage *stage, ComboTrace *trace);
+
+// Parse "ref", "ref:swap", "combine:<k>", "combo:<k>" or "combo:<k>:<max>"
+// where max is the haplotype limit. genotypes is passed to combine and combo
+// stages. Returns 0 if invalid.
+char vcfstage_parse(VcfStage *stage, const char *spec, Genome *genome,
+                    char genotypes);
+
+void vcfstage_dealloc(VcfStage *stage);
+
+// Pass a line into stage, entries are split into columns here
+void vcfstage_push(VcfStage *stage, LineSpan *line);
+
+// Pass an entry into stage, rec holds the columns of line
+void vcfstage_push_rec(VcfStage *stage, LineSpan *line, VcfRecord *rec);
+
+// Pass a BCF record into stage, see entry_bcf
+void vcfstage_push_bcf(VcfStage *stage, bcf1_t *rec, char sites);
+
+// Called by a stage to pass a line on. line[len] must be readable.
+void vcfstage_emit(VcfStage *stage, char *line, size_t len);
+
+// As vcfstage_emit() for an entry whose columns are in rec, so the next stage
+// does not split it again
+void vcfstage_emit_rec(VcfStage *stage, LineSpan *line, VcfRecord *rec);
+
+// As vcfstage_emit() for a BCF record. The last stage writes it with
+// linewriter_write_rec().
+void vcfstage_emit_bcf(VcfStage *stage, bcf1_t *rec, char sites);
+
+// Flush stage then each stage after it
+void vcfstage_flush(VcfStage *stage);
+
+VcfStage* vcfstage_last(VcfStage *stage);
+
+// Copy what src's chain learnt from the header to dst's chain, for chains
+// on other threads that did not see it
+void vcfstage_copy_header(VcfStage *dst, const VcfStage *src);
+
+// header callback for stages that drop sample columns from the #CHROM line
+void vcfstage_sites_header(VcfStage *stage, LineSpan *line);
+
+// Pass ## lines and the #CHROM line through the stages. Dies if there is no
+// #CHROM line before the first entry.
+void vcfstage_header(VcfStage *stage, LineReader *rdr);
+
+// Pass the remaining lines through the stages and flush. Entries are read
+// without their samples, which stay in the reader: stages up to the first
+// that does not pass samples on can read them, if every stage passes them on
+// they go straight from the reader to the writer, and otherwise they are
+// skipped. Entries of BCF input are read as records, see entry_bcf.
+void vcfstage_run(VcfStage *stage, LineReader *rdr);
+
+// As vcfstage_run() for unsorted input: the remaining entries are put in
+// order by vs first. Entries are read whole, unless the reader has been put
+// in sites only mode.
+void vcfstage_run_sorted(VcfStage *stage, LineReader *rdr, VcfSorter *vs);
+
+// contig_func for contigpool_run(), arg is an array of VcfStage pointers, one
+// chain per worker
+void vcfstage_run_contig(size_t worker, const char *contig,
+                         LineReader *rdr, LineWriter *wtr, void *arg);
+
+// batch_func and batch_cut for pipeline_run(), arg as for
+// vcfstage_run_contig(). Each batch is flushed at the end, so the first stage
+// must have a cut function.
+void vcfstage_run_batch(size_t worker, LineBatch *batch, void *arg);
+size_t vcfstage_cut(const char *block, size_t len, size_t *scanned,
+                    void *arg);
+
+// Used by the ref stage and vcfref's worker threads on entries, rec holds the
+// columns of line. Returns 1 if the entry should be kept. Swaps alleles in
+// place, updating rec.
+char ref_filter_line(LineSpan *line, VcfRecord *rec, GenomeCursor *gc,
+                     Genome *genome, char swap_alleles);
+
+// As ref_filter_line() for a BCF record, which is only unpacked as far as
+// REF and ALT. Swapped alleles are updated in the record.
+char ref_filter_rec(bcf1_t *rec, const bcf_hdr_t *hdr, GenomeCursor *gc,
+                    Genome *genome, char swap_alleles);
+
+#endif /* VCF_STAGE_H_ */